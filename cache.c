@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* longest key (request target and varied headers) that is cached */
+#define CACHE_KEY_MAX   2048
+/* initial number of hashmap buckets of a thread's cache */
+#define CACHE_SIZE      256
+/* status line of ce_304 */
+#define CACHE_304       "HTTP/1.1 304 Not Modified\r\n"
+
+/* stored response */
+struct cache_entry {
+        /* request target and varied header values (key in cl_map) */
+        char                    *ce_key;
+        /* response with ETag added and Date left out (added when sent) */
+        char                    *ce_resp;
+        /* length of ce_resp */
+        size_t                  ce_len;
+        /* length of the header block of ce_resp (for HEAD) */
+        size_t                  ce_hdrlen;
+        /* length of the status line of ce_resp (Date goes after it) */
+        size_t                  ce_linelen;
+        /* prebuilt "304 Not Modified", Date left out as well */
+        char                    *ce_304;
+        /* length of ce_304 */
+        size_t                  ce_304len;
+        /* quoted strong ETag */
+        char                    ce_etag[20];
+        /* ms (CLOCK_MONOTONIC_COARSE) the entry is stale after */
+        uint64_t                ce_expires;
+        /* bytes counted against the budget */
+        size_t                  ce_size;
+        /* neighbours on the lru list */
+        struct cache_entry      *ce_prev;
+        struct cache_entry      *ce_next;
+};
+
+/* lru list of responses, one per thread */
+struct cache_lru {
+        /* ce_key to struct cache_entry */
+        struct hashmap          *cl_map;
+        /* most recently used entry */
+        struct cache_entry      *cl_first;
+        /* least recently used entry (evicted first) */
+        struct cache_entry      *cl_last;
+        /* sum of ce_size of all entries */
+        size_t                  cl_bytes;
+        /*
+         * key of the request cache_serve() last missed, for cache_store()
+         * (taken before the handler can split the query), or ""
+         */
+        char                    cl_key[CACHE_KEY_MAX];
+};
+
+static void cache_lru_free(void *arg);
+
+struct cache *
+cache_new(size_t budget)
+{
+        struct cache    *ca = NULL;
+
+        ca = malloc(sizeof(*ca));
+        if (ca == NULL)
+                return NULL;
+
+        /* caches of loop threads are freed when the threads exit */
+        errno = pthread_key_create(&ca->ca_key, cache_lru_free);
+        if (errno != 0) {
+                free(ca);
+                return NULL;
+        }
+
+        ca->ca_budget = budget;
+        return ca;
+}
+
+void
+cache_free(struct cache **cap)
+{
+        struct cache    *ca = *cap;
+
+        if (ca == NULL)
+                return;
+
+        /* the calling thread's cache, others went with their threads */
+        cache_lru_free(pthread_getspecific(ca->ca_key));
+        (void)pthread_key_delete(ca->ca_key);
+        free(ca);
+        *cap = NULL;
+}
+
+static void
+cache_entry_free(struct cache_entry *ce)
+{
+        free(ce->ce_key);
+        free(ce->ce_resp);
+        free(ce->ce_304);
+        free(ce);
+}
+
+static void
+cache_lru_free(void *arg)
+{
+        struct cache_lru        *cl = arg;
+        struct cache_entry      *ce = NULL;
+        struct cache_entry      *next = NULL;
+
+        if (cl == NULL)
+                return;
+
+        for (ce = cl->cl_first; ce != NULL; ce = next) {
+                next = ce->ce_next;
+                cache_entry_free(ce);
+        }
+
+        (void)hashmap_free(&cl->cl_map);
+        free(cl);
+}
+
+static struct cache_lru *
+cache_lru_get(struct cache *ca)
+{
+        struct cache_lru        *cl = NULL;
+
+        cl = pthread_getspecific(ca->ca_key);
+        if (cl != NULL)
+                return cl;
+
+        cl = calloc(1, sizeof(*cl));
+        if (cl == NULL)
+                return NULL;
+
+        cl->cl_map = hashmap_new(CACHE_SIZE);
+        if (cl->cl_map == NULL) {
+                free(cl);
+                return NULL;
+        }
+
+        errno = pthread_setspecific(ca->ca_key, cl);
+        if (errno != 0) {
+                cache_lru_free(cl);
+                return NULL;
+        }
+
+        return cl;
+}
+
+static void
+cache_unlink(struct cache_lru *cl, struct cache_entry *ce)
+{
+        if (ce->ce_prev != NULL)
+                ce->ce_prev->ce_next = ce->ce_next;
+        else
+                cl->cl_first = ce->ce_next;
+        if (ce->ce_next != NULL)
+                ce->ce_next->ce_prev = ce->ce_prev;
+        else
+                cl->cl_last = ce->ce_prev;
+}
+
+static void
+cache_push(struct cache_lru *cl, struct cache_entry *ce)
+{
+        ce->ce_prev = NULL;
+        ce->ce_next = cl->cl_first;
+        if (cl->cl_first != NULL)
+                cl->cl_first->ce_prev = ce;
+        else
+                cl->cl_last = ce;
+        cl->cl_first = ce;
+}
+
+static void
+cache_remove(struct cache_lru *cl, struct cache_entry *ce)
+{
+        (void)hashmap_del(cl->cl_map, ce->ce_key);
+        cache_unlink(cl, ce);
+        cl->cl_bytes -= ce->ce_size;
+        cache_entry_free(ce);
+}
+
+/* the coarse clock is read without entering the kernel */
+static uint64_t
+cache_now(void)
+{
+        struct timespec ts;
+
+        (void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* request target and the values of the headers the response varies on */
+static int
+cache_key(struct http_request *req, char *key, size_t size)
+{
+        uint64_t        vary = req->rq_handler->hh_vary;
+        const char      *coding = NULL;
+        const char      *value = NULL;
+        size_t          len = req->rq_resource.hv_len;
+        size_t          n;
+        unsigned        h;
+
+        /* a split query is rewritten in place, it is not the target */
+        if (req->rq_split || len >= size)
+                return -1;
+        memcpy(key, http_request_str(req, req->rq_resource), len);
+        /* the '?' is a nul since the path was terminated */
+        if (req->rq_path.hv_len < len)
+                key[req->rq_path.hv_len] = '?';
+
+        /* the response may be compressed for what the client accepts */
+        coding = http_request_accepts(req, "gzip") ? "\ngzip" :
+                 http_request_accepts(req, "deflate") ? "\ndeflate" : "\n";
+        n = strlen(coding);
+        if (len + n >= size)
+                return -1;
+        memcpy(key + len, coding, n);
+        len += n;
+
+        for (h = 0; h < HTTP_HDR_OTHER; ++h) {
+                if (!(vary & HTTP_HEADER_BIT(h)))
+                        continue;
+
+                value = http_request_known(req, h);
+                if (value == NULL)
+                        value = "";
+                n = strlen(value);
+                if (len + 1 + n >= size)
+                        return -1;
+
+                /* values have no control bytes, so '\n' separates them */
+                key[len++] = '\n';
+                memcpy(key + len, value, n);
+                len += n;
+        }
+
+        key[len] = '\0';
+        return 0;
+}
+
+/* whether If-None-Match names etag (or is "*") */
+static int
+cache_match(const char *inm, const char *etag)
+{
+        return strcmp(inm, "*") == 0 || strstr(inm, etag) != NULL;
+}
+
+/* answer a request with an entry: 304, header block (HEAD) or response */
+static void
+cache_send(struct http_request *req, const struct cache_entry *ce)
+{
+        struct iobuf    *ip = req->rq_buf;
+        const char      *inm = NULL;
+        const char      *resp = NULL;
+        const char      *date = NULL;
+        size_t          linelen;
+        size_t          datelen;
+        size_t          len;
+
+        inm = http_request_known(req, HTTP_HDR_IF_NONE_MATCH);
+        if (inm != NULL && cache_match(inm, ce->ce_etag)) {
+                resp = ce->ce_304;
+                len = ce->ce_304len;
+                linelen = sizeof(CACHE_304) - 1;
+        } else {
+                resp = ce->ce_resp;
+                len = req->rq_methodid == HTTP_METHOD_HEAD ? ce->ce_hdrlen :
+                                                             ce->ce_len;
+                linelen = ce->ce_linelen;
+        }
+
+        /* copied, as the entry may be evicted before the queue is sent */
+        date = http_response_date(&datelen);
+        (void)iobuf_write(ip, resp, linelen);
+        (void)iobuf_write(ip, date, datelen);
+        (void)iobuf_write(ip, resp + linelen, len - linelen);
+}
+
+int
+cache_serve(struct cache *ca, struct http_request *req)
+{
+        struct cache_lru        *cl = NULL;
+        struct cache_entry      *ce = NULL;
+        struct hash_entry       *ep = NULL;
+
+        if (ca->ca_budget == 0)
+                return 0;
+
+        cl = cache_lru_get(ca);
+        if (cl == NULL)
+                return 0;
+        if (cache_key(req, cl->cl_key, sizeof(cl->cl_key)) < 0) {
+                cl->cl_key[0] = '\0';
+                return 0;
+        }
+
+        ep = hashmap_get(cl->cl_map, cl->cl_key);
+        if (ep == NULL)
+                return 0;
+
+        ce = ep->he_value;
+        if (cache_now() >= ce->ce_expires) {
+                cache_remove(cl, ce);
+                return 0;
+        }
+
+        cl->cl_key[0] = '\0';
+        cache_unlink(cl, ce);
+        cache_push(cl, ce);
+        cache_send(req, ce);
+        return 1;
+}
+
+/* strong validator of a body (64 bit FNV-1a) */
+static uint64_t
+cache_hash(const char *p, size_t len)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL;
+        size_t          i;
+
+        for (i = 0; i < len; ++i) {
+                h ^= (unsigned char)p[i];
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+/* whether a header line (of len bytes) has a name ("Name:") */
+static int
+cache_header_is(const char *line, size_t len, const char *name)
+{
+        size_t  n = strlen(name);
+
+        return len > n && strncasecmp(line, name, n) == 0;
+}
+
+/* whether a header block has an ETag line */
+static int
+cache_has_etag(const char *p, size_t len)
+{
+        const char      *end = p + len;
+
+        while ((p = memmem(p, end - p, "\r\n", 2)) != NULL) {
+                p += 2;
+                if (cache_header_is(p, end - p, "ETag:"))
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* whether a 304 repeats a header line of the 200 (RFC 9110 15.4.5) */
+static int
+cache_header_kept(const char *line, size_t len)
+{
+        return cache_header_is(line, len, "Cache-Control:") ||
+               cache_header_is(line, len, "Content-Location:") ||
+               cache_header_is(line, len, "Expires:") ||
+               cache_header_is(line, len, "Vary:");
+}
+
+/* build an entry from a response captured from the output queue */
+static struct cache_entry *
+cache_entry_new(const char *key, const char *resp, size_t len)
+{
+        struct cache_entry      *ce = NULL;
+        const char              *end = NULL;
+        const char              *line = NULL;
+        const char              *eol = NULL;
+        char                    *p = NULL;
+        char                    *q = NULL;
+        char                    etag[32];
+        size_t                  hdrlen;
+        size_t                  taglen;
+        size_t                  n;
+
+        /* only complete "200 OK"s without a validator of their own */
+        if (len < 13 || memcmp(resp, "HTTP/1.1 200 ", 13) != 0)
+                return NULL;
+        end = memmem(resp, len, "\r\n\r\n", 4);
+        if (end == NULL)
+                return NULL;
+        hdrlen = end + 2 - resp;
+        if (cache_has_etag(resp, hdrlen))
+                return NULL;
+
+        ce = calloc(1, sizeof(*ce));
+        if (ce == NULL)
+                return NULL;
+
+        ce->ce_key = strdup(key);
+        if (ce->ce_key == NULL)
+                goto free_ce;
+
+        (void)snprintf(ce->ce_etag, sizeof(ce->ce_etag), "\"%016" PRIx64 "\"",
+                       cache_hash(end + 4, resp + len - (end + 4)));
+        taglen = snprintf(etag, sizeof(etag), "ETag: %s\r\n", ce->ce_etag);
+
+        /* at most the response with ETag, and a 304 of its header lines */
+        ce->ce_resp = malloc(len + taglen);
+        if (ce->ce_resp == NULL)
+                goto free_key;
+        ce->ce_304 = malloc(sizeof(CACHE_304) - 1 + hdrlen + taglen + 2);
+        if (ce->ce_304 == NULL)
+                goto free_resp;
+
+        eol = memmem(resp, hdrlen, "\r\n", 2);
+        ce->ce_linelen = eol + 2 - resp;
+        memcpy(ce->ce_resp, resp, ce->ce_linelen);
+        p = ce->ce_resp + ce->ce_linelen;
+        memcpy(ce->ce_304, CACHE_304, sizeof(CACHE_304) - 1);
+        q = ce->ce_304 + sizeof(CACHE_304) - 1;
+
+        /* Date is added when sent, the 304 gets the validator headers */
+        for (line = eol + 2; line < resp + hdrlen; line = eol + 2) {
+                eol = memmem(line, resp + hdrlen - line, "\r\n", 2);
+                n = eol + 2 - line;
+                if (cache_header_is(line, n, "Date:"))
+                        continue;
+                memcpy(p, line, n);
+                p += n;
+                if (cache_header_kept(line, n)) {
+                        memcpy(q, line, n);
+                        q += n;
+                }
+        }
+
+        /* the header block up to its last line, ETag, then the rest */
+        memcpy(p, etag, taglen);
+        p += taglen;
+        ce->ce_hdrlen = p + 2 - ce->ce_resp;
+        memcpy(p, resp + hdrlen, len - hdrlen);
+        ce->ce_len = p + len - hdrlen - ce->ce_resp;
+
+        memcpy(q, etag, taglen);
+        q += taglen;
+        memcpy(q, "\r\n", 2);
+        ce->ce_304len = q + 2 - ce->ce_304;
+
+        ce->ce_size = sizeof(*ce) + strlen(key) + 1 + ce->ce_len +
+                      ce->ce_304len;
+        return ce;
+free_resp:
+        free(ce->ce_resp);
+free_key:
+        free(ce->ce_key);
+free_ce:
+        free(ce);
+        return NULL;
+}
+
+void
+cache_capture(struct cache *ca, struct http_request *req)
+{
+        struct cache_lru        *cl = NULL;
+
+        if (ca->ca_budget <= 1 || req->rq_methodid != HTTP_METHOD_GET)
+                return;
+
+        /* no key from cache_serve(), nothing to store it under */
+        cl = cache_lru_get(ca);
+        if (cl == NULL || cl->cl_key[0] == '\0')
+                return;
+
+        /* a response that goes out while queued is still stored whole */
+        (void)iobuf_capture(req->rq_buf, ca->ca_budget - 1);
+}
+
+void
+cache_store(struct cache *ca,
+            struct http_request *req,
+            size_t outlen,
+            unsigned long long nsent)
+{
+        struct iobuf            *ip = req->rq_buf;
+        struct cache_lru        *cl = NULL;
+        struct cache_entry      *ce = NULL;
+        struct hash_entry       *ep = NULL;
+        char                    *resp = NULL;
+        size_t                  len;
+
+        /* not captured, or more than the budget (or a file) was queued */
+        if (ip->ib_cap == NULL)
+                return;
+        resp = iobuf_capture_end(ip, &len);
+        if (resp == NULL)
+                return;
+
+        /* the key cache_serve() missed, the query may be split by now */
+        cl = cache_lru_get(ca);
+        if (cl != NULL && cl->cl_key[0] != '\0')
+                ce = cache_entry_new(cl->cl_key, resp, len);
+        free(resp);
+        if (ce == NULL)
+                return;
+        cl->cl_key[0] = '\0';
+
+        ce->ce_expires = cache_now() + req->rq_handler->hh_cache_ttl;
+        ep = hashmap_get(cl->cl_map, ce->ce_key);
+        if (ep != NULL)
+                cache_remove(cl, ep->he_value);
+        if (hashmap_set(cl->cl_map, ce->ce_key, ce) == NULL) {
+                cache_entry_free(ce);
+                return;
+        }
+        cache_push(cl, ce);
+        cl->cl_bytes += ce->ce_size;
+
+        /*
+         * the first request gets the ETag (or the 304) like later ones,
+         * unless some of its response was written meanwhile
+         */
+        if (ip->ib_nsent == nsent && ip->ib_outlen - outlen == len &&
+            iobuf_truncate_out(ip, outlen) == 0)
+                cache_send(req, ce);
+
+        while (cl->cl_bytes > ca->ca_budget && cl->cl_last != ce)
+                cache_remove(cl, cl->cl_last);
+}
@@ -0,0 +1,84 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "http.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * response cache of a server: each thread keeps its own lru list of
+ * responses (so nothing is locked), all with the same byte budget
+ */
+struct cache {
+        /* each thread's struct cache_lru */
+        pthread_key_t   ca_key;
+        /* bytes of responses a thread keeps (zero disables the cache) */
+        size_t          ca_budget;
+};
+
+/**
+ * Create a response cache:
+ *
+ * args:
+ *      @budget:        bytes of responses each thread keeps
+ * ret:
+ *      @success:       pointer to new cache
+ *      @failure:       NULL and errno set
+ */
+extern struct cache *cache_new(size_t budget);
+
+/**
+ * Answer a GET or HEAD request from the cache: with the prebuilt "304
+ * Not Modified" if If-None-Match names the entry's ETag, else with the
+ * stored response (its header block for HEAD), either with a fresh Date;
+ * on a miss, keep the key for cache_store(), the handler may split the
+ * query it is made of (a request whose query is split is not cached):
+ *
+ * args:
+ *      @ca:    pointer to cache
+ *      @req:   request for a route whose handler sets hh_cache_ttl
+ * ret:
+ *      1 if the request is answered, 0 if the handler has to run
+ */
+extern int cache_serve(struct cache *ca, struct http_request *req);
+
+/**
+ * Start copying the output queued for a GET request (up to the budget)
+ * that cache_serve() just missed, for cache_store() to keep once the
+ * handler has run:
+ *
+ * args:
+ *      @ca:    pointer to cache
+ *      @req:   request about to be handled
+ */
+extern void cache_capture(struct cache *ca, struct http_request *req);
+
+/**
+ * Store the response captured since cache_capture() under the key
+ * cache_serve() missed, if it is a "200 OK" with no ETag of its own, with
+ * a strong ETag of its body added and its Date left out; if none of it
+ * was written yet, queue it again that way (or the prebuilt "304 Not
+ * Modified" if If-None-Match names it):
+ *
+ * args:
+ *      @ca:            pointer to cache
+ *      @req:           request just handled
+ *      @outlen:        req->rq_buf->ib_outlen before the handler ran
+ *      @nsent:         req->rq_buf->ib_nsent before the handler ran
+ */
+extern void cache_store(struct cache *ca,
+                        struct http_request *req,
+                        size_t outlen,
+                        unsigned long long nsent);
+
+/**
+ * Free a response cache (with the calling thread's responses, other
+ * threads free theirs when they exit):
+ *
+ * args:
+ *      @cap:   pointer to pointer to cache
+ */
+extern void cache_free(struct cache **cap);
+
+#endif
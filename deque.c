@@ -0,0 +1,175 @@
+#include "deque.h"
+
+struct deque *
+deque_new(size_t size)
+{
+        struct deque    *dp = NULL;
+        size_t          cap;
+        size_t          i;
+
+        if (size == 0)
+                size = 256;
+
+        for (cap = 1; cap < size; cap <<= 1)
+                ;
+
+        dp = malloc(sizeof(*dp));
+        if (dp == NULL)
+                return NULL;
+
+        dp->dq_arr = malloc(cap * sizeof(*dp->dq_arr));
+        if (dp->dq_arr == NULL) {
+                free(dp);
+                return NULL;
+        }
+
+        for (i = 0; i < cap; ++i)
+                atomic_init(&dp->dq_arr[i], NULL);
+        atomic_init(&dp->dq_top, 0);
+        atomic_init(&dp->dq_bottom, 0);
+        dp->dq_mask = cap - 1;
+        return dp;
+}
+
+static int deque_sanity(const struct deque *dp);
+
+int
+deque_push(struct deque *dp, void *p)
+{
+        long    bottom;
+        long    top;
+
+        if (deque_sanity(dp) < 0)
+                return -1;
+
+        if (p == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        bottom = atomic_load_explicit(&dp->dq_bottom, memory_order_relaxed);
+        top = atomic_load_explicit(&dp->dq_top, memory_order_acquire);
+        if (bottom - top > dp->dq_mask) {
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        /* release: a thief that sees the new bottom also sees p */
+        atomic_store_explicit(&dp->dq_arr[bottom & dp->dq_mask], p,
+                              memory_order_relaxed);
+        atomic_store_explicit(&dp->dq_bottom, bottom + 1,
+                              memory_order_release);
+        return 0;
+}
+
+static int
+deque_sanity(const struct deque *dp)
+{
+        errno = EINVAL;
+        if (dp == NULL)
+                return -1;
+        if (dp->dq_arr == NULL)
+                return -1;
+        errno = 0;
+        return 0;
+}
+
+void *
+deque_pop(struct deque *dp)
+{
+        long    bottom;
+        long    top;
+        void    *p = NULL;
+
+        if (deque_sanity(dp) < 0)
+                return NULL;
+
+        bottom = atomic_load_explicit(&dp->dq_bottom,
+                                      memory_order_relaxed) - 1;
+        atomic_store_explicit(&dp->dq_bottom, bottom, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        top = atomic_load_explicit(&dp->dq_top, memory_order_relaxed);
+
+        if (top > bottom) {
+                /* empty */
+                atomic_store_explicit(&dp->dq_bottom, bottom + 1,
+                                      memory_order_relaxed);
+                return NULL;
+        }
+
+        p = atomic_load_explicit(&dp->dq_arr[bottom & dp->dq_mask],
+                                 memory_order_relaxed);
+        if (top != bottom)
+                return p;
+
+        /* last entry, race thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&dp->dq_top, &top,
+                                                     top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+                p = NULL;
+        atomic_store_explicit(&dp->dq_bottom, bottom + 1,
+                              memory_order_relaxed);
+        return p;
+}
+
+void *
+deque_steal(struct deque *dp)
+{
+        long    bottom;
+        long    top;
+        void    *p = NULL;
+
+        if (deque_sanity(dp) < 0)
+                return NULL;
+
+        top = atomic_load_explicit(&dp->dq_top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        bottom = atomic_load_explicit(&dp->dq_bottom, memory_order_acquire);
+        if (top >= bottom)
+                return NULL;
+
+        p = atomic_load_explicit(&dp->dq_arr[top & dp->dq_mask],
+                                 memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&dp->dq_top, &top,
+                                                     top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+                return NULL;
+
+        return p;
+}
+
+size_t
+deque_size(struct deque *dp)
+{
+        long    bottom;
+        long    top;
+
+        if (deque_sanity(dp) < 0)
+                return 0;
+
+        bottom = atomic_load_explicit(&dp->dq_bottom, memory_order_relaxed);
+        top = atomic_load_explicit(&dp->dq_top, memory_order_relaxed);
+        return bottom > top ? bottom - top : 0;
+}
+
+int
+deque_free(struct deque **dpp)
+{
+        struct deque    *dp = NULL;
+
+        if (dpp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        dp = *dpp;
+        if (deque_sanity(dp) < 0)
+                return -1;
+
+        free(dp->dq_arr);
+        free(dp);
+        *dpp = NULL;
+        return 0;
+}
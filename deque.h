@@ -0,0 +1,89 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * fixed capacity work-stealing deque (Chase-Lev): the owning thread
+ * pushes and pops at the bottom, any other thread steals from the top
+ */
+struct deque {
+        /* next slot to steal from */
+        atomic_long             dq_top;
+        /* next slot to push to */
+        atomic_long             dq_bottom;
+        /* capacity - 1 (capacity is a power of two) */
+        long                    dq_mask;
+        /* ring of entries */
+        _Atomic(void *)         *dq_arr;
+};
+
+/**
+ * Create a new deque:
+ *
+ * args:
+ *      @size:  capacity (rounded up to a power of two, zero for default)
+ * ret:
+ *      @success:       pointer to new deque
+ *      @failure:       NULL and errno set
+ */
+extern struct deque *deque_new(size_t size);
+
+/**
+ * Push an entry onto bottom of deque (owner only):
+ *
+ * args:
+ *      @dp:    pointer to deque
+ *      @p:     entry (must not be NULL)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOBUFS if deque is full)
+ */
+extern int deque_push(struct deque *dp, void *p);
+
+/**
+ * Pop an entry from bottom of deque (owner only):
+ *
+ * args:
+ *      @dp:    pointer to deque
+ * ret:
+ *      @success:       entry
+ *      @failure:       NULL if deque is empty
+ */
+extern void *deque_pop(struct deque *dp);
+
+/**
+ * Steal an entry from top of deque (any thread):
+ *
+ * args:
+ *      @dp:    pointer to deque
+ * ret:
+ *      @success:       entry
+ *      @failure:       NULL if deque is empty or another thread won
+ */
+extern void *deque_steal(struct deque *dp);
+
+/**
+ * Number of entries in deque (a snapshot when called by non-owners):
+ *
+ * args:
+ *      @dp:    pointer to deque
+ * ret:
+ *      number of entries
+ */
+extern size_t deque_size(struct deque *dp);
+
+/**
+ * Free a deque:
+ *
+ * args:
+ *      @dpp:   pointer to pointer to deque
+ * ret:
+ *      @success:       0 and *dpp set to NULL
+ *      @failure:       -1 and errno set
+ */
+extern int deque_free(struct deque **dpp);
+
+#endif
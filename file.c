@@ -0,0 +1,807 @@
+#define _GNU_SOURCE
+#include "file.h"
+#include "gzip.h"
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* open files kept per thread */
+#define FILE_CACHE_SIZE         256
+/* milliseconds between checks for inotify events */
+#define FILE_CACHE_POLL         100
+/* largest file compressed at startup */
+#define FILE_GZ_MAX             (16 << 20)
+/* deepest directory searched for files to compress */
+#define FILE_GZ_DEPTH           16
+
+/* directory served by a file handler */
+struct file_root {
+        /* directory file descriptor, paths are opened relative to it */
+        int             fr_dirfd;
+        /* absolute path of directory (inotify watches need paths) */
+        char            *fr_dir;
+        /* each thread's struct file_cache */
+        pthread_key_t   fr_key;
+        /*
+         * path to struct file_gz, built before serving and read-only
+         * after, so every thread and forked child shares it
+         */
+        struct hashmap  *fr_gz;
+};
+
+/* gzip coded copy of a file, made (or found on disk) at startup */
+struct file_gz {
+        /* path below the served directory (key in fr_gz) */
+        char            *fg_path;
+        /* "<path>.gz" on disk or a memfd, sent with sendfile() */
+        int             fg_fd;
+        /* size of the coded file */
+        off_t           fg_size;
+        /* file coded, a changed file is sent uncoded until restart */
+        ino_t           fg_ino;
+        off_t           fg_srcsize;
+        time_t          fg_mtime;
+};
+
+/* open file with everything needed to answer a request for it */
+struct file_entry {
+        /* path below the served directory (key in fc_map) */
+        char                    *fe_path;
+        /* open file descriptor */
+        int                     fe_fd;
+        /* fstat() of fe_fd */
+        struct stat             fe_st;
+        /* strong validator, "<mtime>-<size>" in hex and quoted */
+        char                    fe_etag[40];
+        /* response header block (status line to empty line) */
+        char                    *fe_hdr;
+        /* length of fe_hdr */
+        size_t                  fe_hdrlen;
+        /* gzip coded copy in fr_gz (or NULL, then the rest is unset) */
+        const struct file_gz    *fe_gz;
+        /* validator of the coded copy (fe_etag with "-gz" added) */
+        char                    fe_gzetag[44];
+        /* response header block for the coded copy */
+        char                    *fe_gzhdr;
+        /* length of fe_gzhdr */
+        size_t                  fe_gzhdrlen;
+        /* inotify watch on the file (-1 if entry is not cached) */
+        int                     fe_wd;
+        /* neighbours on the lru list */
+        struct file_entry       *fe_prev;
+        struct file_entry       *fe_next;
+};
+
+/* bounded lru cache of open files, one per thread */
+struct file_cache {
+        /* fe_path to struct file_entry */
+        struct hashmap          *fc_map;
+        /* most recently used entry */
+        struct file_entry       *fc_first;
+        /* least recently used entry (evicted first) */
+        struct file_entry       *fc_last;
+        /* number of cached entries */
+        size_t                  fc_count;
+        /* inotify instance (-1 if unavailable, then nothing is cached) */
+        int                     fc_inotifyfd;
+        /* CLOCK_MONOTONIC_COARSE milliseconds of last inotify check */
+        uint64_t                fc_polled;
+};
+
+static const char file_404[] = "HTTP/1.1 404 Not Found\r\n"
+                               "Content-Length: 0\r\n"
+                               "\r\n";
+
+/* content types by file extension */
+static const struct {
+        const char      *ft_ext;
+        const char      *ft_type;
+} file_types[] = {
+        { "html",       "text/html" },
+        { "htm",        "text/html" },
+        { "css",        "text/css" },
+        { "js",         "text/javascript" },
+        { "json",       "application/json" },
+        { "txt",        "text/plain" },
+        { "xml",        "application/xml" },
+        { "svg",        "image/svg+xml" },
+        { "png",        "image/png" },
+        { "jpg",        "image/jpeg" },
+        { "jpeg",       "image/jpeg" },
+        { "gif",        "image/gif" },
+        { "webp",       "image/webp" },
+        { "ico",        "image/x-icon" },
+        { "wasm",       "application/wasm" },
+        { "pdf",        "application/pdf" },
+};
+
+static void file_serve(struct http_request *req, struct http_response *res);
+static void file_root_free(void *arg);
+static void file_cache_free(void *arg);
+static void file_gz_scan(struct file_root *fr,
+                         int dirfd,
+                         const char *prefix,
+                         int depth);
+static void file_gz_free(struct hash_entry *ep);
+
+struct http_handler *
+file_handler_new(const char *dir)
+{
+        struct http_handler     *hdlr = NULL;
+        struct file_root        *fr = NULL;
+
+        if (dir == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        fr = malloc(sizeof(*fr));
+        if (fr == NULL)
+                return NULL;
+
+        fr->fr_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fr->fr_dirfd < 0)
+                goto free_fr;
+
+        fr->fr_dir = realpath(dir, NULL);
+        if (fr->fr_dir == NULL)
+                goto close_dir;
+
+        /* caches of loop threads are freed when the threads exit */
+        errno = pthread_key_create(&fr->fr_key, file_cache_free);
+        if (errno != 0)
+                goto free_dir;
+
+        fr->fr_gz = hashmap_new(FILE_CACHE_SIZE);
+        if (fr->fr_gz == NULL)
+                goto delete_key;
+
+        /* compressed once here, so no request spends CPU on it */
+        file_gz_scan(fr, dup(fr->fr_dirfd), "", 0);
+
+        hdlr = calloc(1, sizeof(*hdlr));
+        if (hdlr == NULL)
+                goto free_gz;
+
+        hdlr->hh_fn = file_serve;
+        hdlr->hh_arg = fr;
+        hdlr->hh_free = file_root_free;
+        hdlr->hh_prefix = 1;
+        hdlr->hh_methods = HTTP_METHOD_BIT(HTTP_METHOD_GET) |
+                           HTTP_METHOD_BIT(HTTP_METHOD_HEAD);
+        return hdlr;
+free_gz:
+        (void)hashmap_for(fr->fr_gz, file_gz_free);
+        (void)hashmap_free(&fr->fr_gz);
+delete_key:
+        (void)pthread_key_delete(fr->fr_key);
+free_dir:
+        free(fr->fr_dir);
+close_dir:
+        (void)close(fr->fr_dirfd);
+free_fr:
+        free(fr);
+        return NULL;
+}
+
+static void
+file_root_free(void *arg)
+{
+        struct file_root        *fr = arg;
+
+        /* the calling thread's cache, others went with their threads */
+        file_cache_free(pthread_getspecific(fr->fr_key));
+        (void)pthread_key_delete(fr->fr_key);
+        (void)hashmap_for(fr->fr_gz, file_gz_free);
+        (void)hashmap_free(&fr->fr_gz);
+        (void)close(fr->fr_dirfd);
+        free(fr->fr_dir);
+        free(fr);
+}
+
+static const char *file_type(const char *path);
+
+/* find or make the gzip coded copy of a file */
+static void
+file_gz_add(struct file_root *fr, const char *path, const struct stat *st)
+{
+        struct file_gz  *fg = NULL;
+        struct stat     gzst;
+        char            gzpath[PATH_MAX];
+        int             fd;
+
+        if (!gzip_type(file_type(path)) || st->st_size < GZIP_MIN ||
+            st->st_size > FILE_GZ_MAX)
+                return;
+
+        fg = calloc(1, sizeof(*fg));
+        if (fg == NULL)
+                return;
+        fg->fg_ino = st->st_ino;
+        fg->fg_srcsize = st->st_size;
+        fg->fg_mtime = st->st_mtime;
+
+        fg->fg_path = strdup(path);
+        if (fg->fg_path == NULL)
+                goto free_fg;
+
+        /* a "<path>.gz" at least as new as the file is used as is */
+        fg->fg_fd = -1;
+        if (snprintf(gzpath, sizeof(gzpath), "%s.gz", path) <
+            (int)sizeof(gzpath))
+                fg->fg_fd = openat(fr->fr_dirfd, gzpath,
+                                   O_RDONLY | O_CLOEXEC);
+        if (fg->fg_fd >= 0 &&
+            (fstat(fg->fg_fd, &gzst) < 0 || !S_ISREG(gzst.st_mode) ||
+             gzst.st_mtime < st->st_mtime)) {
+                (void)close(fg->fg_fd);
+                fg->fg_fd = -1;
+        }
+
+        if (fg->fg_fd >= 0) {
+                fg->fg_size = gzst.st_size;
+        } else {
+                fd = openat(fr->fr_dirfd, path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                        goto free_path;
+                fg->fg_fd = gzip_file(fd, &fg->fg_size);
+                (void)close(fd);
+                if (fg->fg_fd < 0) {
+                        warn("gzip_file(%s)", path);
+                        goto free_path;
+                }
+        }
+
+        /* not worth a second copy */
+        if (fg->fg_size >= st->st_size)
+                goto close_fd;
+
+        if (hashmap_set(fr->fr_gz, fg->fg_path, fg) == NULL)
+                goto close_fd;
+        return;
+close_fd:
+        (void)close(fg->fg_fd);
+free_path:
+        free(fg->fg_path);
+free_fg:
+        free(fg);
+}
+
+/* walk a directory (taking over dirfd), adding the copy of each file */
+static void
+file_gz_scan(struct file_root *fr, int dirfd, const char *prefix, int depth)
+{
+        struct dirent   *de = NULL;
+        struct stat     st;
+        DIR             *dir = NULL;
+        char            path[PATH_MAX];
+        int             fd;
+
+        if (dirfd < 0)
+                return;
+
+        dir = fdopendir(dirfd);
+        if (dir == NULL) {
+                (void)close(dirfd);
+                return;
+        }
+
+        while ((de = readdir(dir)) != NULL) {
+                if (strcmp(de->d_name, ".") == 0 ||
+                    strcmp(de->d_name, "..") == 0)
+                        continue;
+                if (snprintf(path, sizeof(path), "%s%s", prefix,
+                             de->d_name) >= (int)sizeof(path))
+                        continue;
+                if (fstatat(fr->fr_dirfd, path, &st, 0) < 0)
+                        continue;
+
+                if (S_ISREG(st.st_mode)) {
+                        file_gz_add(fr, path, &st);
+                        continue;
+                }
+
+                /* linked directories are skipped, they could loop */
+                if (!S_ISDIR(st.st_mode) || depth >= FILE_GZ_DEPTH ||
+                    strlen(path) + 2 > sizeof(path))
+                        continue;
+                fd = openat(fr->fr_dirfd, path,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                (void)strcat(path, "/");
+                file_gz_scan(fr, fd, path, depth + 1);
+        }
+
+        (void)closedir(dir);
+}
+
+static void
+file_gz_free(struct hash_entry *ep)
+{
+        struct file_gz  *fg = ep->he_value;
+
+        (void)close(fg->fg_fd);
+        free(fg->fg_path);
+        free(fg);
+}
+
+static void file_entry_free(struct file_entry *fe);
+
+static void
+file_cache_free(void *arg)
+{
+        struct file_cache       *fc = arg;
+        struct file_entry       *fe = NULL;
+        struct file_entry       *next = NULL;
+
+        if (fc == NULL)
+                return;
+
+        for (fe = fc->fc_first; fe != NULL; fe = next) {
+                next = fe->fe_next;
+                file_entry_free(fe);
+        }
+
+        if (fc->fc_inotifyfd >= 0)
+                (void)close(fc->fc_inotifyfd);
+        (void)hashmap_free(&fc->fc_map);
+        free(fc);
+}
+
+static void
+file_entry_free(struct file_entry *fe)
+{
+        (void)close(fe->fe_fd);
+        free(fe->fe_path);
+        free(fe->fe_hdr);
+        free(fe->fe_gzhdr);
+        free(fe);
+}
+
+static struct file_cache *
+file_cache_get(struct file_root *fr)
+{
+        struct file_cache       *fc = NULL;
+
+        fc = pthread_getspecific(fr->fr_key);
+        if (fc != NULL)
+                return fc;
+
+        fc = calloc(1, sizeof(*fc));
+        if (fc == NULL)
+                return NULL;
+
+        fc->fc_map = hashmap_new(FILE_CACHE_SIZE);
+        if (fc->fc_map == NULL) {
+                free(fc);
+                return NULL;
+        }
+
+        fc->fc_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fc->fc_inotifyfd < 0)
+                warn("inotify_init1(): serving files uncached");
+
+        errno = pthread_setspecific(fr->fr_key, fc);
+        if (errno != 0) {
+                file_cache_free(fc);
+                return NULL;
+        }
+
+        return fc;
+}
+
+static int
+file_cache_shared(struct file_cache *fc, struct file_entry *fe, int wd)
+{
+        struct file_entry       *p = NULL;
+
+        /* paths naming the same inode get the same watch */
+        for (p = fc->fc_first; p != NULL; p = p->fe_next) {
+                if (p != fe && p->fe_wd == wd)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* take an entry out of the cache and free it, its watch left alone */
+static void
+file_cache_drop(struct file_cache *fc, struct file_entry *fe)
+{
+        (void)hashmap_del(fc->fc_map, fe->fe_path);
+
+        if (fe->fe_prev != NULL)
+                fe->fe_prev->fe_next = fe->fe_next;
+        else
+                fc->fc_first = fe->fe_next;
+        if (fe->fe_next != NULL)
+                fe->fe_next->fe_prev = fe->fe_prev;
+        else
+                fc->fc_last = fe->fe_prev;
+        --fc->fc_count;
+        file_entry_free(fe);
+}
+
+static void
+file_cache_remove(struct file_cache *fc, struct file_entry *fe)
+{
+        if (!file_cache_shared(fc, fe, fe->fe_wd))
+                (void)inotify_rm_watch(fc->fc_inotifyfd, fe->fe_wd);
+        file_cache_drop(fc, fe);
+}
+
+static void
+file_cache_poll(struct file_cache *fc)
+{
+        struct inotify_event    *ev = NULL;
+        struct file_entry       *fe = NULL;
+        struct file_entry       *next = NULL;
+        struct timespec         ts;
+        uint64_t                now;
+        ssize_t                 nread;
+        char                    *p = NULL;
+        char                    buf[4096]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+
+        /* the coarse clock is read without entering the kernel */
+        (void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        if (now - fc->fc_polled < FILE_CACHE_POLL)
+                return;
+        fc->fc_polled = now;
+
+        while ((nread = read(fc->fc_inotifyfd, buf, sizeof(buf))) > 0) {
+                for (p = buf; p < buf + nread; p += sizeof(*ev) + ev->len) {
+                        ev = (struct inotify_event *)p;
+
+                        /* events were lost, so any entry may be stale */
+                        if (ev->wd == -1 || (ev->mask & IN_Q_OVERFLOW)) {
+                                while (fc->fc_first != NULL)
+                                        file_cache_remove(fc, fc->fc_first);
+                                continue;
+                        }
+
+                        /*
+                         * a change, a move or unlink (IN_MOVE_SELF,
+                         * IN_DELETE_SELF) or the end of the watch
+                         * (IN_IGNORED, after which the kernel has already
+                         * removed it) all invalidate the entries watched
+                         */
+                        for (fe = fc->fc_first; fe != NULL; fe = next) {
+                                next = fe->fe_next;
+                                if (fe->fe_wd != ev->wd)
+                                        continue;
+                                if (ev->mask & IN_IGNORED)
+                                        file_cache_drop(fc, fe);
+                                else
+                                        file_cache_remove(fc, fe);
+                        }
+                }
+        }
+}
+
+static struct file_entry *file_entry_open(struct file_cache *fc,
+                                          struct file_root *fr,
+                                          const char *path);
+
+static struct file_entry *
+file_cache_lookup(struct file_cache *fc,
+                  struct file_root *fr,
+                  const char *path)
+{
+        struct hash_entry       *ep = NULL;
+        struct file_entry       *fe = NULL;
+
+        if (fc->fc_inotifyfd < 0)
+                return file_entry_open(fc, fr, path);
+
+        file_cache_poll(fc);
+        ep = hashmap_get(fc->fc_map, (char *)path);
+        if (ep == NULL) {
+                fe = file_entry_open(fc, fr, path);
+                if (fe == NULL || fe->fe_wd < 0)
+                        return fe;
+
+                if (hashmap_set(fc->fc_map, fe->fe_path, fe) == NULL) {
+                        if (!file_cache_shared(fc, fe, fe->fe_wd))
+                                (void)inotify_rm_watch(fc->fc_inotifyfd,
+                                                       fe->fe_wd);
+                        fe->fe_wd = -1;
+                        return fe;
+                }
+                ++fc->fc_count;
+        } else {
+                /* move to the front of the lru list */
+                fe = ep->he_value;
+                if (fe == fc->fc_first)
+                        return fe;
+
+                fe->fe_prev->fe_next = fe->fe_next;
+                if (fe->fe_next != NULL)
+                        fe->fe_next->fe_prev = fe->fe_prev;
+                else
+                        fc->fc_last = fe->fe_prev;
+        }
+
+        fe->fe_prev = NULL;
+        fe->fe_next = fc->fc_first;
+        if (fc->fc_first != NULL)
+                fc->fc_first->fe_prev = fe;
+        else
+                fc->fc_last = fe;
+        fc->fc_first = fe;
+
+        /* evict only after inserting so a shared watch is kept */
+        if (fc->fc_count > FILE_CACHE_SIZE)
+                file_cache_remove(fc, fc->fc_last);
+        return fe;
+}
+
+static struct file_entry *
+file_entry_open(struct file_cache *fc,
+                struct file_root *fr,
+                const char *path)
+{
+        struct file_entry       *fe = NULL;
+        struct hash_entry       *ep = NULL;
+        const struct file_gz    *fg = NULL;
+        struct tm               tm;
+        char                    abspath[PATH_MAX];
+        char                    mtime[64];
+        char                    hdr[512];
+        int                     len;
+
+        fe = calloc(1, sizeof(*fe));
+        if (fe == NULL)
+                return NULL;
+        fe->fe_fd = -1;
+        fe->fe_wd = -1;
+
+        fe->fe_path = strdup(path);
+        if (fe->fe_path == NULL)
+                goto free_fe;
+
+        /* watch before opening so no change can slip in between */
+        if (fc->fc_inotifyfd >= 0 &&
+            snprintf(abspath, sizeof(abspath), "%s/%s", fr->fr_dir, path) <
+            (int)sizeof(abspath))
+                fe->fe_wd = inotify_add_watch(fc->fc_inotifyfd, abspath,
+                                              IN_MODIFY | IN_ATTRIB |
+                                              IN_MOVE_SELF | IN_DELETE_SELF);
+
+        fe->fe_fd = openat(fr->fr_dirfd, path, O_RDONLY | O_CLOEXEC);
+        if (fe->fe_fd < 0)
+                goto unwatch;
+
+        if (fstat(fe->fe_fd, &fe->fe_st) < 0 || !S_ISREG(fe->fe_st.st_mode))
+                goto unwatch;
+
+        /* the coded copy only stands for the file it was made from */
+        ep = hashmap_get(fr->fr_gz, (char *)path);
+        if (ep != NULL) {
+                fg = ep->he_value;
+                if (fg->fg_ino == fe->fe_st.st_ino &&
+                    fg->fg_srcsize == fe->fe_st.st_size &&
+                    fg->fg_mtime == fe->fe_st.st_mtime)
+                        fe->fe_gz = fg;
+        }
+
+        (void)snprintf(fe->fe_etag, sizeof(fe->fe_etag), "\"%llx-%llx\"",
+                       (unsigned long long)fe->fe_st.st_mtime,
+                       (unsigned long long)fe->fe_st.st_size);
+        (void)snprintf(fe->fe_gzetag, sizeof(fe->fe_gzetag),
+                       "\"%llx-%llx-gz\"",
+                       (unsigned long long)fe->fe_st.st_mtime,
+                       (unsigned long long)fe->fe_st.st_size);
+
+        (void)gmtime_r(&fe->fe_st.st_mtime, &tm);
+        (void)strftime(mtime, sizeof(mtime), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        len = snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Length: %lld\r\n"
+                       "Content-Type: %s\r\n"
+                       "Last-Modified: %s\r\n"
+                       "ETag: %s\r\n"
+                       "%s"
+                       "\r\n",
+                       (long long)fe->fe_st.st_size, file_type(path), mtime,
+                       fe->fe_etag,
+                       fe->fe_gz != NULL ? "Vary: Accept-Encoding\r\n" : "");
+        if (len < 0 || len >= (int)sizeof(hdr))
+                goto unwatch;
+
+        fe->fe_hdr = strdup(hdr);
+        if (fe->fe_hdr == NULL)
+                goto unwatch;
+        fe->fe_hdrlen = len;
+
+        if (fe->fe_gz == NULL)
+                return fe;
+
+        /* a strong ETag differs between codings */
+        len = snprintf(hdr, sizeof(hdr),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Length: %lld\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Encoding: gzip\r\n"
+                       "Last-Modified: %s\r\n"
+                       "ETag: %s\r\n"
+                       "Vary: Accept-Encoding\r\n"
+                       "\r\n",
+                       (long long)fg->fg_size, file_type(path), mtime,
+                       fe->fe_gzetag);
+        if (len < 0 || len >= (int)sizeof(hdr))
+                goto free_hdr;
+
+        fe->fe_gzhdr = strdup(hdr);
+        if (fe->fe_gzhdr == NULL)
+                goto free_hdr;
+        fe->fe_gzhdrlen = len;
+        return fe;
+free_hdr:
+        free(fe->fe_hdr);
+unwatch:
+        if (fe->fe_wd >= 0 && !file_cache_shared(fc, fe, fe->fe_wd))
+                (void)inotify_rm_watch(fc->fc_inotifyfd, fe->fe_wd);
+        if (fe->fe_fd >= 0)
+                (void)close(fe->fe_fd);
+        free(fe->fe_path);
+free_fe:
+        free(fe);
+        return NULL;
+}
+
+static int file_path_ok(const char *path);
+
+/*
+ * whether the client's copy is current: If-None-Match names etag (or is
+ * "*"), or else, without If-None-Match, the file is no newer than an
+ * IMF-fixdate If-Modified-Since (other date formats are ignored)
+ */
+static int
+file_fresh(struct http_request *req,
+           const struct file_entry *fe,
+           const char *etag)
+{
+        const char      *inm = NULL;
+        const char      *ims = NULL;
+        const char      *end = NULL;
+        struct tm       tm;
+
+        inm = http_request_known(req, HTTP_HDR_IF_NONE_MATCH);
+        if (inm != NULL)
+                return strcmp(inm, "*") == 0 || strstr(inm, etag) != NULL;
+
+        ims = http_request_known(req, HTTP_HDR_IF_MODIFIED_SINCE);
+        if (ims == NULL)
+                return 0;
+
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == NULL || *end != '\0')
+                return 0;
+
+        return fe->fe_st.st_mtime <= timegm(&tm);
+}
+
+static void
+file_serve(struct http_request *req, struct http_response *res)
+{
+        struct file_root        *fr = req->rq_handler->hh_arg;
+        struct file_cache       *fc = NULL;
+        struct file_entry       *fe = NULL;
+        const char              *path = NULL;
+        char                    index[PATH_MAX];
+        int                     head;
+        int                     gz;
+
+        /* only GET and HEAD get here (hh_methods) */
+        path = http_request_str(req, req->rq_pathinfo);
+        head = req->rq_methodid == HTTP_METHOD_HEAD;
+
+        /* openat() would ignore fr_dirfd for an absolute path */
+        while (*path == '/')
+                ++path;
+
+        if (!file_path_ok(path))
+                goto not_found;
+
+        if (*path == '\0' || path[strlen(path) - 1] == '/') {
+                if (snprintf(index, sizeof(index), "%sindex.html", path) >=
+                    (int)sizeof(index))
+                        goto not_found;
+                path = index;
+        }
+
+        fc = file_cache_get(fr);
+        if (fc == NULL) {
+                warn("file_cache_get()");
+                goto not_found;
+        }
+
+        /* a hit costs no open(), fstat() or header formatting */
+        fe = file_cache_lookup(fc, fr, path);
+        if (fe == NULL)
+                goto not_found;
+
+        gz = fe->fe_gz != NULL && http_request_accepts(req, "gzip");
+
+        /* Date, ETag and Vary, as the 200 would have had them */
+        if (file_fresh(req, fe, gz ? fe->fe_gzetag : fe->fe_etag)) {
+                (void)http_response_status(res, 304);
+                (void)http_response_header(res, "ETag",
+                                           gz ? fe->fe_gzetag : fe->fe_etag);
+                if (fe->fe_gz != NULL)
+                        (void)http_response_header(res, "Vary",
+                                                   "Accept-Encoding");
+                (void)http_response_send(res, NULL, 0);
+        } else if (gz) {
+                /* the coded copy is sent as is, nothing is compressed */
+                (void)iobuf_write(req->rq_buf, fe->fe_gzhdr,
+                                  fe->fe_gzhdrlen);
+                if (!head && iobuf_sendfile(req->rq_buf, fe->fe_gz->fg_fd, 0,
+                                            fe->fe_gz->fg_size) < 0)
+                        warn("iobuf_sendfile()");
+        } else {
+                (void)iobuf_write(req->rq_buf, fe->fe_hdr, fe->fe_hdrlen);
+
+                /* the body goes from the page cache to the socket */
+                if (!head && iobuf_sendfile(req->rq_buf, fe->fe_fd, 0,
+                                            fe->fe_st.st_size) < 0)
+                        warn("iobuf_sendfile()");
+        }
+
+        if (fe->fe_wd < 0)
+                file_entry_free(fe);
+        return;
+not_found:
+        (void)iobuf_puts(req->rq_buf, file_404);
+}
+
+/* reject ".." components so requests stay below the served directory */
+static int
+file_path_ok(const char *path)
+{
+        const char      *p = path;
+
+        while (*p != '\0') {
+                if (p[0] == '.' && p[1] == '.' &&
+                    (p[2] == '/' || p[2] == '\0'))
+                        return 0;
+
+                p = strchr(p, '/');
+                if (p == NULL)
+                        break;
+                ++p;
+        }
+
+        return 1;
+}
+
+static const char *
+file_type(const char *path)
+{
+        const char      *ext = NULL;
+        size_t          i;
+
+        ext = strrchr(path, '.');
+        if (ext == NULL || strchr(ext, '/') != NULL)
+                return "application/octet-stream";
+
+        ++ext;
+        for (i = 0; i < sizeof(file_types) / sizeof(file_types[0]); ++i) {
+                if (strcasecmp(ext, file_types[i].ft_ext) == 0)
+                        return file_types[i].ft_type;
+        }
+
+        return "application/octet-stream";
+}
@@ -0,0 +1,22 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "http.h"
+#include <errno.h>
+#include <stdlib.h>
+
+/**
+ * Create a handler serving the files of a directory (GET and HEAD
+ * only); add it with http_server_add_handler() for a resource ending in
+ * '/' and a request for <resource>a/b.html gets <dir>/a/b.html, sent
+ * with sendfile() (a resource ending in '/' gets its index.html):
+ *
+ * args:
+ *      @dir:   directory to serve
+ * ret:
+ *      @success:       pointer to handler
+ *      @failure:       NULL and errno set
+ */
+extern struct http_handler *file_handler_new(const char *dir);
+
+#endif
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "gzip.h"
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* bytes read from and written to files at a time */
+#define GZIP_CHUNK      (64 * 1024)
+
+/* compression state of a thread, kept between responses */
+struct gzip_state {
+        /* stream of each format (deflateReset() between uses) */
+        z_stream        gs_streams[GZIP_NFORMATS];
+        /* level of each initialized stream (zero until initialized) */
+        int             gs_levels[GZIP_NFORMATS];
+        /* output buffer, grown to the largest deflateBound() seen */
+        unsigned char   *gs_buf;
+        /* size of gs_buf */
+        size_t          gs_size;
+};
+
+/* zlib's windowBits: 16 + 15 asks for a gzip header and trailer */
+static const int gzip_bits[GZIP_NFORMATS] = {
+        [GZIP_GZIP] = 16 + MAX_WBITS,
+        [GZIP_DEFLATE] = MAX_WBITS,
+};
+
+/* content types compressed, matched up to their length */
+static const char *const gzip_types[] = {
+        "text/",
+        "application/json",
+        "application/javascript",
+        "application/xml",
+        "image/svg+xml",
+        "application/wasm",
+};
+
+static pthread_once_t   gzip_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    gzip_key;
+static int              gzip_keyerr;
+
+int
+gzip_type(const char *type)
+{
+        size_t  i;
+
+        for (i = 0; i < sizeof(gzip_types) / sizeof(gzip_types[0]); ++i) {
+                if (strncasecmp(type, gzip_types[i],
+                                strlen(gzip_types[i])) == 0)
+                        return 1;
+        }
+
+        return 0;
+}
+
+static void
+gzip_state_free(void *arg)
+{
+        struct gzip_state       *gs = arg;
+        int                     i;
+
+        if (gs == NULL)
+                return;
+
+        for (i = 0; i < GZIP_NFORMATS; ++i) {
+                if (gs->gs_levels[i] != 0)
+                        (void)deflateEnd(&gs->gs_streams[i]);
+        }
+        free(gs->gs_buf);
+        free(gs);
+}
+
+static void
+gzip_key_create(void)
+{
+        /* states of loop threads are freed when the threads exit */
+        gzip_keyerr = pthread_key_create(&gzip_key, gzip_state_free);
+}
+
+static struct gzip_state *
+gzip_state_get(void)
+{
+        struct gzip_state       *gs = NULL;
+
+        (void)pthread_once(&gzip_once, gzip_key_create);
+        if (gzip_keyerr != 0) {
+                errno = gzip_keyerr;
+                return NULL;
+        }
+
+        gs = pthread_getspecific(gzip_key);
+        if (gs != NULL)
+                return gs;
+
+        gs = calloc(1, sizeof(*gs));
+        if (gs == NULL)
+                return NULL;
+
+        errno = pthread_setspecific(gzip_key, gs);
+        if (errno != 0) {
+                free(gs);
+                return NULL;
+        }
+
+        return gs;
+}
+
+/* the thread's stream for a format, reset and at the level asked for */
+static z_stream *
+gzip_stream(struct gzip_state *gs, enum gzip_format format, int level)
+{
+        z_stream        *zs = &gs->gs_streams[format];
+
+        if (gs->gs_levels[format] == 0) {
+                if (deflateInit2(zs, level, Z_DEFLATED, gzip_bits[format],
+                                 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+                gs->gs_levels[format] = level;
+                return zs;
+        }
+
+        if (deflateReset(zs) != Z_OK)
+                goto einval;
+        if (gs->gs_levels[format] != level) {
+                if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                        goto einval;
+                gs->gs_levels[format] = level;
+        }
+
+        return zs;
+einval:
+        errno = EINVAL;
+        return NULL;
+}
+
+ssize_t
+gzip_buf(enum gzip_format format,
+         int level,
+         const void *in,
+         size_t len,
+         const void **outp)
+{
+        struct gzip_state       *gs = NULL;
+        z_stream                *zs = NULL;
+        unsigned char           *buf = NULL;
+        size_t                  bound;
+
+        if (format < 0 || format >= GZIP_NFORMATS || level < 1 ||
+            level > 9 || len > UINT_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        gs = gzip_state_get();
+        if (gs == NULL)
+                return -1;
+
+        zs = gzip_stream(gs, format, level);
+        if (zs == NULL)
+                return -1;
+
+        /* one deflate() call fits in deflateBound() bytes */
+        bound = deflateBound(zs, len);
+        if (bound > gs->gs_size) {
+                buf = realloc(gs->gs_buf, bound);
+                if (buf == NULL)
+                        return -1;
+                gs->gs_buf = buf;
+                gs->gs_size = bound;
+        }
+
+        zs->next_in = (unsigned char *)in;
+        zs->avail_in = len;
+        zs->next_out = gs->gs_buf;
+        zs->avail_out = gs->gs_size;
+        if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        *outp = gs->gs_buf;
+        return zs->total_out;
+}
+
+/* write all of a buffer, short writes included */
+static int
+gzip_write(int fd, const unsigned char *p, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, p, len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0)
+                        return -1;
+                p += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+int
+gzip_file(int fd, off_t *sizep)
+{
+        z_stream        zs;
+        unsigned char   in[GZIP_CHUNK];
+        unsigned char   out[GZIP_CHUNK];
+        ssize_t         nread;
+        int             saved_errno;
+        int             flush = Z_NO_FLUSH;
+        int             memfd;
+        int             ret;
+
+        memfd = memfd_create("gzip", MFD_CLOEXEC);
+        if (memfd < 0)
+                return -1;
+
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED,
+                         gzip_bits[GZIP_GZIP], 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+                errno = ENOMEM;
+                goto close_memfd;
+        }
+
+        do {
+                nread = read(fd, in, sizeof(in));
+                if (nread < 0 && errno == EINTR)
+                        continue;
+                if (nread < 0)
+                        goto end;
+                flush = nread == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+                zs.next_in = in;
+                zs.avail_in = nread;
+                do {
+                        zs.next_out = out;
+                        zs.avail_out = sizeof(out);
+                        ret = deflate(&zs, flush);
+                        if (ret == Z_STREAM_ERROR) {
+                                errno = EINVAL;
+                                goto end;
+                        }
+                        if (gzip_write(memfd, out,
+                                       sizeof(out) - zs.avail_out) < 0)
+                                goto end;
+                } while (zs.avail_out == 0);
+        } while (flush != Z_FINISH);
+
+        *sizep = zs.total_out;
+        (void)deflateEnd(&zs);
+        return memfd;
+end:
+        saved_errno = errno;
+        (void)deflateEnd(&zs);
+        errno = saved_errno;
+close_memfd:
+        saved_errno = errno;
+        (void)close(memfd);
+        errno = saved_errno;
+        return -1;
+}
@@ -0,0 +1,64 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* content codings produced (the "deflate" coding is zlib framed) */
+enum gzip_format {
+        GZIP_GZIP,
+        GZIP_DEFLATE,
+        /* number of formats */
+        GZIP_NFORMATS,
+};
+
+/* smallest body worth compressing (smaller ones barely shrink) */
+#define GZIP_MIN        256
+
+/**
+ * Tell whether a content type is worth compressing (text, JSON, XML,
+ * JavaScript, SVG and WebAssembly; images and archives already are):
+ *
+ * args:
+ *      @type:  Content-Type value (parameters such as charset ignored)
+ * ret:
+ *      1 if it is, 0 if not
+ */
+extern int gzip_type(const char *type);
+
+/**
+ * Compress a buffer with the calling thread's stream for a format, so
+ * zlib's state is allocated once per thread rather than per call:
+ *
+ * args:
+ *      @format:        GZIP_GZIP or GZIP_DEFLATE
+ *      @level:         zlib compression level (1 to 9)
+ *      @in:            bytes to compress
+ *      @len:           number of bytes in in
+ *      @outp:          set to the compressed bytes (owned by the thread,
+ *                      valid until its next gzip_buf())
+ * ret:
+ *      @success:       number of compressed bytes
+ *      @failure:       -1 and errno set
+ */
+extern ssize_t gzip_buf(enum gzip_format format,
+                        int level,
+                        const void *in,
+                        size_t len,
+                        const void **outp);
+
+/**
+ * Compress a file into an anonymous in-memory file (memfd), in chunks,
+ * at the best compression level (meant for startup, not requests):
+ *
+ * args:
+ *      @fd:    file to compress (read from its current offset)
+ *      @sizep: set to the size of the compressed file
+ * ret:
+ *      @success:       file descriptor of the compressed file
+ *      @failure:       -1 and errno set
+ */
+extern int gzip_file(int fd, off_t *sizep);
+
+#endif
@@ -222,6 +222,33 @@ hashmap_grow(struct hashmap *hp)
         return 0;
 }
 
+int
+hashmap_del(struct hashmap *hp, char *key)
+{
+        struct hash_link        **pp = NULL;
+        struct hash_link        *p = NULL;
+
+        if (hashmap_sanity(hp) < 0)
+                return -1;
+
+        for (pp = &hp->hm_tab[hashfn(key) % hp->hm_size]; *pp != NULL;
+             pp = &(*pp)->hl_next) {
+                if (!strcmp(key, (*pp)->hl_entry.he_key))
+                        break;
+        }
+
+        if (*pp == NULL) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        p = *pp;
+        *pp = p->hl_next;
+        free(p);
+        --hp->hm_count;
+        return 0;
+}
+
 int
 hashmap_for(struct hashmap *hp, void (*fn)(struct hash_entry *))
 {
@@ -81,6 +81,18 @@ extern struct hash_entry *hashmap_get(struct hashmap *hp, char *key);
  */
 extern struct hash_entry *hashmap_set(struct hashmap *hp, char *key, void *value);
 
+/**
+ * Remove an entry from hashmap (key and value are not freed):
+ *
+ * args:
+ *      @hp:    pointer to hashmap
+ *      @key:   key of entry to remove
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOENT if key is not there)
+ */
+extern int hashmap_del(struct hashmap *hp, char *key);
+
 /**
  * Iterate through a hashmap:
  *
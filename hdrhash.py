@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Generate the perfect hash of the known header names in http.c.
+
+The names are read from http_header_names[] in http.c (in enum order),
+and a weight is searched for every byte so that
+
+    len + asso[name[0]] + asso[name[len - 1]] + asso[name[len - 4]]
+
+(name[0] instead of name[len - 4] for names under 4 bytes) modulo the
+number of slots differs for every name; a byte and its other case get
+the same weight.  The search is seeded, so the same names always give
+the same tables.  They are printed as C, to replace http_header_asso[]
+and http_header_slots[] in http.c:
+
+    ./hdrhash.py [path/to/http.c]
+"""
+
+import os
+import random
+import re
+import sys
+
+# slots in http_header_slots[] (a power of two, the hash is taken mod it)
+NSLOTS = 64
+# weights tried before starting over from a new random table
+TRIES = 100000
+
+
+def read_names(path):
+    """header names of http_header_names[], in enum http_header order"""
+    with open(path) as f:
+        src = f.read()
+
+    table = re.search(r"http_header_names\[HTTP_HDR_OTHER\] = \{(.*?)\};",
+                      src, re.S)
+    if table is None:
+        sys.exit("%s: no http_header_names[]" % path)
+
+    return re.findall(r'\[HTTP_HDR_\w+\] = "([^"]+)"', table.group(1))
+
+
+def keys(name):
+    """bytes weighted for a name, as http_header_id() picks them"""
+    s = name.lower()
+    return len(s), (s[0], s[-1], s[len(s) - 4] if len(s) >= 4 else s[0])
+
+
+def slot(asso, key):
+    n, chars = key
+    return (n + sum(asso[c] for c in chars)) % NSLOTS
+
+
+def collisions(asso, ks):
+    slots = [slot(asso, k) for k in ks]
+    return len(slots) - len(set(slots))
+
+
+def search(names, seed=0):
+    """weights giving every name its own slot (local search)"""
+    rnd = random.Random(seed)
+    ks = [keys(name) for name in names]
+    chars = sorted(set(c for _, cs in ks for c in cs))
+
+    while True:
+        asso = {c: rnd.randrange(NSLOTS) for c in chars}
+        cost = collisions(asso, ks)
+        for _ in range(TRIES):
+            if cost == 0:
+                return asso
+            c = rnd.choice(chars)
+            old = asso[c]
+            asso[c] = rnd.randrange(NSLOTS)
+            new = collisions(asso, ks)
+            if new <= cost:
+                cost = new
+            else:
+                asso[c] = old
+
+
+def rows(values, per_row):
+    lines = []
+    for i in range(0, len(values), per_row):
+        row = values[i:i + per_row]
+        lines.append("        " + " ".join("%2d," % v for v in row))
+    return "\n".join(lines)
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else \
+        os.path.join(os.path.dirname(os.path.abspath(__file__)), "http.c")
+    names = read_names(path)
+    if len(names) >= 256:
+        sys.exit("too many names for unsigned char slots")
+    if len(names) > NSLOTS:
+        sys.exit("more names than slots")
+
+    asso = search(names)
+
+    table = [0] * 256
+    for c, w in asso.items():
+        table[ord(c.lower())] = w
+        table[ord(c.upper())] = w
+
+    slots = [0] * NSLOTS
+    for i, name in enumerate(names):
+        slots[slot(asso, keys(name))] = i + 1
+
+    print("static const unsigned char http_header_asso[256] = {")
+    print(rows(table, 16))
+    print("};")
+    print()
+    print("/* enum http_header + 1 of the name hashing to each slot "
+          "(0 if none) */")
+    print("static const unsigned char http_header_slots[%d] = {" % NSLOTS)
+    print(rows(slots, 8))
+    print("};")
+
+
+if __name__ == "__main__":
+    main()
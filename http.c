@@ -1,49 +1,142 @@
+#define _GNU_SOURCE
 #include "http.h"
+#include "cache.h"
+#include "deque.h"
+#include "gzip.h"
+#include "route.h"
+#include "scan.h"
+#include "uring.h"
+#include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <signal.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <err.h>
 #include <sysexits.h>
 
+/* default number of requests served on one connection */
+#define HTTP_MAX_REQUESTS 100
+/* default ms a connection may take to send a complete request */
+#define HTTP_IDLE_TIMEOUT 5000
+/* default largest request body */
+#define HTTP_MAX_BODY (1 << 20)
+/* default zlib level of compressed response bodies */
+#define HTTP_GZIP_LEVEL 6
+/* default bytes of cached responses per thread */
+#define HTTP_CACHE_BUDGET (16 << 20)
+
+static int http_server_socket(const struct http_server *hp);
+static void http_header_check(void);
+
 struct http_server *
 http_server_new(struct addrinfo *ap)
 {
         struct http_server      *s = NULL;
-        int                     saved_errno;
-        int                     y;
+
+        http_header_check();
+
+        if (ap == NULL || ap->ai_addrlen > sizeof(s->sv_addr)) {
+                errno = EINVAL;
+                return NULL;
+        }
 
         s = malloc(sizeof(*s));
         if (s == NULL)
                 goto ret;
 
-        s->sv_handlers = hashmap_new(0);
-        if (s->sv_handlers == NULL)
+        s->sv_routes = route_new();
+        if (s->sv_routes == NULL)
                 goto free_server;
-
-        s->sv_fd = socket(ap->ai_family, ap->ai_socktype, ap->ai_protocol);
+        s->sv_table = NULL;
+
+        s->sv_mode = HTTP_SERVER_FORK;
+        s->sv_backend = uring_supported() ? HTTP_BACKEND_URING :
+                                            HTTP_BACKEND_EPOLL;
+        s->sv_nworkers = 0;
+        s->sv_max_requests = HTTP_MAX_REQUESTS;
+        s->sv_idle_timeout = HTTP_IDLE_TIMEOUT;
+        s->sv_max_body = HTTP_MAX_BODY;
+        s->sv_gzip_level = HTTP_GZIP_LEVEL;
+        s->sv_cache = cache_new(HTTP_CACHE_BUDGET);
+        if (s->sv_cache == NULL)
+                goto free_routes;
+        memcpy(&s->sv_addr, ap->ai_addr, ap->ai_addrlen);
+        s->sv_addrlen = ap->ai_addrlen;
+        s->sv_family = ap->ai_family;
+        s->sv_socktype = ap->ai_socktype;
+        s->sv_protocol = ap->ai_protocol;
+
+        s->sv_fd = http_server_socket(s);
         if (s->sv_fd < 0)
-                goto free_handlers;
+                goto free_cache;
+
+        goto ret;
+free_cache:
+        cache_free(&s->sv_cache);
+free_routes:
+        route_free(&s->sv_routes);
+free_server:
+        free(s);
+        s = NULL;
+ret:
+        return s;
+}
+
+static int
+http_server_socket(const struct http_server *hp)
+{
+        int     saved_errno;
+        int     fd;
+        int     y;
+
+        fd = socket(hp->sv_family, hp->sv_socktype, hp->sv_protocol);
+        if (fd < 0)
+                return -1;
 
         y = 1;
-        if (setsockopt(s->sv_fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) < 0)
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) < 0)
                 goto close_fd;
 
-        if (bind(s->sv_fd, ap->ai_addr, ap->ai_addrlen) < 0)
+        /* lets every prefork worker bind its own socket to this address */
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(y)) < 0)
                 goto close_fd;
 
-        goto ret;
+        if (bind(fd, (struct sockaddr *)&hp->sv_addr, hp->sv_addrlen) < 0)
+                goto close_fd;
+
+        return fd;
 close_fd:
         saved_errno = errno;
-        (void)close(s->sv_fd);
+        (void)close(fd);
         errno = saved_errno;
-free_handlers:
-        (void)hashmap_free(&s->sv_handlers);
-free_server:
-        free(s);
-        s = NULL;
-ret:
-        return s;
+        return -1;
+}
+
+/* add a handler for a route while routes may still change */
+static int
+http_server_route(struct http_server *hp,
+                  const char *route,
+                  struct http_handler *handler)
+{
+        /* workers share the frozen table, so routes are final by now */
+        if (hp->sv_table != NULL) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        return route_add(hp->sv_routes, route, handler);
 }
 
 int
@@ -51,24 +144,183 @@ http_server_add_handler(struct http_server *hp,
                         char *resource,
                         struct http_handler *handler)
 {
-        struct hash_entry       *ep = NULL;
+        if (http_server_route(hp, resource, handler) < 0)
+                return -1;
+
+        free(resource);
+        return 0;
+}
+
+int
+http_server_use(struct http_server *hp,
+                const char *prefix,
+                struct http_middleware *mw)
+{
+        if (hp->sv_table != NULL) {
+                errno = EBUSY;
+                return -1;
+        }
 
-        ep = hashmap_set(hp->sv_handlers, resource, handler);
-        return ep != NULL ? 0 : -1;
+        return route_use(hp->sv_routes, prefix, mw);
 }
 
 static int http_server_sanity(const struct http_server *server);
-static void sigchld_handler(int signo);
-static void http_server_client(struct http_server *hp, int connfd);
 
 int
-http_server_listen(struct http_server *hp, int qsize)
+http_server_set_mode(struct http_server *hp, enum http_server_mode mode)
 {
-        struct sigaction        act;
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        switch (mode) {
+        case HTTP_SERVER_FORK:
+        case HTTP_SERVER_EPOLL:
+        case HTTP_SERVER_PREFORK:
+        case HTTP_SERVER_THREADS:
+                hp->sv_mode = mode;
+                return 0;
+        }
+
+        errno = EINVAL;
+        return -1;
+}
+
+int
+http_server_set_backend(struct http_server *hp,
+                        enum http_server_backend backend)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        switch (backend) {
+        case HTTP_BACKEND_URING:
+                if (!uring_supported()) {
+                        errno = ENOTSUP;
+                        return -1;
+                }
+                /* fall through */
+        case HTTP_BACKEND_EPOLL:
+                hp->sv_backend = backend;
+                return 0;
+        }
+
+        errno = EINVAL;
+        return -1;
+}
+
+int
+http_server_set_workers(struct http_server *hp, long nworkers)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        if (nworkers < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        hp->sv_nworkers = nworkers;
+        return 0;
+}
+
+int
+http_server_set_keepalive(struct http_server *hp,
+                          long max_requests,
+                          long idle_timeout)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        if (max_requests < 0 || idle_timeout < 0 || idle_timeout > INT_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        hp->sv_max_requests = max_requests;
+        hp->sv_idle_timeout = idle_timeout;
+        return 0;
+}
+
+int
+http_server_set_max_body(struct http_server *hp, size_t max_body)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        hp->sv_max_body = max_body;
+        return 0;
+}
+
+int
+http_server_set_compression(struct http_server *hp, int level)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        if (level < 0 || level > 9) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        hp->sv_gzip_level = level;
+        return 0;
+}
+
+int
+http_server_set_cache(struct http_server *hp, size_t budget)
+{
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        /* workers read the budget without locking */
+        if (hp->sv_table != NULL) {
+                errno = EBUSY;
+                return -1;
+        }
+
+        hp->sv_cache->ca_budget = budget;
+        return 0;
+}
+
+static int http_server_fork(struct http_server *hp, int qsize);
+static int http_server_epoll(struct http_server *hp, int qsize);
+static int http_server_prefork(struct http_server *hp, int qsize);
+static int http_server_threads(struct http_server *hp, int qsize);
 
+int
+http_server_listen(struct http_server *hp, int qsize)
+{
         if (http_server_sanity(hp) < 0)
                 return -1;
 
+        if (hp->sv_table == NULL) {
+                hp->sv_table = route_freeze(hp->sv_routes);
+                if (hp->sv_table == NULL)
+                        return -1;
+        }
+
+        switch (hp->sv_mode) {
+        case HTTP_SERVER_EPOLL:
+                return http_server_epoll(hp, qsize);
+        case HTTP_SERVER_PREFORK:
+                return http_server_prefork(hp, qsize);
+        case HTTP_SERVER_THREADS:
+                return http_server_threads(hp, qsize);
+        case HTTP_SERVER_FORK:
+                break;
+        }
+
+        return http_server_fork(hp, qsize);
+}
+
+static void sigchld_handler(int signo);
+static void http_server_client(struct http_server *hp, int connfd);
+
+static int
+http_server_fork(struct http_server *hp, int qsize)
+{
+        struct sigaction        act;
+
         memset(&act, 0, sizeof(act));
         act.sa_handler = sigchld_handler;
         act.sa_flags = 0;
@@ -107,13 +359,131 @@ http_server_listen(struct http_server *hp, int qsize)
         return -1;
 }
 
+/* set by SIGINT/SIGTERM in the prefork master */
+static volatile sig_atomic_t prefork_stop;
+
+static void prefork_stop_handler(int signo);
+static pid_t http_prefork_spawn(struct http_server *hp, int qsize);
+
+static int
+http_server_prefork(struct http_server *hp, int qsize)
+{
+        struct sigaction        act;
+        pid_t                   *pids = NULL;
+        long                    nworkers;
+        long                    i;
+
+        nworkers = hp->sv_nworkers;
+        if (nworkers == 0)
+                nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers <= 0)
+                nworkers = 1;
+
+        pids = calloc(nworkers, sizeof(*pids));
+        if (pids == NULL)
+                return -1;
+
+        /* no SA_RESTART: waitpid() must return so we can shut down */
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = prefork_stop_handler;
+        act.sa_flags = 0;
+        sigemptyset(&act.sa_mask);
+        if (sigaction(SIGINT, &act, NULL) < 0)
+                goto free_pids;
+        if (sigaction(SIGTERM, &act, NULL) < 0)
+                goto free_pids;
+
+        /*
+         * the master never listens on sv_fd, it only keeps the address
+         * bound while workers accept on their own SO_REUSEPORT sockets
+         */
+        for (i = 0; i < nworkers; ++i) {
+                pids[i] = http_prefork_spawn(hp, qsize);
+                if (pids[i] < 0)
+                        goto kill_workers;
+        }
+
+        while (!prefork_stop) {
+                time_t  started;
+                pid_t   pid;
+
+                pid = waitpid(-1, NULL, 0);
+                if (pid < 0 && errno == EINTR)
+                        continue;
+                if (pid < 0)
+                        goto kill_workers;
+
+                for (i = 0; i < nworkers; ++i) {
+                        if (pids[i] == pid)
+                                break;
+                }
+                if (i == nworkers)
+                        continue;
+
+                warnx("worker %ld exited, respawning", (long)pid);
+                started = time(NULL);
+                pids[i] = http_prefork_spawn(hp, qsize);
+                if (pids[i] < 0)
+                        goto kill_workers;
+
+                /* do not spin if workers die as soon as they start */
+                if (time(NULL) == started)
+                        (void)sleep(1);
+        }
+
+        for (i = 0; i < nworkers; ++i)
+                (void)kill(pids[i], SIGTERM);
+        while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+                ;
+        free(pids);
+        return 0;
+kill_workers:
+        for (i = 0; i < nworkers; ++i) {
+                if (pids[i] > 0)
+                        (void)kill(pids[i], SIGTERM);
+        }
+free_pids:
+        free(pids);
+        return -1;
+}
+
+static void
+prefork_stop_handler(int signo)
+{
+        prefork_stop = 1;
+}
+
+static pid_t
+http_prefork_spawn(struct http_server *hp, int qsize)
+{
+        pid_t   pid;
+        int     fd;
+
+        pid = fork();
+        if (pid != 0)
+                return pid;
+
+        (void)signal(SIGINT, SIG_DFL);
+        (void)signal(SIGTERM, SIG_DFL);
+
+        fd = http_server_socket(hp);
+        if (fd < 0)
+                err(EX_OSERR, "worker socket");
+
+        (void)close(hp->sv_fd);
+        hp->sv_fd = fd;
+        if (http_server_epoll(hp, qsize) < 0)
+                err(EX_OSERR, "worker event loop");
+        exit(0);
+}
+
 static int
 http_server_sanity(const struct http_server *server)
 {
         errno = EINVAL;
         if (server == NULL)
                 return -1;
-        if (server->sv_handlers == NULL)
+        if (server->sv_routes == NULL)
                 return -1;
         if (server->sv_fd < 0)
                 return -1;
@@ -130,363 +500,3285 @@ sigchld_handler(int signo)
                 ;
 }
 
-static struct http_request *http_request_new(int connfd);
-static struct http_response *http_response_new(void);
+static struct http_request *http_request_new(int connfd, size_t maxbody);
 static int http_request_free(struct http_request **reqp);
-static void free_hash_entry(struct hash_entry *ep);
-static int http_response_free(struct http_response **resp);
-static int http_parse_first_line(struct http_request *req, char *linep);
-static int http_parse_header(struct http_request *req, char *linep);
+static int http_request_reset(struct http_request *req);
+static int http_request_keepalive(struct http_request *req);
+static int http_request_parse(struct http_request *req);
+static void http_server_dispatch(struct http_server *hp,
+                                 struct http_request *req,
+                                 struct http_response *res);
+static void http_send_status(struct http_request *req, const char *status);
+static void http_send_405(struct http_request *req, unsigned methods);
+static int http_request_buffered(struct http_request *req);
+static int http_request_flush(struct http_request *req);
+static int http_request_skip_body(struct http_request *req);
+
+/* canned replies for requests no handler answers */
+static const char http_400[] = "HTTP/1.1 400 Bad Request\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n"
+                               "\r\n";
+static const char http_404[] = "HTTP/1.1 404 Not Found\r\n"
+                               "Content-Length: 0\r\n"
+                               "\r\n";
+static const char http_413[] = "HTTP/1.1 413 Content Too Large\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n"
+                               "\r\n";
+static const char http_501[] = "HTTP/1.1 501 Not Implemented\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n"
+                               "\r\n";
+static const char http_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* response to a request http_request_parse() failed with errno error */
+static const char *
+http_parse_status(int error)
+{
+        switch (error) {
+        case EMSGSIZE:
+                return http_413;
+        case ENOTSUP:
+                return http_501;
+        default:
+                return http_400;
+        }
+}
 
 static void
 http_server_client(struct http_server *hp, int connfd)
 {
-        struct http_response    *res = NULL;
+        struct http_response    res;
         struct http_request     *req = NULL;
-        struct http_handler     *hdlr = NULL;
-        struct hash_entry       *ep = NULL;
-        struct string           *line = NULL;
-        int                     firstline;
-        int                     c;
-        int                     reqok;
-
-        req = http_request_new(connfd);
+        struct timeval          tv;
+        long                    nrequests;
+
+        req = http_request_new(connfd, hp->sv_max_body);
         if (req == NULL)
                 err(EX_SOFTWARE, "http_request_new()");
 
-        res = http_response_new();
-        if (res == NULL)
-                err(EX_SOFTWARE, "http_response_new()");
-
-        line = string_new(0);
-        if (line == NULL)
-                err(EX_SOFTWARE, "string_new()");
+        /* a blocking read that waits this long ends the connection */
+        if (hp->sv_idle_timeout > 0) {
+                tv.tv_sec = hp->sv_idle_timeout / 1000;
+                tv.tv_usec = hp->sv_idle_timeout % 1000 * 1000;
+                if (setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO,
+                               &tv, sizeof(tv)) < 0)
+                        warn("setsockopt()");
+        }
 
-        firstline = 1;
-        reqok = 1;
-        while ((c = iobuf_getc(req->rq_buf)) > 0) {
-                char    *linep = NULL;
+        for (nrequests = 1; ; ++nrequests) {
+                int     ret;
 
-                if (string_append(line, c) < 0) {
-                        warn("failed to read line");
-                        reqok = 0;
+                /* eof, read timeout or error end the connection */
+                while ((ret = http_request_parse(req)) == 0) {
+                        if (iobuf_read(req->rq_buf) <= 0)
+                                break;
+                }
+                if (ret == 0)
+                        break;
+                if (ret < 0) {
+                        http_send_status(req, http_parse_status(errno));
+                        warnx("malformed request");
                         break;
                 }
 
-                if (c != '\n')
-                        continue;
+                http_server_dispatch(hp, req, &res);
+                if (http_request_flush(req) < 0)
+                        break;
 
-                linep = line->s_arr;
-                if (linep[0] == '\r')
+                if (!http_request_keepalive(req))
+                        break;
+                if (hp->sv_max_requests > 0 && nrequests >= hp->sv_max_requests)
                         break;
+                /* rq_buf is kept: it may hold the next request already */
+                if (http_request_reset(req) < 0)
+                        break;
+        }
 
-                if (firstline) {
-                        if (http_parse_first_line(req, linep) < 0) {
-                                warn("malformed first line: %s", linep);
-                                reqok = 0;
+        (void)http_request_free(&req);
+}
+
+/* where http_request_parse() resumes */
+enum http_parse_state {
+        HTTP_PARSE_METHOD,
+        HTTP_PARSE_RESOURCE,
+        HTTP_PARSE_VERSION,
+        HTTP_PARSE_LINE_LF,
+        HTTP_PARSE_FIELD,
+        HTTP_PARSE_NAME,
+        HTTP_PARSE_VALUE_WS,
+        HTTP_PARSE_VALUE,
+        HTTP_PARSE_FIELD_LF,
+        HTTP_PARSE_END_LF,
+};
+
+static void http_request_terminate(struct http_request *req);
+static int http_request_frame(struct http_request *req);
+static enum http_header http_header_id(const char *name, size_t len);
+static void http_request_target(struct http_request *req, const char *buf);
+static enum http_method http_method_id(const char *method, size_t len);
+static enum http_version http_version_id(const char *version, size_t len);
+
+/*
+ * Parse as much of the request as rq_buf holds, picking up where the
+ * last call stopped; nothing is copied or allocated, the request is
+ * recorded as views into rq_buf:
+ *
+ * ret:
+ *      1 once the header block is complete, 0 if more input is needed,
+ *      -1 with errno EBADMSG if the request is malformed (or does not fit
+ *      in rq_buf), ENOTSUP for a transfer coding other than chunked and
+ *      EMSGSIZE for a Content-Length over rq_maxbody
+ */
+static int
+http_request_parse(struct http_request *req)
+{
+        struct iobuf            *ip = req->rq_buf;
+        struct http_field       *fp = NULL;
+        const char              *buf = ip->ib_inbufp;
+        size_t                  len = ip->ib_inendp - ip->ib_inbufp;
+        size_t                  i;
+        size_t                  j;
+        size_t                  n;
+        char                    c;
+
+        if (req->rq_hdrlen > 0)
+                return 1;
+
+        /*
+         * inside a token the next delimiter (or invalid byte) is found by
+         * scan_stop() and the loop resumes on it, so only delimiters go
+         * through the switch one byte at a time
+         */
+        for (i = req->rq_parsed; i < len; ++i) {
+                c = buf[i];
+                switch (req->rq_state) {
+                case HTTP_PARSE_METHOD:
+                        n = scan_stop(buf + i, len - i, SCAN_TOKEN);
+                        if (n > 0) {
+                                i += n - 1;
+                                break;
+                        }
+                        if (c != ' ' || i == req->rq_mark)
+                                goto malformed;
+                        req->rq_method.hv_off = req->rq_mark;
+                        req->rq_method.hv_len = i - req->rq_mark;
+                        req->rq_methodid = http_method_id(buf + req->rq_mark,
+                                                          i - req->rq_mark);
+                        req->rq_mark = i + 1;
+                        req->rq_state = HTTP_PARSE_RESOURCE;
+                        break;
+                case HTTP_PARSE_RESOURCE:
+                        n = scan_stop(buf + i, len - i, SCAN_TARGET);
+                        if (n > 0) {
+                                i += n - 1;
                                 break;
                         }
-                        firstline = 0;
-                } else {
-                        if (http_parse_header(req, linep) < 0) {
-                                warn("malformed header: %s", linep);
-                                reqok = 0;
+                        if (c != ' ' || i == req->rq_mark)
+                                goto malformed;
+                        req->rq_resource.hv_off = req->rq_mark;
+                        req->rq_resource.hv_len = i - req->rq_mark;
+                        http_request_target(req, buf);
+                        req->rq_mark = i + 1;
+                        req->rq_state = HTTP_PARSE_VERSION;
+                        break;
+                case HTTP_PARSE_VERSION:
+                        n = scan_stop(buf + i, len - i, SCAN_TARGET);
+                        if (n > 0) {
+                                i += n - 1;
+                                break;
+                        }
+                        if ((c != '\r' && c != '\n') || i == req->rq_mark)
+                                goto malformed;
+                        req->rq_version.hv_off = req->rq_mark;
+                        req->rq_version.hv_len = i - req->rq_mark;
+                        req->rq_versionid = http_version_id(buf + req->rq_mark,
+                                                            i - req->rq_mark);
+                        req->rq_state = c == '\r' ? HTTP_PARSE_LINE_LF :
+                                                    HTTP_PARSE_FIELD;
+                        break;
+                case HTTP_PARSE_LINE_LF:
+                case HTTP_PARSE_FIELD_LF:
+                        if (c != '\n')
+                                goto malformed;
+                        req->rq_state = HTTP_PARSE_FIELD;
+                        break;
+                case HTTP_PARSE_FIELD:
+                        if (c == '\r') {
+                                req->rq_state = HTTP_PARSE_END_LF;
+                                break;
+                        }
+                        if (c == '\n')
+                                goto done;
+                        /* obsolete line folding and empty names included */
+                        if (scan_stop(buf + i, 1, SCAN_TOKEN) == 0)
+                                goto malformed;
+                        if (req->rq_nfields == HTTP_MAX_FIELDS)
+                                goto malformed;
+                        req->rq_mark = i;
+                        req->rq_state = HTTP_PARSE_NAME;
+                        break;
+                case HTTP_PARSE_NAME:
+                        n = scan_stop(buf + i, len - i, SCAN_TOKEN);
+                        if (n > 0) {
+                                i += n - 1;
                                 break;
                         }
+                        if (c != ':')
+                                goto malformed;
+                        fp = &req->rq_fields[req->rq_nfields];
+                        fp->hf_name.hv_off = req->rq_mark;
+                        fp->hf_name.hv_len = i - req->rq_mark;
+                        fp->hf_id = http_header_id(buf + req->rq_mark,
+                                                   i - req->rq_mark);
+                        if (fp->hf_id != HTTP_HDR_OTHER &&
+                            req->rq_known[fp->hf_id] == 0)
+                                req->rq_known[fp->hf_id] = req->rq_nfields + 1;
+                        req->rq_state = HTTP_PARSE_VALUE_WS;
+                        break;
+                case HTTP_PARSE_VALUE_WS:
+                        if (c == ' ' || c == '\t')
+                                break;
+                        req->rq_mark = req->rq_valend = i;
+                        req->rq_state = HTTP_PARSE_VALUE;
+                        /* fall through */
+                case HTTP_PARSE_VALUE:
+                        n = scan_stop(buf + i, len - i, SCAN_VALUE);
+                        if (n > 0) {
+                                /* trailing whitespace is not in the value */
+                                for (j = i + n; j > i; --j) {
+                                        if (buf[j - 1] != ' ' &&
+                                            buf[j - 1] != '\t') {
+                                                req->rq_valend = j;
+                                                break;
+                                        }
+                                }
+                                i += n - 1;
+                                break;
+                        }
+                        if (c != '\r' && c != '\n')
+                                goto malformed;
+                        req->rq_fields[req->rq_nfields].hf_value.hv_off =
+                                req->rq_mark;
+                        req->rq_fields[req->rq_nfields].hf_value.hv_len =
+                                req->rq_valend - req->rq_mark;
+                        ++req->rq_nfields;
+                        req->rq_state = c == '\r' ? HTTP_PARSE_FIELD_LF :
+                                                    HTTP_PARSE_FIELD;
+                        break;
+                case HTTP_PARSE_END_LF:
+                        if (c != '\n')
+                                goto malformed;
+                        goto done;
                 }
-
-                line->s_len = 0;
         }
-        if (string_free(&line) < 0)
-                warn("could not free string");
 
-        if (reqok) {
-                ep = hashmap_get(hp->sv_handlers, req->rq_resource);
-                if (ep != NULL) {
-                        hdlr = ep->he_value;
-                        hdlr->hh_fn(req, res);
-                } else {
-                        warn("no handler for %s", req->rq_resource);
-                }
+        req->rq_parsed = len;
+
+        /* the whole buffer and still no end of the header block */
+        if (len == ip->ib_insize) {
+                errno = EBADMSG;
+                return -1;
         }
 
-        (void)http_response_free(&res);
-        (void)http_request_free(&req);
+        return 0;
+done:
+        req->rq_parsed = req->rq_hdrlen = i + 1;
+        http_request_terminate(req);
+        return http_request_frame(req);
+malformed:
+        req->rq_parsed = i;
+        errno = EBADMSG;
+        return -1;
 }
 
-static struct http_request *
-http_request_new(int connfd)
+/* split the request target into path and query */
+static void
+http_request_target(struct http_request *req, const char *buf)
 {
-        struct http_request     *req = NULL;
-
-        req = malloc(sizeof(*req));
-        if (req == NULL)
-                goto ret;
-
-        req->rq_headers = hashmap_new(0);
-        if (req->rq_headers == NULL)
-                goto free_req;
-
-        req->rq_buf = iobuf_new(connfd, 0);
-        if (req->rq_buf == NULL)
-                goto free_headers;
-
-        req->rq_method = NULL;
-        req->rq_version = NULL;
-        req->rq_resource = NULL;
-        goto ret;
-free_headers:
-        (void)hashmap_free(&req->rq_headers);
-free_req:
-        free(req);
-        req = NULL;
-ret:
-        return req;
-
+        const char      *target = buf + req->rq_resource.hv_off;
+        const char      *q = NULL;
+        size_t          len = req->rq_resource.hv_len;
+
+        q = memchr(target, '?', len);
+        req->rq_path.hv_off = req->rq_resource.hv_off;
+        req->rq_path.hv_len = q != NULL ? (size_t)(q - target) : len;
+        req->rq_query.hv_off = req->rq_resource.hv_off + len;
+        req->rq_query.hv_len = 0;
+        if (q != NULL) {
+                req->rq_query.hv_off = q + 1 - buf;
+                req->rq_query.hv_len = len - (q + 1 - target);
+        }
 }
 
-static struct http_response *
-http_response_new(void)
+/*
+ * every view ends at a delimiter, so they can become c strings in place
+ * (rq_path's nul takes the place of the '?' inside rq_resource)
+ */
+static void
+http_request_terminate(struct http_request *req)
 {
-        struct http_response    *res = NULL;
-
-        res = malloc(sizeof(*res));
-        if (res == NULL)
-                return NULL;
-
-        res->rs_headers = hashmap_new(0);
-        if (res->rs_headers == NULL) {
-                free(res);
-                return NULL;
+        char    *buf = req->rq_buf->ib_inbufp;
+        size_t  i;
+
+        buf[req->rq_method.hv_off + req->rq_method.hv_len] = '\0';
+        buf[req->rq_resource.hv_off + req->rq_resource.hv_len] = '\0';
+        buf[req->rq_path.hv_off + req->rq_path.hv_len] = '\0';
+        buf[req->rq_version.hv_off + req->rq_version.hv_len] = '\0';
+        for (i = 0; i < req->rq_nfields; ++i) {
+                struct http_field       *fp = &req->rq_fields[i];
+
+                buf[fp->hf_name.hv_off + fp->hf_name.hv_len] = '\0';
+                buf[fp->hf_value.hv_off + fp->hf_value.hv_len] = '\0';
         }
-
-        res->rs_version = NULL;
-        res->rs_code = NULL;
-        res->rs_msg = NULL;
-        return res;
 }
 
-static int http_request_sanity(const struct http_request *req);
-
+/* where http_body_decode() resumes */
+enum http_body_state {
+        /* first hex digit of a chunk size */
+        HTTP_BODY_SIZE,
+        /* further hex digits of a chunk size */
+        HTTP_BODY_DIGITS,
+        /* chunk extension (ignored) */
+        HTTP_BODY_EXT,
+        HTTP_BODY_SIZE_LF,
+        /* rq_bodyleft bytes of data */
+        HTTP_BODY_DATA,
+        HTTP_BODY_DATA_CR,
+        HTTP_BODY_DATA_LF,
+        /* start of a trailer line (or the final empty line) */
+        HTTP_BODY_TRAILER,
+        /* rest of a trailer line (ignored) */
+        HTTP_BODY_TRAILER_LINE,
+        HTTP_BODY_END_LF,
+        HTTP_BODY_DONE,
+        /* malformed chunk framing */
+        HTTP_BODY_BAD,
+        /* chunks adding up to more than rq_maxbody */
+        HTTP_BODY_TOOBIG,
+};
+
+/*
+ * Work out how the body following a parsed header block is delimited
+ * (a request with both Transfer-Encoding and Content-Length, or with
+ * conflicting lengths, is rejected since proxies may disagree on it):
+ *
+ * ret:
+ *      1, or -1 with errno EBADMSG, ENOTSUP or EMSGSIZE
+ */
 static int
-http_request_free(struct http_request **reqp)
+http_request_frame(struct http_request *req)
 {
-        struct http_request     *req = NULL;
+        const char      *te = NULL;
+        const char      *cl = NULL;
+        const char      *expect = NULL;
+        size_t          len = 0;
+        size_t          i;
+
+        te = http_request_known(req, HTTP_HDR_TRANSFER_ENCODING);
+        cl = http_request_known(req, HTTP_HDR_CONTENT_LENGTH);
+
+        /* repeats are rare, only look for them if there is a body */
+        for (i = 0; (te != NULL || cl != NULL) && i < req->rq_nfields; ++i) {
+                struct http_field       *fp = &req->rq_fields[i];
+
+                if (fp->hf_id == HTTP_HDR_TRANSFER_ENCODING &&
+                    i + 1 != req->rq_known[fp->hf_id])
+                        goto malformed;
+                if (fp->hf_id == HTTP_HDR_CONTENT_LENGTH &&
+                    strcmp(cl, http_request_str(req, fp->hf_value)) != 0)
+                        goto malformed;
+        }
 
-        if (reqp == NULL) {
-                errno = EINVAL;
-                return -1;
+        req->rq_bodyoff = req->rq_hdrlen;
+        req->rq_bodyleft = 0;
+        req->rq_bodyread = 0;
+        req->rq_chunked = 0;
+        req->rq_bodystate = HTTP_BODY_DONE;
+        if (te != NULL) {
+                if (cl != NULL)
+                        goto malformed;
+                if (strcasecmp(te, "chunked") != 0) {
+                        errno = ENOTSUP;
+                        return -1;
+                }
+                req->rq_chunked = 1;
+                req->rq_bodystate = HTTP_BODY_SIZE;
+        } else if (cl != NULL) {
+                if (*cl == '\0')
+                        goto malformed;
+                for (; *cl != '\0'; ++cl) {
+                        if (*cl < '0' || *cl > '9')
+                                goto malformed;
+                        if (len > (SIZE_MAX - 9) / 10) {
+                                errno = EMSGSIZE;
+                                return -1;
+                        }
+                        len = len * 10 + (*cl - '0');
+                }
+                if (req->rq_maxbody > 0 && len > req->rq_maxbody) {
+                        errno = EMSGSIZE;
+                        return -1;
+                }
+                req->rq_bodyleft = len;
+                if (len > 0)
+                        req->rq_bodystate = HTTP_BODY_DATA;
         }
-        req = *reqp;
 
-        if (http_request_sanity(req) < 0)
-                return -1;
+        expect = http_request_known(req, HTTP_HDR_EXPECT);
+        req->rq_expect = req->rq_bodystate != HTTP_BODY_DONE &&
+                         expect != NULL && !strcasecmp(expect, "100-continue");
+        return 1;
+malformed:
+        errno = EBADMSG;
+        return -1;
+}
 
-        if (iobuf_free(&req->rq_buf) < 0)
-                return -1;
+char *
+http_request_str(struct http_request *req, struct http_view view)
+{
+        return req->rq_buf->ib_inbufp + view.hv_off;
+}
 
-        if (hashmap_for(req->rq_headers, free_hash_entry) < 0)
-                return -1;
+static void
+http_server_dispatch(struct http_server *hp,
+                     struct http_request *req,
+                     struct http_response *res)
+{
+        const struct route_table        *tab = hp->sv_table;
+        const struct route_node         *rn = NULL;
+        const struct http_middleware    *stage = NULL;
+        struct http_handler             *hdlr = NULL;
+        unsigned long long              nsent;
+        size_t                          outlen;
+        size_t                          i;
+
+        rn = route_match(tab, req);
+        if (rn == NULL) {
+                http_send_status(req, http_404);
+                return;
+        }
 
-        if (hashmap_free(&req->rq_headers) < 0)
-                return -1;
+        hdlr = tab->tb_handlers[rn->rn_handlers + req->rq_methodid];
+        if (hdlr == NULL) {
+                http_send_405(req, rn->rn_methods);
+                return;
+        }
 
-        free(req->rq_method);
-        free(req->rq_version);
-        free(req->rq_resource);
-        free(req);
-        *reqp = NULL;
-        return 0;
+        res->rs_req = req;
+        res->rs_status = 0;
+        res->rs_sent = 0;
+        res->rs_level = hp->sv_gzip_level;
+        res->rs_compress = 0;
+        req->rq_handler = hdlr;
+        stage = tab->tb_stages + rn->rn_stages;
+        for (i = 0; i < rn->rn_nstages; ++i, ++stage) {
+                if (stage->hm_fn(req, res, stage->hm_arg) < 0)
+                        return;
+        }
+
+        if (hdlr->hh_cache_ttl <= 0 ||
+            (req->rq_methodid != HTTP_METHOD_GET &&
+             req->rq_methodid != HTTP_METHOD_HEAD)) {
+                hdlr->hh_fn(req, res);
+                return;
+        }
+
+        if (cache_serve(hp->sv_cache, req))
+                return;
+
+        /* whatever the handler queues after outlen is its response */
+        outlen = req->rq_buf->ib_outlen;
+        nsent = req->rq_buf->ib_nsent;
+        cache_capture(hp->sv_cache, req);
+        hdlr->hh_fn(req, res);
+        cache_store(hp->sv_cache, req, outlen, nsent);
 }
 
-static int
-http_request_sanity(const struct http_request *req)
+static void
+http_send_status(struct http_request *req, const char *status)
 {
-        errno = EINVAL;
-        if (req == NULL)
-                return -1;
-        if (req->rq_buf == NULL)
-                return -1;
-        if (req->rq_headers == NULL)
-                return -1;
-        if (req->rq_method == NULL)
-                return -1;
-        if (req->rq_version == NULL)
-                return -1;
-        if (req->rq_resource == NULL)
-                return -1;
-        errno = 0;
-        return 0;
+        (void)iobuf_puts(req->rq_buf, status);
 }
 
+static const char *const http_method_names[] = {
+        [HTTP_METHOD_GET] = "GET",
+        [HTTP_METHOD_HEAD] = "HEAD",
+        [HTTP_METHOD_POST] = "POST",
+        [HTTP_METHOD_PUT] = "PUT",
+        [HTTP_METHOD_DELETE] = "DELETE",
+        [HTTP_METHOD_CONNECT] = "CONNECT",
+        [HTTP_METHOD_OPTIONS] = "OPTIONS",
+        [HTTP_METHOD_TRACE] = "TRACE",
+        [HTTP_METHOD_PATCH] = "PATCH",
+};
+
+/* 405 listing the methods the handler does serve */
 static void
-free_hash_entry(struct hash_entry *ep)
+http_send_405(struct http_request *req, unsigned methods)
 {
-        free(ep->he_key);
-        free(ep->he_value);
+        const char      *sep = "";
+        size_t          i;
+
+        (void)iobuf_puts(req->rq_buf, "HTTP/1.1 405 Method Not Allowed\r\n"
+                                      "Allow: ");
+        for (i = 1; i < sizeof(http_method_names) /
+                        sizeof(http_method_names[0]); ++i) {
+                if (!(methods & HTTP_METHOD_BIT(i)))
+                        continue;
+                (void)iobuf_printf(req->rq_buf, "%s%s", sep,
+                                   http_method_names[i]);
+                sep = ", ";
+        }
+        (void)iobuf_puts(req->rq_buf, "\r\nContent-Length: 0\r\n\r\n");
 }
 
-static int http_response_sanity(const struct http_response *res);
+/* preformatted status line of a status code */
+struct http_status {
+        const char      *hs_line;
+        size_t          hs_len;
+};
+
+#define HTTP_STATUS(code, reason)                                       \
+        [code] = { "HTTP/1.1 " #code " " reason "\r\n",                  \
+                   sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+/* status lines of http_response_status(), indexed by code */
+static const struct http_status http_status_lines[] = {
+        HTTP_STATUS(200, "OK"),
+        HTTP_STATUS(201, "Created"),
+        HTTP_STATUS(202, "Accepted"),
+        HTTP_STATUS(204, "No Content"),
+        HTTP_STATUS(206, "Partial Content"),
+        HTTP_STATUS(301, "Moved Permanently"),
+        HTTP_STATUS(302, "Found"),
+        HTTP_STATUS(303, "See Other"),
+        HTTP_STATUS(304, "Not Modified"),
+        HTTP_STATUS(307, "Temporary Redirect"),
+        HTTP_STATUS(308, "Permanent Redirect"),
+        HTTP_STATUS(400, "Bad Request"),
+        HTTP_STATUS(401, "Unauthorized"),
+        HTTP_STATUS(403, "Forbidden"),
+        HTTP_STATUS(404, "Not Found"),
+        HTTP_STATUS(405, "Method Not Allowed"),
+        HTTP_STATUS(406, "Not Acceptable"),
+        HTTP_STATUS(408, "Request Timeout"),
+        HTTP_STATUS(409, "Conflict"),
+        HTTP_STATUS(410, "Gone"),
+        HTTP_STATUS(411, "Length Required"),
+        HTTP_STATUS(412, "Precondition Failed"),
+        HTTP_STATUS(413, "Content Too Large"),
+        HTTP_STATUS(414, "URI Too Long"),
+        HTTP_STATUS(415, "Unsupported Media Type"),
+        HTTP_STATUS(416, "Range Not Satisfiable"),
+        HTTP_STATUS(417, "Expectation Failed"),
+        HTTP_STATUS(422, "Unprocessable Content"),
+        HTTP_STATUS(426, "Upgrade Required"),
+        HTTP_STATUS(429, "Too Many Requests"),
+        HTTP_STATUS(431, "Request Header Fields Too Large"),
+        HTTP_STATUS(500, "Internal Server Error"),
+        HTTP_STATUS(501, "Not Implemented"),
+        HTTP_STATUS(502, "Bad Gateway"),
+        HTTP_STATUS(503, "Service Unavailable"),
+        HTTP_STATUS(504, "Gateway Timeout"),
+        HTTP_STATUS(505, "HTTP Version Not Supported"),
+};
+
+/* Date header of the current second, one per thread */
+struct http_date {
+        time_t  hd_sec;
+        size_t  hd_len;
+        char    hd_line[48];
+};
+
+static _Thread_local struct http_date http_date_cache = { .hd_sec = -1 };
+
+/* "Date: ...\r\n" for now, formatted again only once the second changes */
+static const struct http_date *
+http_date(void)
+{
+        struct http_date        *dp = &http_date_cache;
+        struct tm               tm;
+        time_t                  now;
+
+        now = time(NULL);
+        if (now != dp->hd_sec) {
+                (void)gmtime_r(&now, &tm);
+                dp->hd_len = strftime(dp->hd_line, sizeof(dp->hd_line),
+                                      "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                                      &tm);
+                dp->hd_sec = now;
+        }
+
+        return dp;
+}
 
-static int
-http_response_free(struct http_response **resp)
+const char *
+http_response_date(size_t *lenp)
+{
+        const struct http_date  *dp = http_date();
+
+        *lenp = dp->hd_len;
+        return dp->hd_line;
+}
+
+/* status line of a code (NULL if there is none in the table) */
+static const struct http_status *
+http_status_line(int status)
+{
+        if (status < 0 || (size_t)status >= sizeof(http_status_lines) /
+                                            sizeof(http_status_lines[0]))
+                return NULL;
+        if (http_status_lines[status].hs_line == NULL)
+                return NULL;
+
+        return &http_status_lines[status];
+}
+
+int
+http_response_status(struct http_response *res, int status)
 {
-        struct http_response    *res = NULL;
+        const struct http_status        *sp = NULL;
+        const struct http_date          *dp = NULL;
+        struct iobuf                    *ip = res->rs_req->rq_buf;
 
-        if (resp == NULL) {
+        sp = http_status_line(status);
+        if (res->rs_status != 0 || sp == NULL) {
                 errno = EINVAL;
                 return -1;
         }
 
-        res = *resp;
-        if (http_response_sanity(res) < 0)
+        dp = http_date();
+        if (iobuf_write(ip, sp->hs_line, sp->hs_len) < 0 ||
+            iobuf_write(ip, dp->hd_line, dp->hd_len) < 0)
                 return -1;
 
-        if (hashmap_for(res->rs_headers, free_hash_entry) < 0)
+        res->rs_status = status;
+        return 0;
+}
+
+int
+http_response_header(struct http_response *res,
+                     const char *name,
+                     const char *value)
+{
+        struct iobuf    *ip = res->rs_req->rq_buf;
+        size_t          namelen = strlen(name);
+        size_t          vallen = strlen(value);
+
+        /* a CR or LF in either would end the header (or the block) early */
+        if (res->rs_sent || namelen == 0 ||
+            scan_stop(name, namelen, SCAN_TOKEN) != namelen ||
+            scan_stop(value, vallen, SCAN_VALUE) != vallen) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (res->rs_status == 0 && http_response_status(res, 200) < 0)
                 return -1;
 
-        if (hashmap_free(&res->rs_headers) < 0)
+        /* a body coded by the handler is not coded again */
+        if (strcasecmp(name, "Content-Encoding") == 0)
+                res->rs_compress = -1;
+        else if (res->rs_compress >= 0 &&
+                 strcasecmp(name, "Content-Type") == 0)
+                res->rs_compress = gzip_type(value);
+
+        if (iobuf_write(ip, name, namelen) < 0 ||
+            iobuf_write(ip, ": ", 2) < 0 ||
+            iobuf_write(ip, value, vallen) < 0 ||
+            iobuf_write(ip, "\r\n", 2) < 0)
                 return -1;
 
-        /* have no added code to initialize these yet
-        free(res->rs_code);
-        free(res->rs_msg);
-        free(res->rs_version);
-        */
-        free(res);
-        *resp = NULL;
         return 0;
 }
 
+/* names of the codings, preferred first */
+static const char *const http_codings[GZIP_NFORMATS] = {
+        [GZIP_GZIP] = "gzip",
+        [GZIP_DEFLATE] = "deflate",
+};
+
+/*
+ * code a body with the first coding the client accepts (into the
+ * thread's gzip buffer), unless that would not make it any smaller
+ */
 static int
-http_response_sanity(const struct http_response *res)
+http_response_compress(struct http_response *res,
+                       const void **bodyp,
+                       size_t *lenp)
 {
-        errno = 0;
-        if (res == NULL)
-                return -1;
-        if (res->rs_headers == NULL)
-                return -1;
-        /* have no added code to initialize these yet
-        if (res->rs_code == NULL)
-                return -1;
-        if (res->rs_msg == NULL)
+        struct iobuf    *ip = res->rs_req->rq_buf;
+        const void      *zbody = NULL;
+        ssize_t         zlen;
+        int             format;
+
+        /* caches must tell the codings apart, coded or not */
+        if (iobuf_puts(ip, "Vary: Accept-Encoding\r\n") < 0)
                 return -1;
-        if (res->rs_version == NULL)
+
+        for (format = 0; format < GZIP_NFORMATS; ++format) {
+                if (http_request_accepts(res->rs_req, http_codings[format]))
+                        break;
+        }
+        if (format == GZIP_NFORMATS)
+                return 0;
+
+        zlen = gzip_buf(format, res->rs_level, *bodyp, *lenp, &zbody);
+        if (zlen < 0 || (size_t)zlen >= *lenp)
+                return 0;
+
+        if (iobuf_puts(ip, "Content-Encoding: ") < 0 ||
+            iobuf_puts(ip, http_codings[format]) < 0 ||
+            iobuf_write(ip, "\r\n", 2) < 0)
                 return -1;
-                */
-        errno = 0;
+
+        *bodyp = zbody;
+        *lenp = zlen;
         return 0;
 }
 
-static int http_server_sanity(const struct http_server *server);
-
 int
-http_server_free(struct http_server **hpp)
+http_response_send(struct http_response *res, const void *body, size_t len)
 {
-        struct http_server      *hp = NULL;
+        struct iobuf    *ip = res->rs_req->rq_buf;
+        char            hdr[48];
+        char            *p = hdr + sizeof(hdr);
+        size_t          n;
 
-        if (hpp == NULL) {
+        if (res->rs_sent) {
                 errno = EINVAL;
                 return -1;
         }
+        if (res->rs_status == 0 && http_response_status(res, 200) < 0)
+                return -1;
+        res->rs_sent = 1;
 
-        hp = *hpp;
-        if (http_server_sanity(hp) < 0)
+        if (res->rs_compress > 0 && res->rs_level > 0 &&
+            res->rs_status == 200 && len >= GZIP_MIN &&
+            http_response_compress(res, &body, &len) < 0)
                 return -1;
 
-        if (hashmap_for(hp->sv_handlers, free_hash_entry) < 0)
+        /* "Content-Length: <len>\r\n\r\n", digits written backwards */
+        n = len;
+        *--p = '\n';
+        *--p = '\r';
+        *--p = '\n';
+        *--p = '\r';
+        do {
+                *--p = '0' + n % 10;
+                n /= 10;
+        } while (n > 0);
+        p -= sizeof("Content-Length: ") - 1;
+        memcpy(p, "Content-Length: ", sizeof("Content-Length: ") - 1);
+
+        /* no body (and so no length) for these */
+        if (res->rs_status == 204 || res->rs_status == 304) {
+                p = hdr + sizeof(hdr) - 2;
+                len = 0;
+        }
+        if (iobuf_write(ip, p, hdr + sizeof(hdr) - p) < 0)
                 return -1;
 
-        if (hashmap_free(&hp->sv_handlers) < 0)
+        if (len > 0 && res->rs_req->rq_methodid != HTTP_METHOD_HEAD &&
+            iobuf_write(ip, body, len) < 0)
                 return -1;
 
-        return close(hp->sv_fd);
+        return iobuf_flush_out(ip);
 }
 
+/* response of http_server_add_static_response(), serialized once */
+struct http_static {
+        /* read-only, page aligned mapping: header block then body */
+        char    *st_buf;
+        /* length of the status line (the Date line is sent after it) */
+        size_t  st_linelen;
+        /* length of the header block */
+        size_t  st_hdrlen;
+        /* length of the whole response */
+        size_t  st_len;
+        /* size of the mapping */
+        size_t  st_mapsize;
+};
+
+static void http_static_send(struct http_request *req,
+                             struct http_response *res);
+static void http_static_free(void *arg);
+
+/* header lines the server writes itself */
+static const char *const http_static_own[] = {
+        "Content-Length",
+        "Date",
+        "Transfer-Encoding",
+};
+
+/* whether headers are "name: value\r\n" lines, none of them our own */
 static int
-http_parse_first_line(struct http_request *req, char *linep)
+http_static_headers_ok(const char *p)
 {
-        char    *method = NULL;
-        char    *resource = NULL;
-        char    *version = NULL;
+        const char      *eol = NULL;
+        size_t          n;
+        size_t          i;
+
+        for (; *p != '\0'; p = eol + 2) {
+                eol = strstr(p, "\r\n");
+                if (eol == NULL)
+                        return 0;
+
+                n = scan_stop(p, eol - p, SCAN_TOKEN);
+                if (n == 0 || p[n] != ':' ||
+                    scan_stop(p + n + 1, eol - (p + n + 1), SCAN_VALUE) !=
+                    (size_t)(eol - (p + n + 1)))
+                        return 0;
+
+                for (i = 0; i < sizeof(http_static_own) /
+                                sizeof(http_static_own[0]); ++i) {
+                        if (strlen(http_static_own[i]) == n &&
+                            strncasecmp(p, http_static_own[i], n) == 0)
+                                return 0;
+                }
+        }
 
-        method = strsep(&linep, " ");
-        if (method == NULL)
-                return -1;
+        return 1;
+}
 
-        resource = strsep(&linep, " ");
-        if (resource == NULL)
+int
+http_server_add_static_response(struct http_server *hp,
+                                const char *path,
+                                int status,
+                                const char *headers,
+                                const char *body)
+{
+        const struct http_status        *sp = NULL;
+        struct http_handler             *hdlr = NULL;
+        struct http_static              *st = NULL;
+        char                            clen[48];
+        char                            *p = NULL;
+        size_t                          hlen;
+        size_t                          blen;
+        size_t                          clenlen = 0;
+        int                             saved_errno;
+
+        /* an interim (1xx) response can't be the final answer */
+        sp = http_status_line(status);
+        if (sp == NULL || status < 200 ||
+            (headers != NULL && !http_static_headers_ok(headers))) {
+                errno = EINVAL;
                 return -1;
-
-        version = strsep(&linep, "\r");
-        if (version == NULL)
+        }
+        hlen = headers != NULL ? strlen(headers) : 0;
+        blen = body != NULL ? strlen(body) : 0;
+        /* no body (and so no length) for these */
+        if (status == 204 || status == 304)
+                blen = 0;
+        else
+                clenlen = snprintf(clen, sizeof(clen),
+                                   "Content-Length: %zu\r\n", blen);
+
+        st = malloc(sizeof(*st));
+        if (st == NULL)
                 return -1;
 
-        req->rq_method = strdup(method);
-        if (req->rq_method == NULL)
-                return -1;
+        st->st_linelen = sp->hs_len;
+        st->st_hdrlen = sp->hs_len + hlen + clenlen + 2;
+        st->st_len = st->st_hdrlen + blen;
+        st->st_mapsize = st->st_len;
+        st->st_buf = mmap(NULL, st->st_mapsize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (st->st_buf == MAP_FAILED)
+                goto free_st;
+
+        p = mempcpy(st->st_buf, sp->hs_line, sp->hs_len);
+        if (hlen > 0)
+                p = mempcpy(p, headers, hlen);
+        p = mempcpy(p, clen, clenlen);
+        p = mempcpy(p, "\r\n", 2);
+        if (blen > 0)
+                memcpy(p, body, blen);
+
+        /* shared by every worker, nothing writes it again */
+        if (mprotect(st->st_buf, st->st_mapsize, PROT_READ) < 0)
+                goto unmap;
+
+        hdlr = calloc(1, sizeof(*hdlr));
+        if (hdlr == NULL)
+                goto unmap;
+
+        hdlr->hh_fn = http_static_send;
+        hdlr->hh_arg = st;
+        hdlr->hh_free = http_static_free;
+        hdlr->hh_methods = HTTP_METHOD_BIT(HTTP_METHOD_GET) |
+                           HTTP_METHOD_BIT(HTTP_METHOD_HEAD);
+        if (http_server_route(hp, path, hdlr) < 0)
+                goto free_hdlr;
 
-        req->rq_resource = strdup(resource);
-        if (req->rq_resource == NULL) {
-                free(req->rq_method);
-                req->rq_method = NULL;
-                return -1;
+        return 0;
+free_hdlr:
+        saved_errno = errno;
+        free(hdlr);
+        errno = saved_errno;
+unmap:
+        saved_errno = errno;
+        (void)munmap(st->st_buf, st->st_mapsize);
+        errno = saved_errno;
+free_st:
+        saved_errno = errno;
+        free(st);
+        errno = saved_errno;
+        return -1;
+}
+
+/*
+ * queue the serialized response by reference around a copy of the
+ * thread's Date line, HEAD gets the headers
+ */
+static void
+http_static_send(struct http_request *req, struct http_response *res)
+{
+        const struct http_static        *st = req->rq_handler->hh_arg;
+        struct iovec                    iov;
+        const char                      *date = NULL;
+        size_t                          datelen;
+
+        iov.iov_base = st->st_buf;
+        iov.iov_len = st->st_linelen;
+        (void)iobuf_writev(req->rq_buf, &iov, 1);
+
+        date = http_response_date(&datelen);
+        (void)iobuf_write(req->rq_buf, date, datelen);
+
+        iov.iov_base = st->st_buf + st->st_linelen;
+        iov.iov_len = (req->rq_methodid == HTTP_METHOD_HEAD ? st->st_hdrlen :
+                                                              st->st_len) -
+                      st->st_linelen;
+        (void)iobuf_writev(req->rq_buf, &iov, 1);
+        (void)iobuf_flush_out(req->rq_buf);
+}
+
+static void
+http_static_free(void *arg)
+{
+        struct http_static      *st = arg;
+
+        (void)munmap(st->st_buf, st->st_mapsize);
+        free(st);
+}
+
+/* up to 8 bytes as one integer, so a token is matched by one compare */
+static uint64_t
+http_word(const char *p, size_t len)
+{
+        uint64_t        w = 0;
+
+        memcpy(&w, p, len);
+        return w;
+}
+
+static enum http_method
+http_method_id(const char *method, size_t len)
+{
+        uint64_t        w;
+
+        if (len < 3 || len > 7)
+                return HTTP_METHOD_OTHER;
+
+        w = http_word(method, len);
+        switch (len) {
+        case 3:
+                if (w == http_word("GET", 3))
+                        return HTTP_METHOD_GET;
+                if (w == http_word("PUT", 3))
+                        return HTTP_METHOD_PUT;
+                break;
+        case 4:
+                if (w == http_word("HEAD", 4))
+                        return HTTP_METHOD_HEAD;
+                if (w == http_word("POST", 4))
+                        return HTTP_METHOD_POST;
+                break;
+        case 5:
+                if (w == http_word("TRACE", 5))
+                        return HTTP_METHOD_TRACE;
+                if (w == http_word("PATCH", 5))
+                        return HTTP_METHOD_PATCH;
+                break;
+        case 6:
+                if (w == http_word("DELETE", 6))
+                        return HTTP_METHOD_DELETE;
+                break;
+        case 7:
+                if (w == http_word("OPTIONS", 7))
+                        return HTTP_METHOD_OPTIONS;
+                if (w == http_word("CONNECT", 7))
+                        return HTTP_METHOD_CONNECT;
+                break;
         }
 
-        req->rq_version = strdup(version);
-        if (req->rq_version == NULL) {
-                free(req->rq_method);
-                req->rq_method = NULL;
-                free(req->rq_resource);
-                req->rq_resource = NULL;
+        return HTTP_METHOD_OTHER;
+}
+
+static enum http_version
+http_version_id(const char *version, size_t len)
+{
+        uint64_t        w;
+
+        if (len != 8)
+                return HTTP_VERSION_OTHER;
+
+        w = http_word(version, 8);
+        if (w == http_word("HTTP/1.1", 8))
+                return HTTP_VERSION_1_1;
+        if (w == http_word("HTTP/1.0", 8))
+                return HTTP_VERSION_1_0;
+
+        return HTTP_VERSION_OTHER;
+}
+
+/*
+ * whether the header block of a further request is already buffered (it
+ * starts at rq_bodyoff, so only once the body is read or skipped)
+ */
+static int
+http_request_buffered(struct http_request *req)
+{
+        struct iobuf    *ip = req->rq_buf;
+
+        return memmem(ip->ib_inbufp + req->rq_bodyoff,
+                      ip->ib_inendp - ip->ib_inbufp - req->rq_bodyoff,
+                      "\r\n\r\n", 4) != NULL;
+}
+
+static int
+http_request_flush(struct http_request *req)
+{
+        /*
+         * pipelined requests get their responses in one write; a blank
+         * line in a body still unread must not be taken for one
+         */
+        if (http_request_skip_body(req) && http_request_buffered(req))
+                return 0;
+
+        if (iobuf_uncork(req->rq_buf) < 0)
                 return -1;
+
+        return iobuf_cork(req->rq_buf);
+}
+
+static int http_token_has(const char *list, const char *token);
+
+static int
+http_request_keepalive(struct http_request *req)
+{
+        char    *conn = NULL;
+
+        /* an unread rest of the body would be taken for the next request */
+        if (!http_request_skip_body(req))
+                return 0;
+
+        /*
+         * HTTP/1.0 keep-alive only works if the response says so too and
+         * handlers write their own headers, so 1.0 clients get one request
+         */
+        if (req->rq_versionid != HTTP_VERSION_1_1)
+                return 0;
+
+        conn = http_request_known(req, HTTP_HDR_CONNECTION);
+        return conn == NULL || !http_token_has(conn, "close");
+}
+
+static int
+http_token_has(const char *list, const char *token)
+{
+        size_t  toklen;
+
+        toklen = strlen(token);
+        while (*list != '\0') {
+                size_t  len;
+
+                list += strspn(list, " \t,");
+                len = strcspn(list, ",");
+                while (len > 0 && (list[len - 1] == ' ' ||
+                                   list[len - 1] == '\t'))
+                        --len;
+                if (len == toklen && !strncasecmp(list, token, len))
+                        return 1;
+                list += strcspn(list, ",");
         }
 
         return 0;
 }
 
+/*
+ * Perfect hash of the known header names, case insensitive: the weights
+ * of the first, last and fourth to last bytes make every name in
+ * http_header_names hash to a slot of its own; both tables are output
+ * of ./hdrhash.py, run it again after changing the names
+ */
+static const unsigned char http_header_asso[256] = {
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 32,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0, 33,  0, 41, 33, 62, 18,  5, 18, 25,  0, 18, 29, 54, 17, 12,
+        13,  0, 18, 35, 57, 58, 26, 26, 12,  0,  0,  0,  0,  0,  0,  0,
+         0, 33,  0, 41, 33, 62, 18,  5, 18, 25,  0, 18, 29, 54, 17, 12,
+        13,  0, 18, 35, 57, 58, 26, 26, 12,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+         0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+/* enum http_header + 1 of the name hashing to each slot (0 if none) */
+static const unsigned char http_header_slots[64] = {
+        22, 20, 39, 23, 13,  0, 25,  0,
+        45,  1, 15, 31,  7, 41, 16,  0,
+         0, 37, 33,  0, 19, 27,  3,  0,
+        40, 21, 10,  0,  0,  0, 17,  9,
+         0, 18,  5,  0,  0, 32,  0, 42,
+         4, 30, 28, 35, 11,  0,  0,  0,
+        36,  0, 34,  0, 38,  0, 29, 24,
+         6, 12,  2, 43, 26,  8, 14, 44,
+};
+
+static const char *const http_header_names[HTTP_HDR_OTHER] = {
+        [HTTP_HDR_ACCEPT] = "Accept",
+        [HTTP_HDR_ACCEPT_CHARSET] = "Accept-Charset",
+        [HTTP_HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+        [HTTP_HDR_ACCEPT_LANGUAGE] = "Accept-Language",
+        [HTTP_HDR_ACCEPT_RANGES] = "Accept-Ranges",
+        [HTTP_HDR_AUTHORIZATION] = "Authorization",
+        [HTTP_HDR_CACHE_CONTROL] = "Cache-Control",
+        [HTTP_HDR_CONNECTION] = "Connection",
+        [HTTP_HDR_CONTENT_ENCODING] = "Content-Encoding",
+        [HTTP_HDR_CONTENT_LENGTH] = "Content-Length",
+        [HTTP_HDR_CONTENT_TYPE] = "Content-Type",
+        [HTTP_HDR_COOKIE] = "Cookie",
+        [HTTP_HDR_DATE] = "Date",
+        [HTTP_HDR_DNT] = "DNT",
+        [HTTP_HDR_EXPECT] = "Expect",
+        [HTTP_HDR_FORWARDED] = "Forwarded",
+        [HTTP_HDR_FROM] = "From",
+        [HTTP_HDR_HOST] = "Host",
+        [HTTP_HDR_IF_MATCH] = "If-Match",
+        [HTTP_HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+        [HTTP_HDR_IF_NONE_MATCH] = "If-None-Match",
+        [HTTP_HDR_IF_RANGE] = "If-Range",
+        [HTTP_HDR_IF_UNMODIFIED_SINCE] = "If-Unmodified-Since",
+        [HTTP_HDR_KEEP_ALIVE] = "Keep-Alive",
+        [HTTP_HDR_MAX_FORWARDS] = "Max-Forwards",
+        [HTTP_HDR_ORIGIN] = "Origin",
+        [HTTP_HDR_PRAGMA] = "Pragma",
+        [HTTP_HDR_PROXY_AUTHORIZATION] = "Proxy-Authorization",
+        [HTTP_HDR_RANGE] = "Range",
+        [HTTP_HDR_REFERER] = "Referer",
+        [HTTP_HDR_SEC_FETCH_DEST] = "Sec-Fetch-Dest",
+        [HTTP_HDR_SEC_FETCH_MODE] = "Sec-Fetch-Mode",
+        [HTTP_HDR_SEC_FETCH_SITE] = "Sec-Fetch-Site",
+        [HTTP_HDR_TE] = "TE",
+        [HTTP_HDR_TRAILER] = "Trailer",
+        [HTTP_HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+        [HTTP_HDR_UPGRADE] = "Upgrade",
+        [HTTP_HDR_UPGRADE_INSECURE_REQUESTS] = "Upgrade-Insecure-Requests",
+        [HTTP_HDR_USER_AGENT] = "User-Agent",
+        [HTTP_HDR_VIA] = "Via",
+        [HTTP_HDR_X_FORWARDED_FOR] = "X-Forwarded-For",
+        [HTTP_HDR_X_FORWARDED_HOST] = "X-Forwarded-Host",
+        [HTTP_HDR_X_FORWARDED_PROTO] = "X-Forwarded-Proto",
+        [HTTP_HDR_X_REAL_IP] = "X-Real-IP",
+        [HTTP_HDR_X_REQUESTED_WITH] = "X-Requested-With",
+};
+
+static enum http_header
+http_header_id(const char *name, size_t len)
+{
+        const unsigned char     *p = (const unsigned char *)name;
+        const char              *known = NULL;
+        unsigned                slot;
+
+        if (len == 0)
+                return HTTP_HDR_OTHER;
+
+        slot = len + http_header_asso[p[0]] + http_header_asso[p[len - 1]] +
+               http_header_asso[p[len >= 4 ? len - 4 : 0]];
+        slot = http_header_slots[slot % 64];
+        if (slot == 0)
+                return HTTP_HDR_OTHER;
+
+        known = http_header_names[slot - 1];
+        if (strncasecmp(known, name, len) != 0 || known[len] != '\0')
+                return HTTP_HDR_OTHER;
+
+        return slot - 1;
+}
+
+/* hdrhash.py output must still match http_header_names (debug builds) */
+static void
+http_header_check(void)
+{
+        size_t  i;
+
+        for (i = 0; i < HTTP_HDR_OTHER; ++i)
+                assert(http_header_id(http_header_names[i],
+                                      strlen(http_header_names[i])) == i);
+}
+
+char *
+http_request_known(struct http_request *req, enum http_header hdr)
+{
+        unsigned char   idx;
+
+        if (req == NULL || hdr < 0 || hdr >= HTTP_HDR_OTHER)
+                return NULL;
+
+        idx = req->rq_known[hdr];
+        if (idx == 0)
+                return NULL;
+
+        return http_request_str(req, req->rq_fields[idx - 1].hf_value);
+}
+
+char *
+http_request_header(struct http_request *req, const char *name)
+{
+        enum http_header        id;
+        size_t                  namelen;
+        size_t                  i;
+
+        if (req == NULL || name == NULL)
+                return NULL;
+
+        namelen = strlen(name);
+        id = http_header_id(name, namelen);
+        if (id != HTTP_HDR_OTHER)
+                return http_request_known(req, id);
+
+        /* the rest are few, a scan of the fields not known is enough */
+        for (i = 0; i < req->rq_nfields; ++i) {
+                struct http_field       *fp = &req->rq_fields[i];
+
+                if (fp->hf_id == HTTP_HDR_OTHER &&
+                    fp->hf_name.hv_len == namelen &&
+                    !strncasecmp(http_request_str(req, fp->hf_name), name,
+                                 namelen))
+                        return http_request_str(req, fp->hf_value);
+        }
+
+        return NULL;
+}
+
+/* whether a qvalue ("0", "0.000", "0.5", "1") is zero */
 static int
-http_parse_header(struct http_request *req, char *linep)
+http_qzero(const char *q, size_t len)
 {
-        struct hash_entry       *p = NULL;
-        char                    *header = NULL;
-        char                    *value = NULL;
+        size_t  i;
 
-        header = strsep(&linep, ":");
-        if (header == NULL)
-                return -1;
+        if (len == 0 || q[0] != '0')
+                return 0;
+        for (i = 1; i < len; ++i) {
+                if (q[i] != '.' && q[i] != '0')
+                        return 0;
+        }
 
-        if (linep == NULL)
-                return -1;
+        return 1;
+}
 
-        ++linep;
-        value = strsep(&linep, "\r");
-        if (value == NULL)
-                return -1;
+int
+http_request_accepts(struct http_request *req, const char *coding)
+{
+        const char      *p = NULL;
+        const char      *tok = NULL;
+        const char      *q = NULL;
+        size_t          codinglen = strlen(coding);
+        size_t          toklen;
+        int             any = 0;
+        int             ok;
+
+        p = http_request_known(req, HTTP_HDR_ACCEPT_ENCODING);
+        if (p == NULL)
+                return 0;
+
+        /* "gzip, deflate;q=0.5, *;q=0" */
+        for (;;) {
+                p += strspn(p, " \t,");
+                if (*p == '\0')
+                        break;
+                tok = p;
+                toklen = strcspn(p, " \t;,");
+                p += toklen;
+
+                /* of the parameters only q matters */
+                ok = 1;
+                for (;;) {
+                        p += strspn(p, " \t");
+                        if (*p != ';')
+                                break;
+                        p += 1 + strspn(p + 1, " \t");
+                        if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                                q = p + 2;
+                                ok = !http_qzero(q, strcspn(q, " \t;,"));
+                        }
+                        p += strcspn(p, ";,");
+                }
 
-        p = hashmap_get(req->rq_headers, header);
-        if (p != NULL) {
-                value = strdup(value);
-                if (value == NULL)
-                        return -1;
-                free(p->he_value);
-                p->he_value = value;
-        } else {
-                header = strdup(header);
-                if (header == NULL)
-                        return -1;
-                value = strdup(value);
-                if (value == NULL) {
-                        free(header);
-                        return -1;
+                /* the coding by name overrides "*" */
+                if (toklen == codinglen &&
+                    strncasecmp(tok, coding, codinglen) == 0)
+                        return ok;
+                if (toklen == 1 && *tok == '*')
+                        any = ok;
+        }
+
+        return any;
+}
+
+static void http_query_split(struct http_request *req);
+const struct http_view *
+http_request_capture(struct http_request *req, const char *name)
+{
+        size_t  i;
+
+        for (i = 0; i < req->rq_ncaptures; ++i) {
+                if (strcmp(req->rq_captures[i].hc_name, name) == 0)
+                        return &req->rq_captures[i].hc_value;
+        }
+
+        return NULL;
+}
+
+static size_t http_unescape(char *s, size_t len);
+
+char *
+http_request_query(struct http_request *req, const char *key)
+{
+        char    *buf = NULL;
+        size_t  keylen;
+        size_t  i;
+
+        if (req == NULL || key == NULL || req->rq_hdrlen == 0)
+                return NULL;
+
+        if (!req->rq_split)
+                http_query_split(req);
+
+        buf = req->rq_buf->ib_inbufp;
+        keylen = strlen(key);
+        for (i = 0; i < req->rq_nparams; ++i) {
+                struct http_param       *qp = &req->rq_params[i];
+                char                    *value = NULL;
+
+                if (qp->hq_key.hv_len != keylen ||
+                    memcmp(buf + qp->hq_key.hv_off, key, keylen) != 0)
+                        continue;
+
+                value = buf + qp->hq_value.hv_off;
+                if (!qp->hq_decoded) {
+                        qp->hq_value.hv_len = http_unescape(value,
+                                                qp->hq_value.hv_len);
+                        value[qp->hq_value.hv_len] = '\0';
+                        qp->hq_decoded = 1;
                 }
-                p = hashmap_set(req->rq_headers, header, value);
-                if (p == NULL) {
-                        free(header);
-                        free(value);
-                        return -1;
+                return value;
+        }
+
+        return NULL;
+}
+
+/*
+ * Record the "key=value" pairs of rq_query, nul terminating keys and
+ * values in place ('=' and '&' make room for it); keys are decoded now
+ * since every lookup compares them, values only when asked for
+ */
+static void
+http_query_split(struct http_request *req)
+{
+        char    *buf = req->rq_buf->ib_inbufp;
+        char    *p = buf + req->rq_query.hv_off;
+        char    *end = p + req->rq_query.hv_len;
+
+        req->rq_split = 1;
+        while (p < end && req->rq_nparams < HTTP_MAX_PARAMS) {
+                struct http_param       *qp = &req->rq_params[req->rq_nparams];
+                char                    *amp = NULL;
+                char                    *eq = NULL;
+
+                amp = memchr(p, '&', end - p);
+                if (amp == NULL)
+                        amp = end;
+                eq = memchr(p, '=', amp - p);
+                if (eq == NULL)
+                        eq = amp;
+
+                if (eq > p) {
+                        qp->hq_key.hv_off = p - buf;
+                        qp->hq_key.hv_len = http_unescape(p, eq - p);
+                        qp->hq_value.hv_off = eq + (eq < amp) - buf;
+                        qp->hq_value.hv_len = amp - (eq + (eq < amp));
+                        qp->hq_decoded = 0;
+                        p[qp->hq_key.hv_len] = '\0';
+                        *amp = '\0';
+                        ++req->rq_nparams;
+                }
+                p = amp + 1;
+        }
+}
+
+static int http_hex(char c);
+
+/* percent-decode (and '+' to space) in place, returns the new length */
+static size_t
+http_unescape(char *s, size_t len)
+{
+        size_t  i;
+        size_t  j;
+        int     hi;
+        int     lo;
+
+        for (i = j = 0; i < len; ++i, ++j) {
+                if (s[i] == '+') {
+                        s[j] = ' ';
+                        continue;
+                }
+                if (s[i] == '%' && i + 2 < len) {
+                        hi = http_hex(s[i + 1]);
+                        lo = http_hex(s[i + 2]);
+                        if (hi >= 0 && lo >= 0) {
+                                s[j] = hi << 4 | lo;
+                                i += 2;
+                                continue;
+                        }
                 }
+                s[j] = s[i];
+        }
+
+        return j;
+}
+
+static ssize_t http_body_decode(struct http_request *req,
+                                char *buf,
+                                size_t len);
+static int http_request_fill(struct http_request *req);
+
+ssize_t
+http_request_read_body(struct http_request *req, void *buf, size_t len)
+{
+        ssize_t n;
+
+        if (req == NULL || req->rq_hdrlen == 0 || (buf == NULL && len > 0)) {
+                errno = EINVAL;
+                return -1;
         }
 
+        for (;;) {
+                n = http_body_decode(req, buf, len);
+                if (n != 0 || len == 0 || req->rq_bodystate == HTTP_BODY_DONE)
+                        return n;
+
+                if (http_request_fill(req) < 0)
+                        return -1;
+        }
+}
+
+static int http_body_chunk(struct http_request *req);
+
+/*
+ * Decode the body bytes rq_buf holds without reading any more (buf may
+ * be NULL to drop them):
+ *
+ * ret:
+ *      number of bytes stored, 0 if all input is used up or the body is
+ *      complete, -1 with errno EBADMSG or EMSGSIZE
+ */
+static ssize_t
+http_body_decode(struct http_request *req, char *buf, size_t len)
+{
+        struct iobuf    *ip = req->rq_buf;
+        const char      *in = ip->ib_inbufp;
+        size_t          end = ip->ib_inendp - ip->ib_inbufp;
+        size_t          off = req->rq_bodyoff;
+        size_t          stored = 0;
+        size_t          n;
+        int             digit;
+        char            c;
+
+        while (off < end && stored < len) {
+                int     *state = &req->rq_bodystate;
+
+                if (*state == HTTP_BODY_DATA) {
+                        n = end - off;
+                        if (n > len - stored)
+                                n = len - stored;
+                        if (n > req->rq_bodyleft)
+                                n = req->rq_bodyleft;
+                        /* http_request_buffer() decodes within rq_buf */
+                        if (buf != NULL)
+                                memmove(buf + stored, in + off, n);
+                        off += n;
+                        stored += n;
+                        req->rq_bodyleft -= n;
+                        req->rq_bodyread += n;
+                        if (req->rq_bodyleft == 0)
+                                *state = req->rq_chunked ? HTTP_BODY_DATA_CR :
+                                                           HTTP_BODY_DONE;
+                        continue;
+                }
+                if (*state == HTTP_BODY_DONE || *state == HTTP_BODY_BAD ||
+                    *state == HTTP_BODY_TOOBIG)
+                        break;
+
+                c = in[off++];
+                switch (*state) {
+                case HTTP_BODY_SIZE:
+                case HTTP_BODY_DIGITS:
+                        digit = http_hex(c);
+                        if (digit >= 0) {
+                                if (req->rq_bodyleft > SIZE_MAX >> 4) {
+                                        *state = HTTP_BODY_TOOBIG;
+                                        break;
+                                }
+                                req->rq_bodyleft = req->rq_bodyleft << 4 |
+                                                   digit;
+                                *state = HTTP_BODY_DIGITS;
+                        } else if (*state == HTTP_BODY_SIZE) {
+                                *state = HTTP_BODY_BAD;
+                        } else if (c == ';' || c == ' ' || c == '\t') {
+                                *state = HTTP_BODY_EXT;
+                        } else if (c == '\r') {
+                                *state = HTTP_BODY_SIZE_LF;
+                        } else if (c == '\n') {
+                                (void)http_body_chunk(req);
+                        } else {
+                                *state = HTTP_BODY_BAD;
+                        }
+                        break;
+                case HTTP_BODY_EXT:
+                        if (c == '\r')
+                                *state = HTTP_BODY_SIZE_LF;
+                        else if (c == '\n')
+                                (void)http_body_chunk(req);
+                        break;
+                case HTTP_BODY_SIZE_LF:
+                        if (c != '\n')
+                                *state = HTTP_BODY_BAD;
+                        else
+                                (void)http_body_chunk(req);
+                        break;
+                case HTTP_BODY_DATA_CR:
+                        if (c == '\r')
+                                *state = HTTP_BODY_DATA_LF;
+                        else if (c == '\n')
+                                *state = HTTP_BODY_SIZE;
+                        else
+                                *state = HTTP_BODY_BAD;
+                        break;
+                case HTTP_BODY_DATA_LF:
+                        *state = c == '\n' ? HTTP_BODY_SIZE : HTTP_BODY_BAD;
+                        break;
+                case HTTP_BODY_TRAILER:
+                        if (c == '\r')
+                                *state = HTTP_BODY_END_LF;
+                        else if (c == '\n')
+                                *state = HTTP_BODY_DONE;
+                        else
+                                *state = HTTP_BODY_TRAILER_LINE;
+                        break;
+                case HTTP_BODY_TRAILER_LINE:
+                        if (c == '\n')
+                                *state = HTTP_BODY_TRAILER;
+                        break;
+                case HTTP_BODY_END_LF:
+                        *state = c == '\n' ? HTTP_BODY_DONE : HTTP_BODY_BAD;
+                        break;
+                }
+        }
+        req->rq_bodyoff = off;
+
+        /* bytes decoded before an error are returned first */
+        if (stored > 0)
+                return stored;
+        if (req->rq_bodystate == HTTP_BODY_BAD) {
+                errno = EBADMSG;
+                return -1;
+        }
+        if (req->rq_bodystate == HTTP_BODY_TOOBIG) {
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+http_hex(char c)
+{
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+
+        return -1;
+}
+
+/* a chunk size line is complete: start its data (or the trailer) */
+static int
+http_body_chunk(struct http_request *req)
+{
+        if (req->rq_bodyleft == 0) {
+                req->rq_bodystate = HTTP_BODY_TRAILER;
+                return 0;
+        }
+
+        if (req->rq_maxbody > 0 &&
+            req->rq_bodyleft > req->rq_maxbody - req->rq_bodyread) {
+                req->rq_bodystate = HTTP_BODY_TOOBIG;
+                return -1;
+        }
+
+        req->rq_bodystate = HTTP_BODY_DATA;
+        return 0;
+}
+
+/* wait for more of the body (everything buffered is decoded already) */
+static int
+http_request_fill(struct http_request *req)
+{
+        struct iobuf    *ip = req->rq_buf;
+        ssize_t         nread;
+
+        /* event loops buffer the whole body before the handler runs */
+        if (req->rq_conn != NULL) {
+                errno = EIO;
+                return -1;
+        }
+
+        /* the header block stays, the decoded bytes after it make room */
+        ip->ib_inendp = ip->ib_inbufp + req->rq_hdrlen;
+        req->rq_bodyoff = req->rq_hdrlen;
+
+        /* the client holds the body back until told to go on */
+        if (req->rq_expect) {
+                req->rq_expect = 0;
+                if (iobuf_puts(ip, http_100) < 0 || iobuf_uncork(ip) < 0 ||
+                    iobuf_cork(ip) < 0)
+                        return -1;
+        }
+
+        nread = iobuf_read(ip);
+        if (nread == 0) {
+                errno = ECONNRESET;
+                return -1;
+        }
+        /* SO_RCVTIMEO ran out */
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                errno = ETIMEDOUT;
+
+        return nread < 0 ? -1 : 0;
+}
+
+/*
+ * Event loops run a handler only once rq_buf holds all of its body, so
+ * reading the body never waits on the socket: rq_buf grows to fit a
+ * Content-Length body, and a chunked one is decoded in place as it
+ * arrives, its data left right after the header block as if it had
+ * come with a Content-Length (rq_maxbody bounds both):
+ *
+ * ret:
+ *      1 once the body is buffered, 0 if more input is needed, -1 with
+ *      errno EBADMSG, EMSGSIZE or ENOMEM
+ */
+static int
+http_request_buffer(struct http_request *req)
+{
+        struct iobuf    *ip = req->rq_buf;
+        size_t          have;
+        size_t          need;
+        size_t          end;
+        ssize_t         n;
+
+        if (req->rq_bodystate == HTTP_BODY_DONE)
+                return 1;
+
+        /* the client holds the body back until told to go on */
+        if (req->rq_expect) {
+                req->rq_expect = 0;
+                if (iobuf_puts(ip, http_100) < 0 || iobuf_uncork(ip) < 0 ||
+                    iobuf_cork(ip) < 0)
+                        return -1;
+        }
+
+        have = ip->ib_inendp - ip->ib_inbufp;
+        if (!req->rq_chunked) {
+                need = req->rq_hdrlen + req->rq_bodyleft;
+                if (have >= need)
+                        return 1;
+                if (need > ip->ib_insize && iobuf_resize_in(ip, need) < 0)
+                        return -1;
+                return 0;
+        }
+
+        /* decoded data goes over the framing it came in */
+        do {
+                n = http_body_decode(req, ip->ib_inbufp + req->rq_hdrlen +
+                                          req->rq_bodyread, SIZE_MAX);
+        } while (n > 0);
+        if (n < 0)
+                return -1;
+
+        /* what follows the decoded input moves up to the decoded data */
+        end = req->rq_hdrlen + req->rq_bodyread;
+        memmove(ip->ib_inbufp + end, ip->ib_inbufp + req->rq_bodyoff,
+                have - req->rq_bodyoff);
+        ip->ib_inendp -= req->rq_bodyoff - end;
+        req->rq_bodyoff = end;
+
+        if (req->rq_bodystate != HTTP_BODY_DONE) {
+                /* a full rq_buf holds nothing but the header and data */
+                if ((size_t)(ip->ib_inendp - ip->ib_inbufp) ==
+                    ip->ib_insize &&
+                    iobuf_resize_in(ip, ip->ib_insize * 2) < 0)
+                        return -1;
+                return 0;
+        }
+
+        req->rq_chunked = 0;
+        req->rq_bodyleft = req->rq_bodyread;
+        req->rq_bodyread = 0;
+        req->rq_bodyoff = req->rq_hdrlen;
+        req->rq_bodystate = req->rq_bodyleft > 0 ? HTTP_BODY_DATA :
+                                                   HTTP_BODY_DONE;
+        return 1;
+}
+
+/* decode and drop whatever of the body is buffered, 1 if that ends it */
+static int
+http_request_skip_body(struct http_request *req)
+{
+        while (http_body_decode(req, NULL, SIZE_MAX) > 0)
+                ;
+
+        return req->rq_bodystate == HTTP_BODY_DONE;
+}
+
+/* maximum number of events taken from epoll_wait() at once */
+#define HTTP_EPOLL_EVENTS 64
+/* capacity of each event loop's work-stealing deque */
+#define HTTP_DEQUE_SIZE 1024
+/* io_uring submission queue entries */
+#define HTTP_URING_ENTRIES 256
+/* io_uring provided recv buffers per loop and their size */
+#define HTTP_URING_NBUFS 256
+#define HTTP_URING_BUFSIZE 4096
+/* recv buffers a connection holds before its recv waits for rq_buf room */
+#define HTTP_URING_HELD 8
+
+struct http_loop;
+
+/* connection owned by an event loop */
+struct http_conn {
+        /* request being read or handled on this connection */
+        struct http_request     *cn_req;
+        /* event loop whose epoll set holds the connection */
+        struct http_loop        *cn_loop;
+        /* connections waiting for a request, oldest first */
+        struct http_conn        *cn_prev;
+        struct http_conn        *cn_next;
+        /* when a complete request must have arrived (ms, monotonic) */
+        uint64_t                cn_deadline;
+        /* requests read on this connection so far */
+        long                    cn_nrequests;
+        /* set while on the owning loop's list of waiting connections */
+        int                     cn_waiting;
+        /* events the connection is registered for in the epoll set */
+        uint32_t                cn_events;
+        /* set while a response waits for the socket to take the rest */
+        int                     cn_flushing;
+        /* set if the connection is closed once the response is out */
+        int                     cn_last;
+        /* io_uring: operations in flight on the connection */
+        int                     cn_ops;
+        /* io_uring: set while a send (or a poll for room to send) is queued */
+        int                     cn_sending;
+        /* io_uring: set while a recv is armed */
+        int                     cn_recving;
+        /* io_uring: set while a multishot recv holding too much is cancelled */
+        int                     cn_cancelling;
+        /* io_uring: message handed to IORING_OP_SENDMSG */
+        struct msghdr           cn_msg;
+        /* io_uring: set once the connection is being torn down */
+        int                     cn_closing;
+        /* io_uring: set once IORING_OP_CLOSE closed the fd */
+        int                     cn_fdclosed;
+        /* io_uring: received buffers not yet copied into rq_buf */
+        unsigned short          cn_heldbid[HTTP_URING_NBUFS];
+        unsigned                cn_heldlen[HTTP_URING_NBUFS];
+        /* io_uring: index of oldest held buffer, bytes copied from it */
+        unsigned                cn_heldfirst;
+        unsigned                cn_heldoff;
+        /* io_uring: number of held buffers */
+        unsigned                cn_nheld;
+        /* set once another loop has run the handler */
+        atomic_int              cn_done;
+};
+
+/* event loop state, one per thread (nothing here is shared by default) */
+struct http_loop {
+        /* server being run (read-only once listening) */
+        struct http_server      *lp_server;
+        /* every loop of the runtime, for stealing */
+        struct http_loop        *lp_loops;
+        /* number of loops in lp_loops */
+        size_t                  lp_nloops;
+        /* index of this loop in lp_loops */
+        size_t                  lp_id;
+        /* requests that are parsed and waiting for their handler */
+        struct deque            *lp_work;
+        /* connections waiting for a request, oldest deadline first */
+        struct http_conn        *lp_first;
+        struct http_conn        *lp_last;
+        /* EPOLLONESHOT when other loops may steal our connections */
+        uint32_t                lp_oneshot;
+        /* set while blocked in epoll_wait() with no work queued */
+        atomic_int              lp_idle;
+        /* epoll instance */
+        int                     lp_epfd;
+        /* listening socket */
+        int                     lp_listenfd;
+        /* eventfd other loops use to wake us when they have work */
+        int                     lp_wakefd;
+        /* eventfd shared by all loops, readable once stopping */
+        int                     lp_stopfd;
+        /* thread running the loop */
+        pthread_t               lp_thread;
+        /* io_uring backend ring (NULL for epoll) */
+        struct uring            *lp_ring;
+        /* io_uring provided recv buffers */
+        struct uring_bufs       lp_bufs;
+        /* cleared if the kernel rejects multishot recv */
+        int                     lp_multishot;
+};
+
+static int http_loop_init(struct http_loop *lp,
+                          struct http_server *hp,
+                          struct http_loop *loops,
+                          size_t nloops,
+                          size_t id,
+                          int listenfd,
+                          int stopfd,
+                          int qsize);
+static int http_loop_run(struct http_loop *lp);
+static void http_loop_destroy(struct http_loop *lp);
+
+static int http_server_uring(struct http_server *hp, int qsize);
+
+static int
+http_server_epoll(struct http_server *hp, int qsize)
+{
+        struct http_loop        loop;
+        int                     saved_errno;
+
+        /* a client hanging up mid-response must not kill every connection */
+        if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+                return -1;
+
+        if (hp->sv_backend == HTTP_BACKEND_URING)
+                return http_server_uring(hp, qsize);
+
+        if (http_loop_init(&loop, hp, &loop, 1, 0, hp->sv_fd, -1, qsize) < 0)
+                return -1;
+
+        (void)http_loop_run(&loop);
+        saved_errno = errno;
+        http_loop_destroy(&loop);
+        errno = saved_errno;
+        return -1;
+}
+
+static void *http_loop_thread(void *arg);
+
+static int
+http_server_threads(struct http_server *hp, int qsize)
+{
+        struct http_loop        *loops = NULL;
+        sigset_t                oldmask;
+        sigset_t                mask;
+        uint64_t                one;
+        long                    nloops;
+        long                    nstarted;
+        long                    ninit;
+        int                     saved_errno;
+        int                     stopfd;
+        int                     signo;
+        int                     ret;
+
+        nloops = hp->sv_nworkers;
+        if (nloops == 0)
+                nloops = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nloops <= 0)
+                nloops = 1;
+
+        if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+                return -1;
+
+        loops = calloc(nloops, sizeof(*loops));
+        if (loops == NULL)
+                return -1;
+
+        ret = -1;
+        nstarted = ninit = 0;
+        stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (stopfd < 0)
+                goto free_loops;
+
+        /* loop threads inherit the mask so only sigwait() sees these */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        errno = pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+        if (errno != 0)
+                goto close_stopfd;
+
+        for (ninit = 0; ninit < nloops; ++ninit) {
+                int     listenfd;
+
+                /* every loop after the first gets its own SO_REUSEPORT socket */
+                listenfd = hp->sv_fd;
+                if (ninit > 0)
+                        listenfd = http_server_socket(hp);
+                if (listenfd < 0)
+                        goto stop_loops;
+
+                if (http_loop_init(&loops[ninit], hp, loops, nloops, ninit,
+                                   listenfd, stopfd, qsize) < 0) {
+                        if (listenfd != hp->sv_fd)
+                                (void)close(listenfd);
+                        goto stop_loops;
+                }
+        }
+
+        for (nstarted = 0; nstarted < nloops; ++nstarted) {
+                errno = pthread_create(&loops[nstarted].lp_thread, NULL,
+                                       http_loop_thread, &loops[nstarted]);
+                if (errno != 0)
+                        goto stop_loops;
+        }
+
+        if (sigwait(&mask, &signo) == 0)
+                ret = 0;
+stop_loops:
+        saved_errno = errno;
+        one = 1;
+        if (write(stopfd, &one, sizeof(one)) != sizeof(one))
+                warn("could not stop event loops");
+        while (nstarted > 0)
+                (void)pthread_join(loops[--nstarted].lp_thread, NULL);
+        while (ninit > 0)
+                http_loop_destroy(&loops[--ninit]);
+        (void)pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+        errno = saved_errno;
+close_stopfd:
+        saved_errno = errno;
+        (void)close(stopfd);
+        errno = saved_errno;
+free_loops:
+        free(loops);
+        return ret;
+}
+
+static void *
+http_loop_thread(void *arg)
+{
+        struct http_loop        *lp = arg;
+
+        if (http_loop_run(lp) < 0)
+                warn("event loop %zu", lp->lp_id);
+        return NULL;
+}
+
+static int http_loop_watch(struct http_loop *lp, int fd, void *ptr);
+
+static int
+http_loop_init(struct http_loop *lp,
+               struct http_server *hp,
+               struct http_loop *loops,
+               size_t nloops,
+               size_t id,
+               int listenfd,
+               int stopfd,
+               int qsize)
+{
+        int     saved_errno;
+        int     flags;
+
+        flags = fcntl(listenfd, F_GETFL);
+        if (flags < 0)
+                return -1;
+        if (fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0)
+                return -1;
+
+        if (listen(listenfd, qsize) < 0)
+                return -1;
+
+        lp->lp_server = hp;
+        lp->lp_loops = loops;
+        lp->lp_nloops = nloops;
+        lp->lp_id = id;
+        lp->lp_oneshot = nloops > 1 ? EPOLLONESHOT : 0;
+        atomic_init(&lp->lp_idle, 0);
+        lp->lp_listenfd = listenfd;
+        lp->lp_stopfd = stopfd;
+        lp->lp_wakefd = -1;
+        lp->lp_first = lp->lp_last = NULL;
+        lp->lp_ring = NULL;
+
+        lp->lp_work = deque_new(HTTP_DEQUE_SIZE);
+        if (lp->lp_work == NULL)
+                return -1;
+
+        lp->lp_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (lp->lp_epfd < 0)
+                goto free_work;
+
+        /* special fds are told apart from connections by their address */
+        if (http_loop_watch(lp, lp->lp_listenfd, &lp->lp_listenfd) < 0)
+                goto close_epfd;
+
+        if (stopfd >= 0 && http_loop_watch(lp, stopfd, &lp->lp_stopfd) < 0)
+                goto close_epfd;
+
+        if (nloops > 1) {
+                lp->lp_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (lp->lp_wakefd < 0)
+                        goto close_epfd;
+                if (http_loop_watch(lp, lp->lp_wakefd, &lp->lp_wakefd) < 0)
+                        goto close_wakefd;
+        }
+
+        return 0;
+close_wakefd:
+        saved_errno = errno;
+        (void)close(lp->lp_wakefd);
+        errno = saved_errno;
+close_epfd:
+        saved_errno = errno;
+        (void)close(lp->lp_epfd);
+        errno = saved_errno;
+free_work:
+        (void)deque_free(&lp->lp_work);
+        return -1;
+}
+
+static int
+http_loop_watch(struct http_loop *lp, int fd, void *ptr)
+{
+        struct epoll_event      ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = ptr;
+        return epoll_ctl(lp->lp_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void http_conn_close(struct http_conn *cn);
+
+static void
+http_loop_destroy(struct http_loop *lp)
+{
+        while (lp->lp_first != NULL)
+                http_conn_close(lp->lp_first);
+        (void)close(lp->lp_epfd);
+        if (lp->lp_wakefd >= 0)
+                (void)close(lp->lp_wakefd);
+        if (lp->lp_listenfd != lp->lp_server->sv_fd)
+                (void)close(lp->lp_listenfd);
+        (void)deque_free(&lp->lp_work);
+}
+
+static int http_loop_expire(struct http_loop *lp);
+static int http_loop_accept(struct http_loop *lp);
+static void http_loop_event(struct http_loop *lp, struct http_conn *cn);
+static void http_loop_wake_peers(struct http_loop *lp);
+static int http_loop_work(struct http_loop *lp);
+
+static int
+http_loop_run(struct http_loop *lp)
+{
+        struct epoll_event      events[HTTP_EPOLL_EVENTS];
+        int                     stole;
+
+        stole = 0;
+        for (;;) {
+                uint64_t        count;
+                int             timeout;
+                int             nready;
+                int             i;
+
+                /* only sleep once there is nothing left to run or steal */
+                timeout = http_loop_expire(lp);
+                if (stole || deque_size(lp->lp_work) > 0)
+                        timeout = 0;
+                else
+                        atomic_store(&lp->lp_idle, 1);
+
+                nready = epoll_wait(lp->lp_epfd, events, HTTP_EPOLL_EVENTS,
+                                    timeout);
+                atomic_store(&lp->lp_idle, 0);
+                if (nready < 0 && errno == EINTR)
+                        continue;
+                if (nready < 0)
+                        return -1;
+
+                for (i = 0; i < nready; ++i) {
+                        void    *ptr = events[i].data.ptr;
+
+                        if (ptr == &lp->lp_listenfd) {
+                                if (http_loop_accept(lp) < 0)
+                                        return -1;
+                        } else if (ptr == &lp->lp_stopfd) {
+                                return 0;
+                        } else if (ptr == &lp->lp_wakefd) {
+                                if (read(lp->lp_wakefd, &count,
+                                         sizeof(count)) < 0 &&
+                                    errno != EAGAIN)
+                                        return -1;
+                        } else {
+                                http_loop_event(lp, ptr);
+                        }
+                }
+
+                http_loop_wake_peers(lp);
+                stole = http_loop_work(lp);
+        }
+}
+
+static uint64_t http_now(void);
+
+static int
+http_loop_expire(struct http_loop *lp)
+{
+        uint64_t        now;
+
+        if (lp->lp_first == NULL || lp->lp_server->sv_idle_timeout == 0)
+                return -1;
+
+        /* every connection gets the same timeout so the oldest expires first */
+        now = http_now();
+        while (lp->lp_first != NULL && lp->lp_first->cn_deadline <= now)
+                http_conn_close(lp->lp_first);
+
+        if (lp->lp_first == NULL)
+                return -1;
+
+        return lp->lp_first->cn_deadline - now;
+}
+
+static uint64_t
+http_now(void)
+{
+        struct timespec ts;
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void http_loop_wait(struct http_loop *lp, struct http_conn *cn);
+
+static int
+http_loop_accept(struct http_loop *lp)
+{
+        for (;;) {
+                struct epoll_event      ev;
+                struct http_conn        *cn = NULL;
+                int                     connfd;
+
+                /* a client that stops reading must not stall the loop */
+                connfd = accept4(lp->lp_listenfd, NULL, NULL,
+                                 SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (connfd < 0 && errno == EINTR)
+                        continue;
+                if (connfd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return 0;
+                /* client gave up before we got to it */
+                if (connfd < 0 && errno == ECONNABORTED)
+                        continue;
+                /* out of fds or memory, retry on the next event */
+                if (connfd < 0 && (errno == EMFILE || errno == ENFILE ||
+                                   errno == ENOBUFS || errno == ENOMEM)) {
+                        warn("accept4()");
+                        return 0;
+                }
+                if (connfd < 0)
+                        return -1;
+
+                cn = malloc(sizeof(*cn));
+                if (cn == NULL) {
+                        warn("malloc()");
+                        (void)close(connfd);
+                        continue;
+                }
+
+                cn->cn_req = http_request_new(connfd,
+                                              lp->lp_server->sv_max_body);
+                if (cn->cn_req == NULL) {
+                        warn("http_request_new()");
+                        free(cn);
+                        (void)close(connfd);
+                        continue;
+                }
+                cn->cn_req->rq_conn = cn;
+                cn->cn_loop = lp;
+                cn->cn_nrequests = 0;
+                cn->cn_waiting = 0;
+                cn->cn_events = EPOLLIN | EPOLLRDHUP;
+                cn->cn_flushing = 0;
+                cn->cn_last = 0;
+                atomic_init(&cn->cn_done, 0);
+                http_loop_wait(lp, cn);
+
+                memset(&ev, 0, sizeof(ev));
+                ev.events = cn->cn_events | lp->lp_oneshot;
+                ev.data.ptr = cn;
+                if (epoll_ctl(lp->lp_epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+                        warn("epoll_ctl()");
+                        http_conn_close(cn);
+                }
+        }
+}
+
+static void
+http_loop_wait(struct http_loop *lp, struct http_conn *cn)
+{
+        cn->cn_deadline = http_now() + lp->lp_server->sv_idle_timeout;
+        cn->cn_waiting = 1;
+        cn->cn_next = NULL;
+        cn->cn_prev = lp->lp_last;
+        if (lp->lp_last != NULL)
+                lp->lp_last->cn_next = cn;
+        else
+                lp->lp_first = cn;
+        lp->lp_last = cn;
+}
+
+static void
+http_loop_unwait(struct http_loop *lp, struct http_conn *cn)
+{
+        if (!cn->cn_waiting)
+                return;
+
+        if (cn->cn_prev != NULL)
+                cn->cn_prev->cn_next = cn->cn_next;
+        else
+                lp->lp_first = cn->cn_next;
+        if (cn->cn_next != NULL)
+                cn->cn_next->cn_prev = cn->cn_prev;
+        else
+                lp->lp_last = cn->cn_prev;
+        cn->cn_waiting = 0;
+}
+
+static void http_conn_process(struct http_loop *lp, struct http_conn *cn);
+static int http_conn_next(struct http_conn *cn);
+static void http_conn_resume(struct http_loop *lp, struct http_conn *cn);
+
+static void
+http_loop_event(struct http_loop *lp, struct http_conn *cn)
+{
+        ssize_t nread;
+
+        /* another loop ran the handler and handed the connection back */
+        if (atomic_load_explicit(&cn->cn_done, memory_order_acquire)) {
+                atomic_store_explicit(&cn->cn_done, 0, memory_order_relaxed);
+                if (http_conn_next(cn) == 0)
+                        http_conn_process(lp, cn);
+                return;
+        }
+
+        if (cn->cn_flushing) {
+                http_conn_resume(lp, cn);
+                return;
+        }
+
+        /* ENOBUFS: ib_inbuf is full, http_conn_process() decides */
+        nread = iobuf_fill(cn->cn_req->rq_buf);
+        if (nread == 0 || (nread < 0 && errno != EAGAIN &&
+                           errno != EWOULDBLOCK && errno != EINTR &&
+                           errno != ENOBUFS)) {
+                http_conn_close(cn);
+                return;
+        }
+
+        http_conn_process(lp, cn);
+}
+
+static int http_request_buffer(struct http_request *req);
+static void http_conn_arm(struct http_conn *cn, uint32_t events);
+static void http_conn_run(struct http_loop *lp, struct http_conn *cn);
+static void http_conn_linger(struct http_conn *cn);
+
+static void
+http_conn_process(struct http_loop *lp, struct http_conn *cn)
+{
+        int     ret;
+
+        /* every complete request buffered is answered before reading */
+        for (;;) {
+                /* parsing resumes where the last partial read stopped */
+                ret = http_request_parse(cn->cn_req);
+                /* a handler never waits for its body on the loop */
+                if (ret > 0)
+                        ret = http_request_buffer(cn->cn_req);
+                if (ret == 0) {
+                        http_conn_arm(cn, EPOLLIN | EPOLLRDHUP);
+                        return;
+                }
+                if (ret < 0) {
+                        http_send_status(cn->cn_req,
+                                         http_parse_status(errno));
+                        http_conn_linger(cn);
+                        return;
+                }
+                http_loop_unwait(lp, cn);
+                ++cn->cn_nrequests;
+
+                /* queue the handler where idle loops can steal it */
+                if (lp->lp_nloops > 1 && deque_push(lp->lp_work, cn) == 0)
+                        return;
+
+                http_conn_run(lp, cn);
+                if (http_conn_next(cn) != 0)
+                        return;
+        }
+}
+
+static void
+http_conn_arm(struct http_conn *cn, uint32_t events)
+{
+        struct http_loop        *lp = cn->cn_loop;
+        struct epoll_event      ev;
+
+        /* level triggered registrations only change with the events */
+        if (!lp->lp_oneshot && events == cn->cn_events)
+                return;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | lp->lp_oneshot;
+        ev.data.ptr = cn;
+        if (epoll_ctl(lp->lp_epfd, EPOLL_CTL_MOD, cn->cn_req->rq_buf->ib_fd,
+                      &ev) < 0) {
+                warn("epoll_ctl()");
+                http_conn_close(cn);
+                return;
+        }
+        cn->cn_events = events;
+}
+
+static void
+http_loop_wake_peers(struct http_loop *lp)
+{
+        size_t  surplus;
+        size_t  i;
+
+        if (lp->lp_nloops == 1)
+                return;
+
+        /* keep one request for ourselves, offer the rest */
+        surplus = deque_size(lp->lp_work);
+        for (i = 1; surplus > 1 && i < lp->lp_nloops; ++i) {
+                struct http_loop        *peer = NULL;
+                uint64_t                one;
+                int                     idle;
+
+                peer = &lp->lp_loops[(lp->lp_id + i) % lp->lp_nloops];
+                idle = 1;
+                if (!atomic_compare_exchange_strong(&peer->lp_idle, &idle, 0))
+                        continue;
+
+                one = 1;
+                if (write(peer->lp_wakefd, &one, sizeof(one)) < 0)
+                        warn("could not wake event loop %zu", peer->lp_id);
+                --surplus;
+        }
+}
+
+static void http_conn_handle(struct http_loop *lp, struct http_conn *cn);
+
+static int
+http_loop_work(struct http_loop *lp)
+{
+        struct http_conn        *cn = NULL;
+        size_t                  i;
+
+        while ((cn = deque_pop(lp->lp_work)) != NULL)
+                http_conn_handle(lp, cn);
+
+        /* out of our own work, help the first busy loop we find */
+        for (i = 1; i < lp->lp_nloops; ++i) {
+                struct http_loop        *victim = NULL;
+
+                victim = &lp->lp_loops[(lp->lp_id + i) % lp->lp_nloops];
+                cn = deque_steal(victim->lp_work);
+                if (cn != NULL) {
+                        http_conn_handle(lp, cn);
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static void
+http_conn_handle(struct http_loop *lp, struct http_conn *cn)
+{
+        struct epoll_event      ev;
+        int                     connfd;
+        int                     epfd;
+
+        http_conn_run(lp, cn);
+        if (cn->cn_loop == lp) {
+                if (http_conn_next(cn) == 0)
+                        http_conn_process(lp, cn);
+                return;
+        }
+
+        /*
+         * the owning loop still has the connection disarmed: give it back
+         * with an event that fires at once so the owner finishes it (the
+         * owner may free cn as soon as cn_done is visible, so nothing in
+         * cn is touched after that unless epoll_ctl() fails)
+         */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = cn;
+        epfd = cn->cn_loop->lp_epfd;
+        connfd = cn->cn_req->rq_buf->ib_fd;
+        atomic_store_explicit(&cn->cn_done, 1, memory_order_release);
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, connfd, &ev) < 0) {
+                warn("epoll_ctl()");
+                http_conn_close(cn);
+        }
+}
+
+static void
+http_conn_run(struct http_loop *lp, struct http_conn *cn)
+{
+        struct http_response    res;
+
+        http_server_dispatch(lp->lp_server, cn->cn_req, &res);
+}
+
+static int http_conn_keepalive(struct http_conn *cn);
+
+/*
+ * ret: 0 once ready for the next request, else the connection is closed
+ * or waits for the socket to take the rest of the response
+ */
+static int
+http_conn_next(struct http_conn *cn)
+{
+        struct http_request     *req = cn->cn_req;
+
+        if (http_request_flush(req) < 0)
+                goto close_conn;
+
+        if (!http_conn_keepalive(cn)) {
+                http_conn_linger(cn);
+                return -1;
+        }
+
+        /* keep rq_buf: it may already hold the next (pipelined) request */
+        if (http_request_reset(req) < 0)
+                goto close_conn;
+
+        http_loop_wait(cn->cn_loop, cn);
+
+        /* nothing else is read or run until the client has caught up */
+        if (req->rq_buf->ib_stalled) {
+                cn->cn_flushing = 1;
+                http_conn_arm(cn, EPOLLOUT);
+                return 1;
+        }
+
+        return 0;
+close_conn:
+        http_conn_close(cn);
+        return -1;
+}
+
+/* close the connection once the client has read what is queued */
+static void
+http_conn_linger(struct http_conn *cn)
+{
+        struct iobuf    *ip = cn->cn_req->rq_buf;
+
+        if (iobuf_uncork(ip) < 0 || !ip->ib_stalled) {
+                http_conn_close(cn);
+                return;
+        }
+
+        /* the idle timeout bounds how long a client may take */
+        http_loop_unwait(cn->cn_loop, cn);
+        http_loop_wait(cn->cn_loop, cn);
+        cn->cn_last = 1;
+        cn->cn_flushing = 1;
+        http_conn_arm(cn, EPOLLOUT);
+}
+
+/* the socket is writable again: send more of the stalled response */
+static void
+http_conn_resume(struct http_loop *lp, struct http_conn *cn)
+{
+        struct iobuf            *ip = cn->cn_req->rq_buf;
+        unsigned long long      nsent = ip->ib_nsent;
+
+        if (iobuf_uncork(ip) < 0 || iobuf_cork(ip) < 0) {
+                http_conn_close(cn);
+                return;
+        }
+
+        /* every bit the client reads restarts its idle timeout */
+        if (ip->ib_nsent != nsent) {
+                http_loop_unwait(lp, cn);
+                http_loop_wait(lp, cn);
+        }
+
+        if (ip->ib_stalled) {
+                http_conn_arm(cn, EPOLLOUT);
+                return;
+        }
+
+        cn->cn_flushing = 0;
+        if (cn->cn_last) {
+                http_conn_close(cn);
+                return;
+        }
+
+        /* pipelined requests read meanwhile are answered now */
+        http_conn_process(lp, cn);
+}
+
+static int
+http_conn_keepalive(struct http_conn *cn)
+{
+        struct http_server      *hp = cn->cn_loop->lp_server;
+
+        if (!http_request_keepalive(cn->cn_req))
+                return 0;
+
+        return hp->sv_max_requests == 0 ||
+               cn->cn_nrequests < hp->sv_max_requests;
+}
+
+static void http_uring_close(struct http_conn *cn);
+
+static void
+http_conn_close(struct http_conn *cn)
+{
+        int     connfd;
+
+        if (cn->cn_loop->lp_ring != NULL) {
+                http_uring_close(cn);
+                return;
+        }
+
+        /* closing the fd also removes it from the epoll set */
+        http_loop_unwait(cn->cn_loop, cn);
+        connfd = cn->cn_req->rq_buf->ib_fd;
+        if (http_request_free(&cn->cn_req) < 0)
+                warn("http_request_free()");
+        (void)close(connfd);
+        free(cn);
+}
+
+/* io_uring user_data tags (connection pointers keep the low bits clear) */
+#define HTTP_URING_ACCEPT       0x1
+#define HTTP_URING_RECV         0x2
+#define HTTP_URING_SEND         0x3
+#define HTTP_URING_SHUTDOWN     0x4
+#define HTTP_URING_CLOSE        0x5
+#define HTTP_URING_POLLOUT      0x6
+#define HTTP_URING_CANCEL       0x7
+#define HTTP_URING_TAGS         0x7
+
+static int http_uring_accept(struct http_loop *lp);
+static void http_uring_complete(struct http_loop *lp,
+                                struct io_uring_cqe *cqe);
+
+static int
+http_server_uring(struct http_server *hp, int qsize)
+{
+        struct http_loop        loop;
+        int                     saved_errno;
+
+        if (listen(hp->sv_fd, qsize) < 0)
+                return -1;
+
+        memset(&loop, 0, sizeof(loop));
+        loop.lp_server = hp;
+        loop.lp_loops = &loop;
+        loop.lp_nloops = 1;
+        loop.lp_listenfd = hp->sv_fd;
+        loop.lp_epfd = -1;
+        loop.lp_wakefd = -1;
+        loop.lp_stopfd = -1;
+        loop.lp_multishot = 1;
+
+        loop.lp_ring = uring_new(HTTP_URING_ENTRIES);
+        if (loop.lp_ring == NULL)
+                return -1;
+
+        if (uring_bufs_init(loop.lp_ring, &loop.lp_bufs, 0, HTTP_URING_NBUFS,
+                            HTTP_URING_BUFSIZE) < 0)
+                goto free_ring;
+
+        if (http_uring_accept(&loop) < 0)
+                goto free_bufs;
+
+        for (;;) {
+                struct io_uring_cqe     *cqe = NULL;
+                struct io_uring_cqe     done;
+
+                if (uring_submit(loop.lp_ring, http_loop_expire(&loop)) < 0 &&
+                    errno != ETIME && errno != EINTR)
+                        break;
+
+                while ((cqe = uring_cqe(loop.lp_ring)) != NULL) {
+                        /* handling may queue sqes, so free the slot first */
+                        done = *cqe;
+                        uring_cqe_seen(loop.lp_ring);
+                        http_uring_complete(&loop, &done);
+                }
+        }
+
+free_bufs:
+        saved_errno = errno;
+        uring_bufs_destroy(loop.lp_ring, &loop.lp_bufs);
+        errno = saved_errno;
+free_ring:
+        saved_errno = errno;
+        (void)uring_free(&loop.lp_ring);
+        errno = saved_errno;
+        return -1;
+}
+
+static int
+http_uring_accept(struct http_loop *lp)
+{
+        struct io_uring_sqe     *sqe = NULL;
+
+        sqe = uring_sqe(lp->lp_ring);
+        if (sqe == NULL)
+                return -1;
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = lp->lp_listenfd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        /* handlers writing more than rq_buf holds must not block */
+        sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+        sqe->user_data = HTTP_URING_ACCEPT;
+        return 0;
+}
+
+static void http_uring_accepted(struct http_loop *lp,
+                                struct io_uring_cqe *cqe);
+static void http_uring_received(struct http_loop *lp,
+                                struct http_conn *cn,
+                                struct io_uring_cqe *cqe);
+static void http_uring_sent(struct http_loop *lp,
+                            struct http_conn *cn,
+                            struct io_uring_cqe *cqe);
+static void http_uring_release(struct http_conn *cn);
+
+static void
+http_uring_complete(struct http_loop *lp, struct io_uring_cqe *cqe)
+{
+        struct http_conn        *cn = NULL;
+
+        cn = (struct http_conn *)(uintptr_t)(cqe->user_data &
+                                             ~(uint64_t)HTTP_URING_TAGS);
+        switch (cqe->user_data & HTTP_URING_TAGS) {
+        case HTTP_URING_ACCEPT:
+                http_uring_accepted(lp, cqe);
+                break;
+        case HTTP_URING_RECV:
+                http_uring_received(lp, cn, cqe);
+                break;
+        case HTTP_URING_SEND:
+        case HTTP_URING_POLLOUT:
+                http_uring_sent(lp, cn, cqe);
+                break;
+        case HTTP_URING_SHUTDOWN:
+                /* the send before it failed and broke the link */
+                if (cqe->res == -ECANCELED)
+                        (void)shutdown(cn->cn_req->rq_buf->ib_fd, SHUT_RDWR);
+                --cn->cn_ops;
+                http_uring_release(cn);
+                break;
+        case HTTP_URING_CLOSE:
+                if (cqe->res >= 0)
+                        cn->cn_fdclosed = 1;
+                --cn->cn_ops;
+                http_uring_release(cn);
+                break;
+        case HTTP_URING_CANCEL:
+                /* the recv reports its own end, whatever the outcome */
+                --cn->cn_ops;
+                http_uring_release(cn);
+                break;
+        }
+}
+
+static int http_uring_recv(struct http_conn *cn);
+
+static void
+http_uring_accepted(struct http_loop *lp, struct io_uring_cqe *cqe)
+{
+        struct http_conn        *cn = NULL;
+
+        /* multishot accept stops on errors and when the ring overflows */
+        if (!(cqe->flags & IORING_CQE_F_MORE) && http_uring_accept(lp) < 0)
+                warn("http_uring_accept()");
+
+        if (cqe->res < 0) {
+                errno = -cqe->res;
+                if (errno != ECONNABORTED)
+                        warn("accept");
+                return;
+        }
+
+        cn = calloc(1, sizeof(*cn));
+        if (cn == NULL) {
+                warn("calloc()");
+                (void)close(cqe->res);
+                return;
+        }
+
+        cn->cn_req = http_request_new(cqe->res, lp->lp_server->sv_max_body);
+        if (cn->cn_req == NULL) {
+                warn("http_request_new()");
+                free(cn);
+                (void)close(cqe->res);
+                return;
+        }
+        cn->cn_req->rq_conn = cn;
+        cn->cn_loop = lp;
+        atomic_init(&cn->cn_done, 0);
+        http_loop_wait(lp, cn);
+
+        if (http_uring_recv(cn) < 0) {
+                warn("http_uring_recv()");
+                http_conn_close(cn);
+        }
+}
+
+static int
+http_uring_recv(struct http_conn *cn)
+{
+        struct http_loop        *lp = cn->cn_loop;
+        struct io_uring_sqe     *sqe = NULL;
+
+        sqe = uring_sqe(lp->lp_ring);
+        if (sqe == NULL)
+                return -1;
+
+        /* the kernel picks a buffer from lp_bufs when data arrives */
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = cn->cn_req->rq_buf->ib_fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = lp->lp_bufs.ub_bgid;
+        if (lp->lp_multishot)
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+        else
+                sqe->len = lp->lp_bufs.ub_bufsize;
+        sqe->user_data = (uintptr_t)cn | HTTP_URING_RECV;
+        ++cn->cn_ops;
+        cn->cn_recving = 1;
+        return 0;
+}
+
+/* stop a multishot recv (its last completion has no IORING_CQE_F_MORE) */
+static int
+http_uring_cancel(struct http_conn *cn)
+{
+        struct io_uring_sqe     *sqe = NULL;
+
+        sqe = uring_sqe(cn->cn_loop->lp_ring);
+        if (sqe == NULL)
+                return -1;
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)cn | HTTP_URING_RECV;
+        sqe->user_data = (uintptr_t)cn | HTTP_URING_CANCEL;
+        ++cn->cn_ops;
+        cn->cn_cancelling = 1;
+        return 0;
+}
+
+/* recv again, unless one is armed or HTTP_URING_HELD buffers wait */
+static int
+http_uring_resume(struct http_conn *cn)
+{
+        if (cn->cn_recving || cn->cn_closing || cn->cn_last ||
+            cn->cn_nheld >= HTTP_URING_HELD)
+                return 0;
+
+        return http_uring_recv(cn);
+}
+
+static void http_uring_process(struct http_loop *lp, struct http_conn *cn);
+
+static void
+http_uring_received(struct http_loop *lp,
+                    struct http_conn *cn,
+                    struct io_uring_cqe *cqe)
+{
+        unsigned short  bid;
+        int             more;
+
+        more = cqe->flags & IORING_CQE_F_MORE;
+        if (!more) {
+                --cn->cn_ops;
+                cn->cn_recving = 0;
+                cn->cn_cancelling = 0;
+        }
+
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cn->cn_closing) {
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                        uring_buf_recycle(&lp->lp_bufs, bid);
+                http_uring_release(cn);
+                return;
+        }
+
+        /* kernels before 6.0 only do single shot recv */
+        if (cqe->res == -EINVAL && lp->lp_multishot) {
+                lp->lp_multishot = 0;
+                cqe->res = -ENOBUFS;
+        }
+
+        /* out of provided buffers, or cancelled below: ask again */
+        if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+                if (http_uring_resume(cn) < 0)
+                        http_conn_close(cn);
+                return;
+        }
+
+        if (cqe->res <= 0) {
+                http_conn_close(cn);
+                return;
+        }
+
+        cn->cn_heldbid[(cn->cn_heldfirst + cn->cn_nheld) %
+                       HTTP_URING_NBUFS] = bid;
+        cn->cn_heldlen[(cn->cn_heldfirst + cn->cn_nheld) %
+                       HTTP_URING_NBUFS] = cqe->res;
+        ++cn->cn_nheld;
+
+        /*
+         * a client pipelining faster than we answer waits: the recv stops
+         * until http_uring_feed() has copied the held buffers into rq_buf
+         * (a multishot recv still completing meanwhile holds at most the
+         * rest of the pool)
+         */
+        if (cn->cn_nheld >= HTTP_URING_HELD) {
+                if (more && !cn->cn_cancelling && http_uring_cancel(cn) < 0) {
+                        http_conn_close(cn);
+                        return;
+                }
+        } else if (http_uring_resume(cn) < 0) {
+                http_conn_close(cn);
+                return;
+        }
+        http_uring_process(lp, cn);
+}
+
+static void
+http_uring_sent(struct http_loop *lp,
+                struct http_conn *cn,
+                struct io_uring_cqe *cqe)
+{
+        struct iobuf    *ip = cn->cn_req->rq_buf;
+
+        --cn->cn_ops;
+        cn->cn_sending = 0;
+        if (cn->cn_closing) {
+                http_uring_release(cn);
+                return;
+        }
+
+        if (cqe->res < 0) {
+                http_conn_close(cn);
+                return;
+        }
+
+        /* a poll for room to send more of a file reports its events */
+        if ((cqe->user_data & HTTP_URING_TAGS) == HTTP_URING_SEND)
+                (void)iobuf_drain_out(ip, cqe->res);
+        http_uring_process(lp, cn);
+}
+
+static int http_uring_feed(struct http_loop *lp, struct http_conn *cn);
+static int http_uring_send(struct http_conn *cn, int last);
+
+static void
+http_uring_process(struct http_loop *lp, struct http_conn *cn)
+{
+        struct http_request     *req = cn->cn_req;
+        struct iobuf            *ip = req->rq_buf;
+        int                     ret;
+
+        /* every complete request buffered is answered before sending */
+        for (;;) {
+                if (cn->cn_sending || cn->cn_closing)
+                        return;
+
+                /* partial send or a file: finish it before anything else */
+                if (ip->ib_outlen > 0 || ip->ib_sendfd >= 0) {
+                        if (http_uring_send(cn, cn->cn_last) < 0) {
+                                http_conn_close(cn);
+                                return;
+                        }
+                        continue;
+                }
+
+                if (http_uring_feed(lp, cn) < 0) {
+                        http_conn_close(cn);
+                        return;
+                }
+                ret = http_request_parse(req);
+                /* the handler cannot wait for completions, nor its body */
+                if (ret > 0)
+                        ret = http_request_buffer(req);
+                if (ret == 0) {
+                        /* rq_buf may have grown to take more of them */
+                        if (cn->cn_nheld > 0 && req->rq_hdrlen > 0)
+                                continue;
+                        return;
+                }
+                if (ret < 0) {
+                        http_send_status(req, http_parse_status(errno));
+                        if (http_uring_send(cn, 1) < 0)
+                                http_conn_close(cn);
+                        return;
+                }
+
+                http_loop_unwait(lp, cn);
+                ++cn->cn_nrequests;
+
+                http_conn_run(lp, cn);
+                if (!http_conn_keepalive(cn)) {
+                        cn->cn_last = 1;
+                        if (http_uring_send(cn, 1) < 0)
+                                http_conn_close(cn);
+                        return;
+                }
+
+                if (http_request_reset(req) < 0) {
+                        http_conn_close(cn);
+                        return;
+                }
+                http_loop_wait(lp, cn);
+
+                /* pipelined requests get their responses in one send */
+                if (http_uring_feed(lp, cn) < 0) {
+                        http_conn_close(cn);
+                        return;
+                }
+                if (ip->ib_sendfd >= 0 ||
+                    (!http_request_buffered(req) && ip->ib_outlen > 0)) {
+                        if (http_uring_send(cn, 0) < 0)
+                                http_conn_close(cn);
+                        return;
+                }
+        }
+}
+
+/* copy held buffers into rq_buf while it has room, then recv again */
+static int
+http_uring_feed(struct http_loop *lp, struct http_conn *cn)
+{
+        while (cn->cn_nheld > 0) {
+                unsigned short  bid;
+                unsigned        len;
+                ssize_t         n;
+
+                bid = cn->cn_heldbid[cn->cn_heldfirst];
+                len = cn->cn_heldlen[cn->cn_heldfirst];
+                n = iobuf_feed(cn->cn_req->rq_buf,
+                               uring_buf(&lp->lp_bufs, bid) + cn->cn_heldoff,
+                               len - cn->cn_heldoff);
+                if (n <= 0)
+                        break;
+
+                cn->cn_heldoff += n;
+                if (cn->cn_heldoff < len)
+                        break;
+
+                uring_buf_recycle(&lp->lp_bufs, bid);
+                cn->cn_heldfirst = (cn->cn_heldfirst + 1) % HTTP_URING_NBUFS;
+                cn->cn_heldoff = 0;
+                --cn->cn_nheld;
+        }
+
+        return http_uring_resume(cn);
+}
+
+static int
+http_uring_send(struct http_conn *cn, int last)
+{
+        struct io_uring_sqe     *sqe = NULL;
+        struct iobuf            *ip = cn->cn_req->rq_buf;
+        struct uring            *ur = cn->cn_loop->lp_ring;
+        int                     fd;
+
+        fd = ip->ib_fd;
+
+        /* a file after the queued output goes out as the socket takes it */
+        if (ip->ib_outlen == 0 && ip->ib_sendfd >= 0) {
+                if (iobuf_uncork(ip) < 0 || iobuf_cork(ip) < 0)
+                        return -1;
+                if (ip->ib_sendfd >= 0) {
+                        sqe = uring_sqe(ur);
+                        if (sqe == NULL)
+                                return -1;
+                        sqe->opcode = IORING_OP_POLL_ADD;
+                        sqe->fd = fd;
+                        sqe->poll32_events = POLLOUT;
+                        sqe->user_data = (uintptr_t)cn | HTTP_URING_POLLOUT;
+                        cn->cn_sending = 1;
+                        ++cn->cn_ops;
+                }
+        }
+
+        if (ip->ib_outlen > 0) {
+                sqe = uring_sqe(ur);
+                if (sqe == NULL)
+                        return -1;
+                /* ib_iov stays untouched until the send completes */
+                memset(&cn->cn_msg, 0, sizeof(cn->cn_msg));
+                cn->cn_msg.msg_iov = ip->ib_iov;
+                cn->cn_msg.msg_iovlen = ip->ib_iovcnt;
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = fd;
+                sqe->addr = (uintptr_t)&cn->cn_msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+                sqe->user_data = (uintptr_t)cn | HTTP_URING_SEND;
+                if (last && ip->ib_sendfd < 0)
+                        sqe->flags = IOSQE_IO_LINK;
+                cn->cn_sending = 1;
+                ++cn->cn_ops;
+        }
+
+        /* the shutdown waits for the rest of a file (cn_last is kept) */
+        if (!last || ip->ib_sendfd >= 0)
+                return 0;
+
+        /* shutdown also ends the multishot recv still holding the socket */
+        http_loop_unwait(cn->cn_loop, cn);
+        cn->cn_closing = 1;
+        sqe = uring_sqe(ur);
+        if (sqe == NULL) {
+                (void)shutdown(fd, SHUT_RDWR);
+                return 0;
+        }
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = fd;
+        sqe->len = SHUT_RDWR;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)cn | HTTP_URING_SHUTDOWN;
+        ++cn->cn_ops;
+
+        sqe = uring_sqe(ur);
+        if (sqe == NULL)
+                return 0;
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = (uintptr_t)cn | HTTP_URING_CLOSE;
+        ++cn->cn_ops;
+        return 0;
+}
+
+static void
+http_uring_close(struct http_conn *cn)
+{
+        http_loop_unwait(cn->cn_loop, cn);
+        if (cn->cn_closing)
+                return;
+
+        /* in flight operations finish (with errors) before cn is freed */
+        cn->cn_closing = 1;
+        (void)shutdown(cn->cn_req->rq_buf->ib_fd, SHUT_RDWR);
+        http_uring_release(cn);
+}
+
+static void
+http_uring_release(struct http_conn *cn)
+{
+        struct http_loop        *lp = cn->cn_loop;
+        struct iobuf            *ip = cn->cn_req->rq_buf;
+        int                     connfd;
+
+        if (!cn->cn_closing || cn->cn_ops > 0)
+                return;
+
+        while (cn->cn_nheld > 0) {
+                uring_buf_recycle(&lp->lp_bufs,
+                                  cn->cn_heldbid[cn->cn_heldfirst]);
+                cn->cn_heldfirst = (cn->cn_heldfirst + 1) % HTTP_URING_NBUFS;
+                --cn->cn_nheld;
+        }
+
+        /* whatever was not sent is dropped, the fd may already be reused */
+        (void)iobuf_discard_out(ip);
+        connfd = ip->ib_fd;
+        if (http_request_free(&cn->cn_req) < 0)
+                warn("http_request_free()");
+        if (!cn->cn_fdclosed)
+                (void)close(connfd);
+        free(cn);
+}
+
+static struct http_request *
+http_request_new(int connfd, size_t maxbody)
+{
+        struct http_request     *req = NULL;
+
+        req = calloc(1, sizeof(*req));
+        if (req == NULL)
+                goto ret;
+
+        req->rq_buf = iobuf_new(connfd, 0);
+        if (req->rq_buf == NULL)
+                goto free_req;
+
+        /* responses are written by http_request_flush() (or once full) */
+        if (iobuf_cork(req->rq_buf) < 0)
+                goto free_buf;
+
+        req->rq_maxbody = maxbody;
+        goto ret;
+free_buf:
+        (void)iobuf_free(&req->rq_buf);
+free_req:
+        free(req);
+        req = NULL;
+ret:
+        return req;
+
+}
+
+static int http_request_sanity(const struct http_request *req);
+
+static int
+http_request_reset(struct http_request *req)
+{
+        if (http_request_sanity(req) < 0)
+                return -1;
+
+        /* the views point into the header block, drop both together */
+        if (iobuf_consume(req->rq_buf, req->rq_bodyoff) < 0)
+                return -1;
+
+        /* rq_buf grown for a body goes back to its size once it is used */
+        if (req->rq_buf->ib_insize > req->rq_buf->ib_size &&
+            iobuf_resize_in(req->rq_buf, 0) < 0)
+                return -1;
+
+        memset(&req->rq_method, 0, sizeof(req->rq_method));
+        memset(&req->rq_resource, 0, sizeof(req->rq_resource));
+        memset(&req->rq_path, 0, sizeof(req->rq_path));
+        memset(&req->rq_query, 0, sizeof(req->rq_query));
+        req->rq_nparams = 0;
+        req->rq_split = 0;
+        memset(&req->rq_version, 0, sizeof(req->rq_version));
+        req->rq_methodid = HTTP_METHOD_OTHER;
+        req->rq_versionid = HTTP_VERSION_OTHER;
+        memset(&req->rq_pathinfo, 0, sizeof(req->rq_pathinfo));
+        req->rq_ncaptures = 0;
+        req->rq_nfields = 0;
+        memset(req->rq_known, 0, sizeof(req->rq_known));
+        req->rq_state = 0;
+        req->rq_parsed = 0;
+        req->rq_mark = 0;
+        req->rq_valend = 0;
+        req->rq_hdrlen = 0;
+        req->rq_handler = NULL;
+        req->rq_chunked = 0;
+        req->rq_bodystate = 0;
+        req->rq_expect = 0;
+        req->rq_bodyleft = 0;
+        req->rq_bodyread = 0;
+        req->rq_bodyoff = 0;
+        return 0;
+}
+
+static int
+http_request_free(struct http_request **reqp)
+{
+        struct http_request     *req = NULL;
+        int                     saved_errno;
+        int                     ret;
+
+        if (reqp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        req = *reqp;
+
+        if (http_request_sanity(req) < 0)
+                return -1;
+
+        /* the request goes too if the last output could not be sent */
+        ret = iobuf_free(&req->rq_buf);
+        saved_errno = errno;
+        free(req);
+        *reqp = NULL;
+        errno = saved_errno;
+        return ret;
+}
+
+static int
+http_request_sanity(const struct http_request *req)
+{
+        errno = EINVAL;
+        if (req == NULL)
+                return -1;
+        if (req->rq_buf == NULL)
+                return -1;
+        errno = 0;
+        return 0;
+}
+
+static int http_server_sanity(const struct http_server *server);
+
+int
+http_server_free(struct http_server **hpp)
+{
+        struct http_server      *hp = NULL;
+
+        if (hpp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        hp = *hpp;
+        if (http_server_sanity(hp) < 0)
+                return -1;
+
+        free(hp->sv_table);
+        route_free(&hp->sv_routes);
+        cache_free(&hp->sv_cache);
+
+        if (close(hp->sv_fd) < 0)
+                return -1;
+
+        free(hp);
+        *hpp = NULL;
         return 0;
 }
@@ -6,45 +6,352 @@
 #include "string.h"
 #include <errno.h>
 #include <netdb.h>
+#include <stdint.h>
 
-/* http request */
+/* bytes of a request in its input buffer */
+struct http_view {
+        /* offset from the start of the request (rq_buf->ib_inbufp) */
+        size_t  hv_off;
+        /* number of bytes */
+        size_t  hv_len;
+};
+
+/* request methods (extension methods are HTTP_METHOD_OTHER) */
+enum http_method {
+        HTTP_METHOD_OTHER,
+        HTTP_METHOD_GET,
+        HTTP_METHOD_HEAD,
+        HTTP_METHOD_POST,
+        HTTP_METHOD_PUT,
+        HTTP_METHOD_DELETE,
+        HTTP_METHOD_CONNECT,
+        HTTP_METHOD_OPTIONS,
+        HTTP_METHOD_TRACE,
+        HTTP_METHOD_PATCH,
+};
+
+/* number of enum http_method values */
+#define HTTP_NMETHODS (HTTP_METHOD_PATCH + 1)
+
+/* bit of a method in a set of methods (e.g. hh_methods) */
+#define HTTP_METHOD_BIT(method) (1u << (method))
+
+/* protocol versions (anything else is HTTP_VERSION_OTHER) */
+enum http_version {
+        HTTP_VERSION_OTHER,
+        HTTP_VERSION_1_0,
+        HTTP_VERSION_1_1,
+};
+
+/* headers found in constant time with http_request_known() */
+enum http_header {
+        HTTP_HDR_ACCEPT,
+        HTTP_HDR_ACCEPT_CHARSET,
+        HTTP_HDR_ACCEPT_ENCODING,
+        HTTP_HDR_ACCEPT_LANGUAGE,
+        HTTP_HDR_ACCEPT_RANGES,
+        HTTP_HDR_AUTHORIZATION,
+        HTTP_HDR_CACHE_CONTROL,
+        HTTP_HDR_CONNECTION,
+        HTTP_HDR_CONTENT_ENCODING,
+        HTTP_HDR_CONTENT_LENGTH,
+        HTTP_HDR_CONTENT_TYPE,
+        HTTP_HDR_COOKIE,
+        HTTP_HDR_DATE,
+        HTTP_HDR_DNT,
+        HTTP_HDR_EXPECT,
+        HTTP_HDR_FORWARDED,
+        HTTP_HDR_FROM,
+        HTTP_HDR_HOST,
+        HTTP_HDR_IF_MATCH,
+        HTTP_HDR_IF_MODIFIED_SINCE,
+        HTTP_HDR_IF_NONE_MATCH,
+        HTTP_HDR_IF_RANGE,
+        HTTP_HDR_IF_UNMODIFIED_SINCE,
+        HTTP_HDR_KEEP_ALIVE,
+        HTTP_HDR_MAX_FORWARDS,
+        HTTP_HDR_ORIGIN,
+        HTTP_HDR_PRAGMA,
+        HTTP_HDR_PROXY_AUTHORIZATION,
+        HTTP_HDR_RANGE,
+        HTTP_HDR_REFERER,
+        HTTP_HDR_SEC_FETCH_DEST,
+        HTTP_HDR_SEC_FETCH_MODE,
+        HTTP_HDR_SEC_FETCH_SITE,
+        HTTP_HDR_TE,
+        HTTP_HDR_TRAILER,
+        HTTP_HDR_TRANSFER_ENCODING,
+        HTTP_HDR_UPGRADE,
+        HTTP_HDR_UPGRADE_INSECURE_REQUESTS,
+        HTTP_HDR_USER_AGENT,
+        HTTP_HDR_VIA,
+        HTTP_HDR_X_FORWARDED_FOR,
+        HTTP_HDR_X_FORWARDED_HOST,
+        HTTP_HDR_X_FORWARDED_PROTO,
+        HTTP_HDR_X_REAL_IP,
+        HTTP_HDR_X_REQUESTED_WITH,
+        /* any other header (and the number of known ones) */
+        HTTP_HDR_OTHER,
+};
+
+/* bit of a known header in a set (e.g. hh_vary) */
+#define HTTP_HEADER_BIT(hdr) (UINT64_C(1) << (hdr))
+
+/* request header */
+struct http_field {
+        /* header name */
+        struct http_view        hf_name;
+        /* header value without surrounding whitespace */
+        struct http_view        hf_value;
+        /* which known header this is (HTTP_HDR_OTHER if none) */
+        enum http_header        hf_id;
+};
+
+/* maximum number of headers in a request */
+#define HTTP_MAX_FIELDS 64
+
+/* query parameter ("key=value" in rq_query) */
+struct http_param {
+        /* key, percent-decoded */
+        struct http_view        hq_key;
+        /* value, percent-decoded in place once asked for */
+        struct http_view        hq_value;
+        /* set once hq_value is decoded */
+        int                     hq_decoded;
+};
+
+/* maximum number of query parameters looked at */
+#define HTTP_MAX_PARAMS 32
+
+/* path segment captured by a route (":name" or "*name") */
+struct http_capture {
+        /* name in the route, without ':' or '*' */
+        const char              *hc_name;
+        /* captured bytes of rq_path (not nul terminated) */
+        struct http_view        hc_value;
+};
+
+/* maximum number of captures in a route */
+#define HTTP_MAX_CAPTURES 8
+
+struct cache;
+struct http_conn;
+struct route;
+struct route_table;
+
+/*
+ * http request (parsed in place: views point into rq_buf, which keeps the
+ * request until http_request_reset() consumes it)
+ */
 struct http_request {
-        /* http request headers */
-        struct hashmap  *rq_headers;
         /* connected socket buffer */
-        struct iobuf    *rq_buf;
+        struct iobuf            *rq_buf;
         /* http method */
-        char            *rq_method;
-        /* resource */
-        char            *rq_resource;
+        struct http_view        rq_method;
+        /*
+         * request target (path and query), only a view: its bytes are
+         * rq_path, a nul where the '?' was, then rq_query (rewritten in
+         * place by the first http_request_query()), so with a query it is
+         * not the target as sent when read as a string
+         */
+        struct http_view        rq_resource;
+        /* rq_resource up to '?' (nul terminated in its place) */
+        struct http_view        rq_path;
+        /* rq_resource after '?' (empty if there is none) */
+        struct http_view        rq_query;
         /* http version */
-        char            *rq_version;
+        struct http_view        rq_version;
+        /* rq_method as an enum */
+        enum http_method        rq_methodid;
+        /* rq_version as an enum */
+        enum http_version       rq_versionid;
+        /* headers in the order received */
+        struct http_field       rq_fields[HTTP_MAX_FIELDS];
+        /* number of entries in rq_fields */
+        size_t                  rq_nfields;
+        /* rq_fields index + 1 of the first of each known header (or 0) */
+        unsigned char           rq_known[HTTP_HDR_OTHER];
+        /* parser state (enum http_parse_state in http.c) */
+        int                     rq_state;
+        /* bytes of input parsed so far */
+        size_t                  rq_parsed;
+        /* start of the token being parsed */
+        size_t                  rq_mark;
+        /* end of the header value being parsed (trailing space excluded) */
+        size_t                  rq_valend;
+        /* length of the header block once complete (zero until then) */
+        size_t                  rq_hdrlen;
+        /* handler serving the request */
+        struct http_handler     *rq_handler;
+        /* rq_path matched by a '*' capture or a prefix handler */
+        struct http_view        rq_pathinfo;
+        /* captures of the route that matched, in route order */
+        struct http_capture     rq_captures[HTTP_MAX_CAPTURES];
+        /* number of entries in rq_captures */
+        size_t                  rq_ncaptures;
+        /*
+         * set if the body uses the chunked transfer coding (cleared once
+         * an event loop has decoded all of it in place)
+         */
+        int                     rq_chunked;
+        /* body decoder state (enum http_body_state in http.c) */
+        int                     rq_bodystate;
+        /* set until "100 Continue" is sent for "Expect: 100-continue" */
+        int                     rq_expect;
+        /* body bytes left in the message or the current chunk */
+        size_t                  rq_bodyleft;
+        /* body bytes returned by http_request_read_body() so far */
+        size_t                  rq_bodyread;
+        /* offset of the first body byte not yet decoded */
+        size_t                  rq_bodyoff;
+        /* largest body accepted (zero for no limit) */
+        size_t                  rq_maxbody;
+        /* event loop connection the request came on (NULL when forked) */
+        struct http_conn        *rq_conn;
+        /* rq_query split up by the first http_request_query() */
+        struct http_param       rq_params[HTTP_MAX_PARAMS];
+        /* number of entries in rq_params */
+        size_t                  rq_nparams;
+        /* set once rq_query is split into rq_params */
+        int                     rq_split;
 };
 
-/* http response */
+/*
+ * http response, written straight into the request's output buffer by
+ * http_response_status(), http_response_header() and
+ * http_response_send()
+ */
 struct http_response {
-        /* http response headers */
-        struct hashmap          *rs_headers;
-        /* http version */
-        char                    *rs_version;
-        /* http response code */
-        char                    *rs_code;
-        /* http response code message */
-        char                    *rs_msg;
+        /* request answered */
+        struct http_request     *rs_req;
+        /* status code sent (zero until the status line is written) */
+        int                     rs_status;
+        /* set once the header block is ended by http_response_send() */
+        int                     rs_sent;
+        /* zlib level bodies are compressed at (zero for none) */
+        int                     rs_level;
+        /*
+         * 1 once a Content-Type worth compressing is set, -1 once the
+         * handler set a Content-Encoding of its own
+         */
+        int                     rs_compress;
 };
 
-/* http handler */
+/* http handler (fields not used must be zero, e.g. use calloc()) */
 struct http_handler {
         /* handler function */
         void (*hh_fn)(struct http_request *req, struct http_response *res);
+        /* handler data, reachable through req->rq_handler */
+        void *hh_arg;
+        /* frees hh_arg when the server is freed */
+        void (*hh_free)(void *arg);
+        /*
+         * set to serve every resource below the resource the handler is
+         * added for (which must end in '/')
+         */
+        int hh_prefix;
+        /*
+         * methods served (HTTP_METHOD_BIT()s or'ed together, zero for
+         * every method), other methods get "405 Method Not Allowed"
+         */
+        unsigned hh_methods;
+        /*
+         * ms a GET response of the handler is served from the server's
+         * cache (zero to run the handler for every request), see
+         * http_server_set_cache()
+         */
+        long hh_cache_ttl;
+        /*
+         * request headers the cached response depends on
+         * (HTTP_HEADER_BIT()s or'ed together, e.g. Accept-Language)
+         */
+        uint64_t hh_vary;
+};
+
+/*
+ * stage run before the handlers of routes below a prefix, added with
+ * http_server_use() (fields not used must be zero, e.g. use calloc())
+ */
+struct http_middleware {
+        /*
+         * called before the handler, returns 0 to pass the request on
+         * or -1 once it has answered the request itself (e.g. with
+         * "401 Unauthorized"), then nothing after it runs
+         */
+        int (*hm_fn)(struct http_request *req,
+                     struct http_response *res,
+                     void *arg);
+        /* passed to hm_fn */
+        void *hm_arg;
+        /* frees hm_arg when the server is freed */
+        void (*hm_free)(void *arg);
+};
+
+/* how http_server_listen() serves connections */
+enum http_server_mode {
+        /* fork() a child for every accepted connection */
+        HTTP_SERVER_FORK,
+        /* single threaded, non-blocking epoll event loop */
+        HTTP_SERVER_EPOLL,
+        /*
+         * workers forked at startup, each running the epoll event loop
+         * on its own SO_REUSEPORT listening socket
+         */
+        HTTP_SERVER_PREFORK,
+        /*
+         * one epoll event loop thread per core, each with its own
+         * SO_REUSEPORT socket, idle loops steal queued requests from busy
+         * ones (handlers must be thread safe)
+         */
+        HTTP_SERVER_THREADS,
+};
+
+/* kernel interface of HTTP_SERVER_EPOLL and HTTP_SERVER_PREFORK loops */
+enum http_server_backend {
+        /* epoll readiness with recv()/write() */
+        HTTP_BACKEND_EPOLL,
+        /*
+         * io_uring completions: multishot accept, multishot recv into
+         * provided buffer rings and linked send+shutdown+close
+         */
+        HTTP_BACKEND_URING,
 };
 
 /* http server */
 struct http_server {
-        /* mapping of resources to handlers */
-        struct hashmap  *sv_handlers;
+        /* radix tree of routes to handlers (added to until listening) */
+        struct route            *sv_routes;
+        /*
+         * sv_routes frozen by http_server_listen(), read-only and shared
+         * by every worker (NULL until then)
+         */
+        struct route_table      *sv_table;
+        /* how connections are served */
+        enum http_server_mode   sv_mode;
+        /* kernel interface of single threaded event loops */
+        enum http_server_backend sv_backend;
+        /* address sv_fd is bound to (workers bind their own sockets) */
+        struct sockaddr_storage sv_addr;
+        /* length of sv_addr */
+        socklen_t               sv_addrlen;
+        /* socket() arguments used for sv_fd */
+        int                     sv_family;
+        int                     sv_socktype;
+        int                     sv_protocol;
+        /* number of worker processes/threads (zero for one per core) */
+        long                    sv_nworkers;
+        /* maximum requests served per connection (zero for no limit) */
+        long                    sv_max_requests;
+        /* ms a connection may wait for a request (zero for no limit) */
+        long                    sv_idle_timeout;
+        /* largest request body accepted (zero for no limit) */
+        size_t                  sv_max_body;
+        /* zlib level of compressed response bodies (zero for none) */
+        int                     sv_gzip_level;
+        /* responses of handlers with hh_cache_ttl, kept per thread */
+        struct cache            *sv_cache;
         /* listening socket */
-        int             sv_fd;
+        int                     sv_fd;
 };
 
 /**
@@ -59,20 +366,182 @@ struct http_server {
 extern struct http_server *http_server_new(struct addrinfo *ap);
 
 /**
- * Add a new handler to http_server:
+ * Add a new handler to http_server for a route: static bytes, segments
+ * starting with ':' that capture one path segment ("/users/:id") and a
+ * last segment starting with '*' that captures the rest of the path;
+ * static bytes win over ':' which wins over '*'; handlers for different
+ * methods (hh_methods) may share a route:
  *
  * args:
  *      @hp:            pointer to http_server
- *      @resource:      resource this handler is handling
- *      @fn:            function to call when resource is requested
+ *      @resource:      route this handler is handling, from malloc():
+ *                      the server frees it on success, on failure it
+ *                      stays the caller's
+ *      @handler:       handler to call when resource is requested (a
+ *                      prefix handler gets resources below it too, the
+ *                      longest prefix wins and exact matches come first);
+ *                      owned by the server from the first successful add
+ *                      on and freed once with it (hh_free() included),
+ *                      even if added for several routes
  * ret:
  *      @success:       0
- *      @failure:       -1 and errno set
+ *      @failure:       -1 and errno set (EEXIST if a method of the
+ *                      route already has a handler, EBUSY once the
+ *                      server listens)
  */
 extern int http_server_add_handler(struct http_server *hp,
                                    char *resource,
                                    struct http_handler *handler);
 
+/**
+ * Add a route answering GET and HEAD with the same bytes every time: the
+ * response is serialized once, into a read-only page aligned buffer that
+ * each request queues by reference, with the current Date line copied in
+ * after the status line:
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @path:          route the response is for
+ *      @status:        status code (e.g. 200), not 1xx
+ *      @headers:       "Name: value" lines, each ending in "\r\n" (or
+ *                      NULL; Date, and Content-Length except for 204 and
+ *                      304, are added, so neither may be given, nor
+ *                      Transfer-Encoding)
+ *      @body:          response body (or NULL for none; ignored for 204
+ *                      and 304, which have none)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL for an unknown or 1xx
+ *                      code or bad headers, EBUSY once the server listens)
+ */
+extern int http_server_add_static_response(struct http_server *hp,
+                                           const char *path,
+                                           int status,
+                                           const char *headers,
+                                           const char *body);
+
+/**
+ * Add middleware for every route starting with a prefix; each route's
+ * chain is resolved when the server starts listening (middleware of
+ * shorter prefixes first, then in the order added):
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @prefix:        start of the routes ("/" for all of them)
+ *      @mw:            middleware (owned and freed by the server)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EBUSY once the server listens)
+ */
+extern int http_server_use(struct http_server *hp,
+                           const char *prefix,
+                           struct http_middleware *mw);
+
+/**
+ * Choose how http_server_listen() serves connections (HTTP_SERVER_FORK
+ * is the default):
+ *
+ * args:
+ *      @hp:    pointer to http_server
+ *      @mode:  server mode
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int http_server_set_mode(struct http_server *hp,
+                                enum http_server_mode mode);
+
+/**
+ * Choose event loop backend (http_server_new() picks HTTP_BACKEND_URING
+ * when the kernel supports it, HTTP_BACKEND_EPOLL otherwise):
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @backend:       backend
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOTSUP if the kernel lacks
+ *                      io_uring support)
+ */
+extern int http_server_set_backend(struct http_server *hp,
+                                   enum http_server_backend backend);
+
+/**
+ * Set number of workers started by HTTP_SERVER_PREFORK and
+ * HTTP_SERVER_THREADS:
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @nworkers:      number of workers (or zero for one per online core)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int http_server_set_workers(struct http_server *hp, long nworkers);
+
+/**
+ * Configure HTTP/1.1 persistent connections:
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @max_requests:  requests served per connection before it is
+ *                      closed (1 disables keep-alive, zero for no limit)
+ *      @idle_timeout:  milliseconds a connection may take to send a
+ *                      complete request (zero for no limit)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int http_server_set_keepalive(struct http_server *hp,
+                                     long max_requests,
+                                     long idle_timeout);
+
+/**
+ * Limit the size of request bodies (larger ones get "413 Content Too
+ * Large" when announced by Content-Length, and fail
+ * http_request_read_body() with EMSGSIZE when chunked); event loops
+ * buffer a whole body before running its handler, so there this also
+ * bounds the memory a request may take, and chunked ones get the 413
+ * too:
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @max_body:      largest body in bytes (zero for no limit)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int http_server_set_max_body(struct http_server *hp, size_t max_body);
+
+/**
+ * Set how hard bodies of responses built with http_response_send() are
+ * compressed for clients that accept gzip or deflate (only bodies of at
+ * least GZIP_MIN bytes of a type gzip_type() accepts):
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @level:         zlib level from 1 (fastest) to 9 (smallest), or
+ *                      zero to never compress
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int http_server_set_compression(struct http_server *hp, int level);
+
+/**
+ * Set the byte budget of each thread's response cache (responses of
+ * handlers with hh_cache_ttl, least recently used ones are evicted once
+ * it is exceeded):
+ *
+ * args:
+ *      @hp:            pointer to http_server
+ *      @budget:        bytes of responses kept (zero disables the cache)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EBUSY once the server listens)
+ */
+extern int http_server_set_cache(struct http_server *hp, size_t budget);
+
 /**
  * Listen on http_server:
  *
@@ -85,6 +554,163 @@ extern int http_server_add_handler(struct http_server *hp,
  */
 extern int http_server_listen(struct http_server *hp, int qsize);
 
+/**
+ * Get the bytes a view of a parsed request refers to (nul terminated in
+ * place, valid until the next request is read):
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @view:  view into req (e.g. req->rq_method)
+ * ret:
+ *      pointer into req->rq_buf
+ */
+extern char *http_request_str(struct http_request *req, struct http_view view);
+
+/**
+ * Look up a request header (header names are case insensitive):
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @name:  header name
+ * ret:
+ *      @success:       header value (nul terminated, in rq_buf)
+ *      @failure:       NULL
+ */
+extern char *http_request_header(struct http_request *req, const char *name);
+
+/**
+ * Look up a known request header without comparing names:
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @hdr:   header (e.g. HTTP_HDR_HOST)
+ * ret:
+ *      @success:       header value (nul terminated, in rq_buf)
+ *      @failure:       NULL
+ */
+extern char *http_request_known(struct http_request *req,
+                                enum http_header hdr);
+
+/**
+ * Tell whether a request's Accept-Encoding takes a content coding,
+ * either by name or through "*" (neither with "q=0"):
+ *
+ * args:
+ *      @req:           pointer to http_request
+ *      @coding:        content coding (e.g. "gzip")
+ * ret:
+ *      1 if it does, 0 if not
+ */
+extern int http_request_accepts(struct http_request *req, const char *coding);
+
+/**
+ * Look up a capture of the route that matched the request:
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @name:  capture name (without ':' or '*')
+ * ret:
+ *      @success:       captured bytes of rq_path (not nul terminated)
+ *      @failure:       NULL
+ */
+extern const struct http_view *http_request_capture(struct http_request *req,
+                                                    const char *name);
+
+/**
+ * Look up a query parameter, percent-decoding its value (and '+' to
+ * space) the first time it is asked for; the query is split in place on
+ * the first call, only the first HTTP_MAX_PARAMS parameters are seen:
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @key:   parameter name (decoded)
+ * ret:
+ *      @success:       decoded value (nul terminated, in rq_buf, "" for a
+ *                      key without '=')
+ *      @failure:       NULL
+ */
+extern char *http_request_query(struct http_request *req, const char *key);
+
+/**
+ * Read the next part of the request body (Content-Length or chunked
+ * transfer coding, decoded), waiting for the client if nothing is
+ * buffered (never on an event loop, which buffers the whole body before
+ * calling the handler); a body the handler leaves unread ends the
+ * connection unless it is already buffered:
+ *
+ * args:
+ *      @req:   pointer to http_request
+ *      @buf:   where to store body bytes
+ *      @len:   size of buf
+ * ret:
+ *      @success:       number of bytes stored (0 at the end of the body)
+ *      @failure:       -1 and errno set (EBADMSG for a malformed chunk,
+ *                      EMSGSIZE if the body exceeds the server limit,
+ *                      ETIMEDOUT if the client stalls)
+ */
+extern ssize_t http_request_read_body(struct http_request *req,
+                                      void *buf,
+                                      size_t len);
+
+/**
+ * Start a response with a status line (from a table of preformatted
+ * lines) and a Date header (formatted at most once a second per thread):
+ *
+ * args:
+ *      @res:           pointer to http_response
+ *      @status:        status code (e.g. 200)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL for an unknown code or
+ *                      a response already started)
+ */
+extern int http_response_status(struct http_response *res, int status);
+
+/**
+ * Date header line ("Date: ...\r\n") of the current second, the one
+ * http_response_status() adds (e.g. for a response stored without it):
+ *
+ * args:
+ *      @lenp:  where to store the length of the line
+ * ret:
+ *      the line, valid in the calling thread until it is called again
+ */
+extern const char *http_response_date(size_t *lenp);
+
+/**
+ * Add a response header (the status is 200 unless set before):
+ *
+ * args:
+ *      @res:   pointer to http_response
+ *      @name:  header name (a token)
+ *      @value: header value (no control bytes but tab)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL once the response is sent,
+ *                      or for a name or value that could split it)
+ */
+extern int http_response_header(struct http_response *res,
+                                const char *name,
+                                const char *value);
+
+/**
+ * End the header block with Content-Length and send the body (left out
+ * for HEAD, and along with Content-Length for 204 and 304); a "200 OK"
+ * body of a compressible Content-Type goes out gzip or deflate coded
+ * when the client accepts it, see http_server_set_compression():
+ *
+ * args:
+ *      @res:   pointer to http_response
+ *      @body:  response body (NULL if len is 0)
+ *      @len:   number of bytes in body
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL if already sent)
+ */
+extern int http_response_send(struct http_response *res,
+                              const void *body,
+                              size_t len);
+
 /**
  * Free an http_server:
  *
@@ -1,4 +1,12 @@
+#define _GNU_SOURCE
 #include "iobuf.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 struct iobuf *
 iobuf_new(int fd, size_t size)
@@ -22,8 +30,25 @@ iobuf_new(int fd, size_t size)
 
         ip->ib_inbufp = ip->ib_inendp = ip->ib_inbuf;
         ip->ib_outbufp = ip->ib_outbuf;
+        ip->ib_iovcnt = 0;
+        ip->ib_outlen = 0;
+        ip->ib_nsent = 0;
+        ip->ib_spill = NULL;
+        ip->ib_spillsize = 0;
+        ip->ib_sendfd = -1;
+        ip->ib_sendpipe = 0;
+        ip->ib_sendoff = 0;
+        ip->ib_sendleft = 0;
         ip->ib_size = size;
+        ip->ib_insize = size;
         ip->ib_fd = fd;
+        ip->ib_corked = 0;
+        ip->ib_stalled = 0;
+        ip->ib_cap = NULL;
+        ip->ib_caplen = 0;
+        ip->ib_capsize = 0;
+        ip->ib_capmax = 0;
+        ip->ib_caperr = 0;
         goto ret;
 free_inbuf:
         free(ip->ib_inbuf);
@@ -34,28 +59,6 @@ ret:
         return ip;
 }
 
-static int iobuf_sanity(const struct iobuf *ip);
-
-int
-iobuf_getc(struct iobuf *ip)
-{
-        ssize_t nread;
-
-        if (iobuf_sanity(ip) < 0)
-                return -1;
-
-        if (ip->ib_inbufp < ip->ib_inendp)
-                return *ip->ib_inbufp++;
-
-        nread = read(ip->ib_fd, ip->ib_inbuf, ip->ib_size);
-        if (nread <= 0)
-                return nread;
-
-        ip->ib_inbufp = ip->ib_inbuf;
-        ip->ib_inendp = ip->ib_inbuf + nread;
-        return *ip->ib_inbufp++;
-}
-
 static int
 iobuf_sanity(const struct iobuf *ip)
 {
@@ -72,13 +75,15 @@ iobuf_sanity(const struct iobuf *ip)
                 return -1;
         if (ip->ib_inbufp == NULL)
                 return -1;
-        if (ip->ib_inbufp > ip->ib_inbuf + ip->ib_size)
+        if (ip->ib_insize < ip->ib_size)
+                return -1;
+        if (ip->ib_inbufp > ip->ib_inbuf + ip->ib_insize)
                 return -1;
         if (ip->ib_inbufp < ip->ib_inbuf)
                 return -1;
         if (ip->ib_inendp == NULL)
                 return -1;
-        if (ip->ib_inendp > ip->ib_inbuf + ip->ib_size)
+        if (ip->ib_inendp > ip->ib_inbuf + ip->ib_insize)
                 return -1;
         if (ip->ib_inendp < ip->ib_inbuf)
                 return -1;
@@ -88,25 +93,485 @@ iobuf_sanity(const struct iobuf *ip)
                 return -1;
         if (ip->ib_outbufp < ip->ib_outbuf)
                 return -1;
+        if (ip->ib_iovcnt > IOBUF_IOVMAX)
+                return -1;
         errno = 0;
         return 0;
 }
 
+static size_t iobuf_compact(struct iobuf *ip);
+
+int
+iobuf_consume(struct iobuf *ip, size_t n)
+{
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (n > (size_t)(ip->ib_inendp - ip->ib_inbufp)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ip->ib_inbufp += n;
+        return 0;
+}
+
+ssize_t
+iobuf_read(struct iobuf *ip)
+{
+        ssize_t nread;
+        size_t  nleft;
+
+        nleft = iobuf_compact(ip);
+        if (nleft == ip->ib_insize) {
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        nread = read(ip->ib_fd, ip->ib_inendp, ip->ib_insize - nleft);
+        if (nread > 0)
+                ip->ib_inendp += nread;
+
+        return nread;
+}
+
+ssize_t
+iobuf_fill(struct iobuf *ip)
+{
+        ssize_t nread;
+        size_t  nleft;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        nleft = iobuf_compact(ip);
+
+        if (nleft == ip->ib_insize) {
+                errno = ENOBUFS;
+                return -1;
+        }
+
+        nread = recv(ip->ib_fd, ip->ib_inendp, ip->ib_insize - nleft,
+                     MSG_DONTWAIT);
+        if (nread > 0)
+                ip->ib_inendp += nread;
+
+        return nread;
+}
+
+static size_t
+iobuf_compact(struct iobuf *ip)
+{
+        size_t  nleft;
+
+        nleft = ip->ib_inendp - ip->ib_inbufp;
+        if (ip->ib_inbufp != ip->ib_inbuf) {
+                memmove(ip->ib_inbuf, ip->ib_inbufp, nleft);
+                ip->ib_inbufp = ip->ib_inbuf;
+                ip->ib_inendp = ip->ib_inbuf + nleft;
+        }
+
+        return nleft;
+}
+
+ssize_t
+iobuf_feed(struct iobuf *ip, const char *buf, size_t len)
+{
+        size_t  room;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        room = ip->ib_insize - iobuf_compact(ip);
+        if (len > room)
+                len = room;
+
+        memcpy(ip->ib_inendp, buf, len);
+        ip->ib_inendp += len;
+        return len;
+}
+
+int
+iobuf_resize_in(struct iobuf *ip, size_t size)
+{
+        char    *inbuf = NULL;
+        size_t  nleft;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        nleft = iobuf_compact(ip);
+        if (size < ip->ib_size)
+                size = ip->ib_size;
+        if (size < nleft)
+                size = nleft;
+        if (size == ip->ib_insize)
+                return 0;
+
+        inbuf = realloc(ip->ib_inbuf, size);
+        if (inbuf == NULL)
+                return -1;
+
+        ip->ib_inbuf = ip->ib_inbufp = inbuf;
+        ip->ib_inendp = inbuf + nleft;
+        ip->ib_insize = size;
+        return 0;
+}
+
+static int iobuf_reserve(struct iobuf *ip, size_t len);
+static void iobuf_queue(struct iobuf *ip, const char *p, size_t len);
+
 int
 iobuf_putc(struct iobuf *ip, char c)
 {
         if (iobuf_sanity(ip) < 0)
                 return -1;
-        if (iobuf_flush_out(ip) < 0)
+        if (iobuf_reserve(ip, 1) < 0)
                 return -1;
-        *ip->ib_outbufp++ = c;
+        *ip->ib_outbufp = c;
+        iobuf_queue(ip, ip->ib_outbufp, 1);
+        return 0;
+}
+
+static int iobuf_drain(struct iobuf *ip);
+static int iobuf_settle(struct iobuf *ip);
+static int iobuf_spill(struct iobuf *ip);
+
+/* make room to copy len bytes into ib_outbuf (writing if needed) */
+static int
+iobuf_reserve(struct iobuf *ip, size_t len)
+{
+        struct iovec    *last = NULL;
+
+        if (iobuf_settle(ip) < 0)
+                return -1;
+
+        if (ip->ib_outbufp + len > ip->ib_outbuf + ip->ib_size)
+                return iobuf_drain(ip);
+
+        if (ip->ib_iovcnt < IOBUF_IOVMAX)
+                return 0;
+
+        /* a full queue can still grow its last entry if it ends here */
+        last = &ip->ib_iov[ip->ib_iovcnt - 1];
+        if ((char *)last->iov_base + last->iov_len == ip->ib_outbufp)
+                return 0;
+
+        return iobuf_drain(ip);
+}
+
+/* copy queued output into ib_cap, growing it up to ib_capmax */
+static void
+iobuf_tee(struct iobuf *ip, const char *p, size_t len)
+{
+        char    *cap = NULL;
+        size_t  size;
+
+        if (ip->ib_caperr != 0)
+                return;
+        if (len > ip->ib_capmax - ip->ib_caplen) {
+                ip->ib_caperr = E2BIG;
+                return;
+        }
+
+        if (ip->ib_caplen + len > ip->ib_capsize) {
+                size = ip->ib_capsize * 2;
+                while (size < ip->ib_caplen + len)
+                        size *= 2;
+                if (size > ip->ib_capmax)
+                        size = ip->ib_capmax;
+                cap = realloc(ip->ib_cap, size);
+                if (cap == NULL) {
+                        ip->ib_caperr = ENOMEM;
+                        return;
+                }
+                ip->ib_cap = cap;
+                ip->ib_capsize = size;
+        }
+
+        memcpy(ip->ib_cap + ip->ib_caplen, p, len);
+        ip->ib_caplen += len;
+}
+
+static void
+iobuf_queue(struct iobuf *ip, const char *p, size_t len)
+{
+        struct iovec    *last = NULL;
+
+        if (ip->ib_iovcnt > 0) {
+                last = &ip->ib_iov[ip->ib_iovcnt - 1];
+                if ((char *)last->iov_base + last->iov_len == p)
+                        last->iov_len += len;
+                else
+                        last = NULL;
+        }
+
+        if (last == NULL) {
+                ip->ib_iov[ip->ib_iovcnt].iov_base = (char *)p;
+                ip->ib_iov[ip->ib_iovcnt].iov_len = len;
+                ++ip->ib_iovcnt;
+        }
+
+        if (ip->ib_cap != NULL)
+                iobuf_tee(ip, p, len);
+        if (p == ip->ib_outbufp)
+                ip->ib_outbufp += len;
+        ip->ib_outlen += len;
+}
+
+ssize_t
+iobuf_write(struct iobuf *ip, const void *buf, size_t len)
+{
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (len == 0)
+                return 0;
+
+        /* too big to ever fit: write it along with what is queued */
+        if (len >= ip->ib_size) {
+                if (iobuf_settle(ip) < 0)
+                        return -1;
+                if (ip->ib_iovcnt == IOBUF_IOVMAX && iobuf_drain(ip) < 0)
+                        return -1;
+                iobuf_queue(ip, buf, len);
+                if (iobuf_drain(ip) < 0) {
+                        /* buf must not stay queued once we return */
+                        (void)iobuf_drain_out(ip, ip->ib_outlen);
+                        return -1;
+                }
+                return len;
+        }
+
+        if (iobuf_reserve(ip, len) < 0)
+                return -1;
+
+        memcpy(ip->ib_outbufp, buf, len);
+        iobuf_queue(ip, ip->ib_outbufp, len);
+        return len;
+}
+
+ssize_t
+iobuf_writev(struct iobuf *ip, const struct iovec *iov, int iovcnt)
+{
+        size_t  total = 0;
+        int     i;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (iov == NULL || iovcnt < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (iobuf_settle(ip) < 0)
+                return -1;
+
+        for (i = 0; i < iovcnt; ++i) {
+                if (iov[i].iov_len == 0)
+                        continue;
+                if (ip->ib_iovcnt == IOBUF_IOVMAX && iobuf_drain(ip) < 0)
+                        return -1;
+                iobuf_queue(ip, iov[i].iov_base, iov[i].iov_len);
+                total += iov[i].iov_len;
+        }
+
+        return total;
+}
+
+/* send a file until it is done or the socket is full (*leftp > 0) */
+static int
+iobuf_file_out(struct iobuf *ip,
+               int fd,
+               int ispipe,
+               off_t *offp,
+               size_t *leftp)
+{
+        ssize_t nsent;
+
+        while (*leftp > 0) {
+                if (ispipe)
+                        nsent = splice(fd, NULL, ip->ib_fd, NULL, *leftp,
+                                       SPLICE_F_MOVE | SPLICE_F_MORE);
+                else
+                        nsent = sendfile(ip->ib_fd, fd, offp, *leftp);
+                if (nsent < 0 && errno == EINTR)
+                        continue;
+                if (nsent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return 0;
+                if (nsent < 0)
+                        return -1;
+                /* the length was promised to the client already */
+                if (nsent == 0) {
+                        errno = EIO;
+                        return -1;
+                }
+
+                *leftp -= nsent;
+                ip->ib_nsent += nsent;
+        }
+
         return 0;
 }
 
+int
+iobuf_sendfile(struct iobuf *ip, int fd, off_t offset, size_t len)
+{
+        struct stat     st;
+        int             ispipe;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (fstat(fd, &st) < 0)
+                return -1;
+        ispipe = S_ISFIFO(st.st_mode);
+
+        /* whatever is queued (e.g. headers) goes out before the body */
+        if (iobuf_settle(ip) < 0 || iobuf_drain(ip) < 0)
+                return -1;
+        if (ip->ib_cap != NULL && len > 0)
+                ip->ib_caperr = E2BIG;
+
+        if (!ip->ib_stalled &&
+            iobuf_file_out(ip, fd, ispipe, &offset, &len) < 0)
+                return -1;
+        if (len == 0)
+                return 0;
+
+        /* the rest goes out as the socket drains, fd may be closed by then */
+        ip->ib_sendfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (ip->ib_sendfd < 0)
+                return -1;
+        ip->ib_sendpipe = ispipe;
+        ip->ib_sendoff = offset;
+        ip->ib_sendleft = len;
+        ip->ib_stalled = 1;
+        return 0;
+}
+
+/* output queued after a file still being sent must wait for all of it */
+static int
+iobuf_settle(struct iobuf *ip)
+{
+        char    *buf = NULL;
+        size_t  len;
+        size_t  got;
+        ssize_t n;
+        int     ret;
+
+        if (ip->ib_sendfd < 0)
+                return 0;
+
+        if (iobuf_drain(ip) < 0)
+                return -1;
+        if (ip->ib_sendfd < 0)
+                return 0;
+
+        /* the socket is full: the rest of the file is read in and queued */
+        len = ip->ib_sendleft;
+        buf = malloc(len);
+        if (buf == NULL)
+                return -1;
+
+        for (got = 0; got < len; got += n) {
+                if (ip->ib_sendpipe)
+                        n = read(ip->ib_sendfd, buf + got, len - got);
+                else
+                        n = pread(ip->ib_sendfd, buf + got, len - got,
+                                  ip->ib_sendoff + got);
+                if (n < 0 && errno == EINTR) {
+                        n = 0;
+                        continue;
+                }
+                if (n == 0)
+                        errno = EIO;
+                if (n <= 0) {
+                        free(buf);
+                        return -1;
+                }
+        }
+
+        (void)close(ip->ib_sendfd);
+        ip->ib_sendfd = -1;
+        ip->ib_sendleft = 0;
+
+        /* the queue is at most a spill and what came after it */
+        iobuf_queue(ip, buf, len);
+        ret = iobuf_spill(ip);
+        free(buf);
+        return ret;
+}
+
+ssize_t
+iobuf_puts(struct iobuf *ip, const char *s)
+{
+        if (s == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return iobuf_write(ip, s, strlen(s));
+}
+
+int
+iobuf_printf(struct iobuf *ip, const char *fmt, ...)
+{
+        va_list ap;
+        int     ret;
+
+        va_start(ap, fmt);
+        ret = iobuf_vprintf(ip, fmt, ap);
+        va_end(ap);
+        return ret;
+}
+
+int
+iobuf_vprintf(struct iobuf *ip, const char *fmt, va_list ap)
+{
+        va_list ap2;
+        size_t  room;
+        char    *p = NULL;
+        int     len;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (iobuf_reserve(ip, 0) < 0)
+                return -1;
+
+        /* format in place, only output that does not fit is copied */
+        room = ip->ib_outbuf + ip->ib_size - ip->ib_outbufp;
+        va_copy(ap2, ap);
+        len = vsnprintf(ip->ib_outbufp, room, fmt, ap2);
+        va_end(ap2);
+        if (len < 0)
+                return -1;
+
+        if ((size_t)len < room) {
+                if (len > 0)
+                        iobuf_queue(ip, ip->ib_outbufp, len);
+                return len;
+        }
+
+        p = malloc(len + 1);
+        if (p == NULL)
+                return -1;
+
+        (void)vsnprintf(p, len + 1, fmt, ap);
+        if (iobuf_write(ip, p, len) < 0)
+                len = -1;
+        free(p);
+        return len;
+}
+
 int
 iobuf_free(struct iobuf **ipp)
 {
         struct iobuf    *ip = NULL;
+        int             saved_errno;
+        int             ret;
 
         if (ipp == NULL) {
                 errno = EINVAL;
@@ -117,33 +582,326 @@ iobuf_free(struct iobuf **ipp)
         if (iobuf_sanity(ip) < 0)
                 return -1;
 
-        if (iobuf_flush_out(ip) < 0)
-                return -1;
+        /* freed even if the peer is gone, the error is returned after */
+        ret = iobuf_uncork(ip);
+        saved_errno = errno;
 
+        if (ip->ib_sendfd >= 0)
+                (void)close(ip->ib_sendfd);
         free(ip->ib_inbuf);
         free(ip->ib_outbuf);
+        free(ip->ib_spill);
+        free(ip->ib_cap);
         free(ip);
         *ipp = NULL;
-        return 0;
+        errno = saved_errno;
+        return ret;
 }
 
 int
 iobuf_flush_out(struct iobuf *ip)
 {
-        ssize_t nwritten;
-        size_t  ntowrite;
-
         if (iobuf_sanity(ip) < 0)
                 return -1;
 
-        ntowrite = ip->ib_outbufp - ip->ib_outbuf;
-        if (ntowrite == 0)
+        if (ip->ib_iovcnt == 0 && ip->ib_sendfd < 0)
+                return 0;
+
+        if (ip->ib_corked && ip->ib_outbufp < ip->ib_outbuf + ip->ib_size &&
+            ip->ib_iovcnt < IOBUF_IOVMAX)
+                return 0;
+
+        return iobuf_drain(ip);
+}
+
+static int
+iobuf_drain(struct iobuf *ip)
+{
+        ssize_t nwritten;
+
+        /* short writes leave the rest queued for the next attempt */
+        while (ip->ib_iovcnt > 0) {
+                nwritten = writev(ip->ib_fd, ip->ib_iov, ip->ib_iovcnt);
+                if (nwritten < 0 && errno == EINTR)
+                        continue;
+                /* a non-blocking fd is written again once it is writable */
+                if (nwritten < 0 && (errno == EAGAIN ||
+                                     errno == EWOULDBLOCK)) {
+                        ip->ib_stalled = 1;
+                        return iobuf_spill(ip);
+                }
+                if (nwritten < 0)
+                        return -1;
+
+                (void)iobuf_drain_out(ip, nwritten);
+        }
+
+        if (ip->ib_sendfd < 0)
+                return 0;
+
+        if (iobuf_file_out(ip, ip->ib_sendfd, ip->ib_sendpipe,
+                           &ip->ib_sendoff, &ip->ib_sendleft) < 0)
+                return -1;
+        if (ip->ib_sendleft > 0) {
+                ip->ib_stalled = 1;
                 return 0;
+        }
+
+        (void)close(ip->ib_sendfd);
+        ip->ib_sendfd = -1;
+        ip->ib_stalled = 0;
+        return 0;
+}
+
+static int
+iobuf_spilled(const struct iobuf *ip, const void *p)
+{
+        return ip->ib_spill != NULL && (const char *)p >= ip->ib_spill &&
+               (const char *)p < ip->ib_spill + ip->ib_spillsize;
+}
+
+/*
+ * move queued output into ib_spill, as one segment: ib_outbuf and ib_iov
+ * can then take more and borrowed buffers need not outlive the call
+ */
+static int
+iobuf_spill(struct iobuf *ip)
+{
+        char    *spill = ip->ib_spill;
+        size_t  kept = 0;
+        size_t  off = 0;
+        size_t  size;
+
+        /* an earlier spill, partly written since, stays where it is */
+        if (iobuf_spilled(ip, ip->ib_iov[0].iov_base)) {
+                if (ip->ib_iovcnt == 1)
+                        return 0;
+                kept = ip->ib_iov[0].iov_len;
+                off = (char *)ip->ib_iov[0].iov_base - spill;
+        }
 
-        nwritten = write(ip->ib_fd, ip->ib_outbuf, ntowrite);
-        if (nwritten != (ssize_t)ntowrite)
+        /* out of room after it: grow ib_spill if need be, then move up */
+        if (off + ip->ib_outlen > ip->ib_spillsize) {
+                if (ip->ib_outlen > ip->ib_spillsize) {
+                        size = ip->ib_spillsize > 0 ? ip->ib_spillsize :
+                                                      ip->ib_size;
+                        while (size < ip->ib_outlen)
+                                size *= 2;
+                        spill = realloc(ip->ib_spill, size);
+                        if (spill == NULL)
+                                return -1;
+                        ip->ib_spill = spill;
+                        ip->ib_spillsize = size;
+                }
+                memmove(spill, spill + off, kept);
+                off = 0;
+        }
+
+        /* ib_iov[0] may point into the old ib_spill, it is only skipped */
+        if (iobuf_copy_out(ip, kept, spill + off + kept,
+                           ip->ib_outlen - kept) < 0)
                 return -1;
 
+        ip->ib_iov[0].iov_base = spill + off;
+        ip->ib_iov[0].iov_len = ip->ib_outlen;
+        ip->ib_iovcnt = 1;
         ip->ib_outbufp = ip->ib_outbuf;
         return 0;
 }
+
+int
+iobuf_copy_out(struct iobuf *ip, size_t off, void *buf, size_t len)
+{
+        char    *p = buf;
+        size_t  i;
+        size_t  n;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (off > ip->ib_outlen || len > ip->ib_outlen - off) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; len > 0; ++i) {
+                if (off >= ip->ib_iov[i].iov_len) {
+                        off -= ip->ib_iov[i].iov_len;
+                        continue;
+                }
+
+                n = ip->ib_iov[i].iov_len - off;
+                if (n > len)
+                        n = len;
+                memcpy(p, (char *)ip->ib_iov[i].iov_base + off, n);
+                p += n;
+                len -= n;
+                off = 0;
+        }
+
+        return 0;
+}
+
+int
+iobuf_truncate_out(struct iobuf *ip, size_t len)
+{
+        struct iovec    *last = NULL;
+        size_t          n;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (len > ip->ib_outlen) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* a copy being taken loses its end too */
+        if (ip->ib_cap != NULL && ip->ib_caperr == 0) {
+                if (ip->ib_outlen - len > ip->ib_caplen)
+                        ip->ib_caperr = EINVAL;
+                else
+                        ip->ib_caplen -= ip->ib_outlen - len;
+        }
+
+        while (ip->ib_outlen > len) {
+                last = &ip->ib_iov[ip->ib_iovcnt - 1];
+                n = ip->ib_outlen - len;
+                if (n > last->iov_len)
+                        n = last->iov_len;
+
+                /* the end of ib_outbuf is written again */
+                if ((char *)last->iov_base + last->iov_len == ip->ib_outbufp)
+                        ip->ib_outbufp -= n;
+                last->iov_len -= n;
+                ip->ib_outlen -= n;
+                if (last->iov_len == 0)
+                        --ip->ib_iovcnt;
+        }
+
+        if (ip->ib_iovcnt == 0)
+                ip->ib_outbufp = ip->ib_outbuf;
+        return 0;
+}
+
+int
+iobuf_drain_out(struct iobuf *ip, size_t n)
+{
+        size_t  i;
+
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (n > ip->ib_outlen) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ip->ib_outlen -= n;
+        ip->ib_nsent += n;
+        for (i = 0; i < ip->ib_iovcnt && n >= ip->ib_iov[i].iov_len; ++i)
+                n -= ip->ib_iov[i].iov_len;
+
+        if (n > 0) {
+                ip->ib_iov[i].iov_base = (char *)ip->ib_iov[i].iov_base + n;
+                ip->ib_iov[i].iov_len -= n;
+        }
+
+        memmove(ip->ib_iov, ip->ib_iov + i,
+                (ip->ib_iovcnt - i) * sizeof(*ip->ib_iov));
+        ip->ib_iovcnt -= i;
+
+        /* ib_outbuf is only reused once everything in it went out */
+        if (ip->ib_iovcnt == 0) {
+                ip->ib_outbufp = ip->ib_outbuf;
+                ip->ib_stalled = ip->ib_sendfd >= 0;
+                /* a slow reader's backlog is not kept around */
+                free(ip->ib_spill);
+                ip->ib_spill = NULL;
+                ip->ib_spillsize = 0;
+        }
+        return 0;
+}
+
+int
+iobuf_discard_out(struct iobuf *ip)
+{
+        if (iobuf_drain_out(ip, ip->ib_outlen) < 0)
+                return -1;
+
+        if (ip->ib_sendfd >= 0) {
+                (void)close(ip->ib_sendfd);
+                ip->ib_sendfd = -1;
+                ip->ib_sendleft = 0;
+        }
+        ip->ib_stalled = 0;
+        return 0;
+}
+
+int
+iobuf_capture(struct iobuf *ip, size_t max)
+{
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        if (ip->ib_cap != NULL || max == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* the rest of a file being sent is not part of the copy */
+        if (iobuf_settle(ip) < 0)
+                return -1;
+
+        ip->ib_capsize = max < ip->ib_size ? max : ip->ib_size;
+        ip->ib_cap = malloc(ip->ib_capsize);
+        if (ip->ib_cap == NULL)
+                return -1;
+
+        ip->ib_caplen = 0;
+        ip->ib_capmax = max;
+        ip->ib_caperr = 0;
+        return 0;
+}
+
+char *
+iobuf_capture_end(struct iobuf *ip, size_t *lenp)
+{
+        char    *cap = ip->ib_cap;
+
+        if (cap == NULL) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        ip->ib_cap = NULL;
+        ip->ib_capsize = 0;
+        if (ip->ib_caperr != 0) {
+                free(cap);
+                errno = ip->ib_caperr;
+                return NULL;
+        }
+
+        *lenp = ip->ib_caplen;
+        return cap;
+}
+
+int
+iobuf_cork(struct iobuf *ip)
+{
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        ip->ib_corked = 1;
+        return 0;
+}
+
+int
+iobuf_uncork(struct iobuf *ip)
+{
+        if (iobuf_sanity(ip) < 0)
+                return -1;
+
+        ip->ib_corked = 0;
+        return iobuf_flush_out(ip);
+}
@@ -2,25 +2,71 @@
 #define IOBUF_H
 
 #include <errno.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* maximum number of queued output segments */
+#define IOBUF_IOVMAX    64
+
 /* I/O buffer */
 struct iobuf {
         /* I/O buffer size */
-        size_t  ib_size;
+        size_t          ib_size;
         /* input buffer */
-        char    *ib_inbuf;
+        char            *ib_inbuf;
+        /* size of ib_inbuf (ib_size unless changed by iobuf_resize_in()) */
+        size_t          ib_insize;
         /* next place to read from in ib_inbuf */
-        char    *ib_inbufp;
+        char            *ib_inbufp;
         /* one past last valid byte in ib_inbuf */
-        char    *ib_inendp;
+        char            *ib_inendp;
         /* output buffer */
-        char    *ib_outbuf;
+        char            *ib_outbuf;
         /* next place to write to in ib_outbuf */
-        char    *ib_outbufp;
+        char            *ib_outbufp;
+        /* queued output: pieces of ib_outbuf and iobuf_writev() buffers */
+        struct iovec    ib_iov[IOBUF_IOVMAX];
+        /* number of entries in ib_iov */
+        size_t          ib_iovcnt;
+        /* number of bytes queued in ib_iov */
+        size_t          ib_outlen;
+        /* number of bytes ever written out (queued or sendfile()d) */
+        unsigned long long ib_nsent;
+        /* heap copy of output a non-blocking fd would not take yet */
+        char            *ib_spill;
+        /* size of ib_spill */
+        size_t          ib_spillsize;
+        /* file (or pipe) being sent after the queued output, -1 if none */
+        int             ib_sendfd;
+        /* set if ib_sendfd is a pipe, splice()d rather than sendfile()d */
+        int             ib_sendpipe;
+        /* where the rest of the file starts */
+        off_t           ib_sendoff;
+        /* bytes of the file left to send */
+        size_t          ib_sendleft;
         /* file descriptor */
-        int     ib_fd;
+        int             ib_fd;
+        /* set while output is only written once ib_outbuf is full */
+        int             ib_corked;
+        /*
+         * set once a non-blocking fd would not take more output, until all
+         * of it (file included) is written by iobuf_flush_out() calls made
+         * once the fd is writable
+         */
+        int             ib_stalled;
+        /* copy of output queued since iobuf_capture(), NULL if none */
+        char            *ib_cap;
+        /* bytes in ib_cap */
+        size_t          ib_caplen;
+        /* size of ib_cap */
+        size_t          ib_capsize;
+        /* most bytes copied into ib_cap */
+        size_t          ib_capmax;
+        /* errno iobuf_capture_end() fails with (zero if the copy is whole) */
+        int             ib_caperr;
 };
 
 /**
@@ -36,15 +82,71 @@ struct iobuf {
 extern struct iobuf *iobuf_new(int fd, size_t size);
 
 /**
- * Read a character from iobuf:
+ * Consume buffered input (parsed in place at ib_inbufp):
  *
  * args:
  *      @ip:    pointer to iobuf
+ *      @n:     number of bytes to consume
  * ret:
- *      @success:       character read
+ *      @success:       0
  *      @failure:       -1 and errno set
  */
-extern int iobuf_getc(struct iobuf *ip);
+extern int iobuf_consume(struct iobuf *ip, size_t n);
+
+/**
+ * Read from a socket into iobuf, blocking until something arrives
+ * (unread input is moved to the front of ib_inbuf first):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ * ret:
+ *      @success:       number of bytes read (0 on end of file)
+ *      @failure:       -1 and errno set (ENOBUFS if ib_inbuf is already
+ *                      full)
+ */
+extern ssize_t iobuf_read(struct iobuf *ip);
+
+/**
+ * Read whatever is available on a socket into iobuf without blocking
+ * (unread input is moved to the front of ib_inbuf first):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ * ret:
+ *      @success:       number of bytes read (0 on end of file)
+ *      @failure:       -1 and errno set (EAGAIN if nothing to read,
+ *                      ENOBUFS if ib_inbuf is already full)
+ */
+extern ssize_t iobuf_fill(struct iobuf *ip);
+
+/**
+ * Append bytes read by someone else (e.g. io_uring) to iobuf's input
+ * (unread input is moved to the front of ib_inbuf first):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @buf:   bytes to append
+ *      @len:   number of bytes in buf
+ * ret:
+ *      @success:       number of bytes appended (less than len once
+ *                      ib_inbuf is full)
+ *      @failure:       -1 and errno set
+ */
+extern ssize_t iobuf_feed(struct iobuf *ip, const char *buf, size_t len);
+
+/**
+ * Resize ib_inbuf, e.g. to hold a whole request body, or to shrink it
+ * back once that is consumed (it never gets smaller than ib_size or the
+ * unread input, which is moved to the front of ib_inbuf first):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @size:  number of bytes ib_inbuf is to hold (0 for ib_size)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_resize_in(struct iobuf *ip, size_t size);
 
 /**
  * Write a character into iobuf:
@@ -59,18 +161,108 @@ extern int iobuf_getc(struct iobuf *ip);
 extern int iobuf_putc(struct iobuf *ip, char c);
 
 /**
- * Free an iobuf:
+ * Write bytes into iobuf (payloads of at least ib_size bytes bypass
+ * ib_outbuf and go straight to the file descriptor):
  *
  * args:
- *      @ipp:   pointer to pointer to iobuf
+ *      @ip:    pointer to iobuf
+ *      @buf:   bytes to write
+ *      @len:   number of bytes in buf
+ * ret:
+ *      @success:       len
+ *      @failure:       -1 and errno set
+ */
+extern ssize_t iobuf_write(struct iobuf *ip, const void *buf, size_t len);
+
+/**
+ * Queue buffers for output without copying them (they must stay valid
+ * until written, e.g. static or cached data, unless a non-blocking fd
+ * would not take them and they were copied instead):
+ *
+ * args:
+ *      @ip:            pointer to iobuf
+ *      @iov:           buffers to write
+ *      @iovcnt:        number of entries in iov
+ * ret:
+ *      @success:       number of bytes queued
+ *      @failure:       -1 and errno set
+ */
+extern ssize_t iobuf_writev(struct iobuf *ip,
+                            const struct iovec *iov,
+                            int iovcnt);
+
+/**
+ * Write queued output, then len bytes of fd straight to the socket with
+ * sendfile() (or splice() if fd is a pipe) so they never enter user
+ * space; on a non-blocking socket whatever it does not take yet is sent
+ * by iobuf_flush_out() once it is writable, from a dup() of fd:
+ *
+ * args:
+ *      @ip:            pointer to iobuf
+ *      @fd:            file (or pipe) to read from (free to close once
+ *                      the call returns)
+ *      @offset:        where to start reading in fd (ignored for pipes)
+ *      @len:           number of bytes to send
  * ret:
  *      @success:       0
+ *      @failure:       -1 and errno set (EIO if fd ends before len bytes)
+ */
+extern int iobuf_sendfile(struct iobuf *ip, int fd, off_t offset, size_t len);
+
+/**
+ * Write a string (without its terminating null byte) into iobuf:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @s:     string to write
+ * ret:
+ *      @success:       number of bytes written
  *      @failure:       -1 and errno set
  */
+extern ssize_t iobuf_puts(struct iobuf *ip, const char *s);
+
+/**
+ * Write formatted output into iobuf:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @fmt:   printf(3) format
+ * ret:
+ *      @success:       number of bytes written
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_printf(struct iobuf *ip, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+
+/**
+ * Same as iobuf_printf() with a va_list:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @fmt:   printf(3) format
+ *      @ap:    arguments for fmt
+ * ret:
+ *      @success:       number of bytes written
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_vprintf(struct iobuf *ip, const char *fmt, va_list ap);
+
+/**
+ * Flush what is queued and free an iobuf (freed even if the flush fails,
+ * e.g. the peer reset the connection):
+ *
+ * args:
+ *      @ipp:   pointer to pointer to iobuf
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (*ipp is freed unless EINVAL)
+ */
 extern int iobuf_free(struct iobuf **ipp);
 
 /**
- * Flush output buffer:
+ * Flush queued output with writev() (unless corked and ib_outbuf and
+ * ib_iov still have room); on a non-blocking fd what does not go out is
+ * kept, borrowed buffers copied, and ib_stalled set until it has:
  *
  * args:
  *      @ip:    pointer to iobuf
@@ -80,4 +272,105 @@ extern int iobuf_free(struct iobuf **ipp);
  */
 extern int iobuf_flush_out(struct iobuf *ip);
 
+/**
+ * Copy bytes of queued (not yet written) output:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @off:   offset into queued output
+ *      @buf:   where to copy to
+ *      @len:   number of bytes to copy
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL if fewer bytes are queued)
+ */
+extern int iobuf_copy_out(struct iobuf *ip, size_t off, void *buf, size_t len);
+
+/**
+ * Drop bytes from the end of queued output (e.g. a response about to be
+ * replaced):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @len:   number of bytes to keep queued
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL if fewer bytes are queued)
+ */
+extern int iobuf_truncate_out(struct iobuf *ip, size_t len);
+
+/**
+ * Drop bytes from front of queued output once someone else (e.g.
+ * io_uring) has written them:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @n:     number of bytes written
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_drain_out(struct iobuf *ip, size_t n);
+
+/**
+ * Drop all queued output and what is left of a file being sent (e.g. the
+ * connection is gone):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_discard_out(struct iobuf *ip);
+
+/**
+ * Start copying output as it is queued (e.g. to keep a response that may
+ * be partly written before the rest of it is queued):
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @max:   most bytes copied (more makes iobuf_capture_end() fail)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_capture(struct iobuf *ip, size_t max);
+
+/**
+ * Stop copying output and take the copy:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ *      @lenp:  where to store the length of the copy
+ * ret:
+ *      @success:       output queued since iobuf_capture() (free() it)
+ *      @failure:       NULL and errno set (E2BIG if more than max bytes or
+ *                      a file were queued, EINVAL if not capturing)
+ */
+extern char *iobuf_capture_end(struct iobuf *ip, size_t *lenp);
+
+/**
+ * Hold back output (iobuf_flush_out() only writes once ib_outbuf is full)
+ * so several responses go out in one write:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_cork(struct iobuf *ip);
+
+/**
+ * Stop holding back output and flush whatever is buffered:
+ *
+ * args:
+ *      @ip:    pointer to iobuf
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int iobuf_uncork(struct iobuf *ip);
+
 #endif
@@ -0,0 +1,627 @@
+#include "route.h"
+#include <string.h>
+
+static struct route *
+route_node(const char *label, size_t len)
+{
+        struct route    *rt = NULL;
+
+        rt = calloc(1, sizeof(*rt));
+        if (rt == NULL)
+                return NULL;
+
+        rt->rt_label = strndup(label, len);
+        if (rt->rt_label == NULL) {
+                free(rt);
+                return NULL;
+        }
+        rt->rt_len = len;
+        return rt;
+}
+
+struct route *
+route_new(void)
+{
+        return route_node("", 0);
+}
+
+/* append a child matching static bytes to rt */
+static int
+route_link(struct route *rt, struct route *child)
+{
+        struct route    **children = NULL;
+        char            *index = NULL;
+        size_t          n = rt->rt_nchildren;
+
+        children = realloc(rt->rt_children, (n + 1) * sizeof(*children));
+        if (children == NULL)
+                return -1;
+        rt->rt_children = children;
+
+        index = realloc(rt->rt_index, n + 1);
+        if (index == NULL)
+                return -1;
+        rt->rt_index = index;
+
+        children[n] = child;
+        index[n] = child->rt_label[0];
+        rt->rt_nchildren = n + 1;
+        return 0;
+}
+
+/* put a node matching the first k bytes of child i of rt above it */
+static struct route *
+route_split(struct route *rt, size_t i, size_t k)
+{
+        struct route    *child = rt->rt_children[i];
+        struct route    *mid = NULL;
+
+        mid = route_node(child->rt_label, k);
+        if (mid == NULL)
+                return NULL;
+
+        mid->rt_children = malloc(sizeof(*mid->rt_children));
+        mid->rt_index = malloc(1);
+        if (mid->rt_children == NULL || mid->rt_index == NULL) {
+                route_free(&mid);
+                return NULL;
+        }
+
+        child->rt_len -= k;
+        memmove(child->rt_label, child->rt_label + k, child->rt_len + 1);
+        mid->rt_children[0] = child;
+        mid->rt_index[0] = child->rt_label[0];
+        mid->rt_nchildren = 1;
+
+        /* mid starts with the same byte, so rt_index[i] stays */
+        rt->rt_children[i] = mid;
+        return mid;
+}
+
+/* descend from rt along static bytes, adding and splitting nodes */
+static struct route *
+route_static(struct route *rt, const char *p, size_t len)
+{
+        struct route    *child = NULL;
+        const char      *c = NULL;
+        size_t          k;
+
+        while (len > 0) {
+                c = NULL;
+                if (rt->rt_nchildren > 0)
+                        c = memchr(rt->rt_index, *p, rt->rt_nchildren);
+                if (c == NULL) {
+                        child = route_node(p, len);
+                        if (child == NULL)
+                                return NULL;
+                        if (route_link(rt, child) < 0) {
+                                route_free(&child);
+                                return NULL;
+                        }
+                        return child;
+                }
+
+                child = rt->rt_children[c - rt->rt_index];
+                for (k = 1; k < child->rt_len && k < len; ++k) {
+                        if (child->rt_label[k] != p[k])
+                                break;
+                }
+                if (k < child->rt_len) {
+                        child = route_split(rt, c - rt->rt_index, k);
+                        if (child == NULL)
+                                return NULL;
+                }
+
+                rt = child;
+                p += k;
+                len -= k;
+        }
+
+        return rt;
+}
+
+/* get (or add) the ':' or '*' child in slot, named name (NULL if none) */
+static struct route *
+route_capture(struct route **slot, const char *name, size_t len)
+{
+        struct route    *rt = *slot;
+
+        if (rt != NULL) {
+                /* every route through a capture must give it one name */
+                if ((rt->rt_name == NULL) != (name == NULL) ||
+                    (name != NULL && (strlen(rt->rt_name) != len ||
+                                      memcmp(rt->rt_name, name, len) != 0))) {
+                        errno = EINVAL;
+                        return NULL;
+                }
+                return rt;
+        }
+
+        rt = route_node("", 0);
+        if (rt == NULL)
+                return NULL;
+
+        if (name != NULL) {
+                rt->rt_name = strndup(name, len);
+                if (rt->rt_name == NULL) {
+                        route_free(&rt);
+                        return NULL;
+                }
+        }
+
+        *slot = rt;
+        return rt;
+}
+
+/* descend from root along a route, adding the nodes it needs */
+static struct route *
+route_walk(struct route *root, const char *pattern)
+{
+        struct route    *rt = root;
+        const char      *p = pattern;
+        const char      *end = NULL;
+        const char      *q = NULL;
+        const char      *name = NULL;
+        size_t          ncaptures = 0;
+
+        end = p + strlen(p);
+        if (*p != '/') {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        while (p < end) {
+                /* static bytes up to a segment starting with ':' or '*' */
+                for (q = p + 1; q < end; ++q) {
+                        if (q[-1] == '/' && (*q == ':' || *q == '*'))
+                                break;
+                }
+
+                rt = route_static(rt, p, q - p);
+                if (rt == NULL)
+                        return NULL;
+                if (q == end)
+                        break;
+
+                name = q + 1;
+                p = memchr(name, '/', end - name);
+                if (p == NULL)
+                        p = end;
+
+                if (*q == '*') {
+                        /* the rest of the path, so nothing may follow */
+                        if (p != end) {
+                                errno = EINVAL;
+                                return NULL;
+                        }
+                        if (name == end)
+                                name = NULL;
+                } else if (name == p) {
+                        errno = EINVAL;
+                        return NULL;
+                }
+
+                if (name != NULL && ++ncaptures > HTTP_MAX_CAPTURES) {
+                        errno = E2BIG;
+                        return NULL;
+                }
+
+                rt = route_capture(*q == '*' ? &rt->rt_wild : &rt->rt_param,
+                                   name,
+                                   name != NULL ? (size_t)(p - name) : 0);
+                if (rt == NULL)
+                        return NULL;
+        }
+
+        return rt;
+}
+
+int
+route_add(struct route *root,
+          const char *pattern,
+          struct http_handler *handler)
+{
+        struct route    *rt = NULL;
+        size_t          len = strlen(pattern);
+        unsigned        methods;
+        size_t          m;
+
+        if (handler->hh_prefix && (len == 0 || pattern[len - 1] != '/')) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        rt = route_walk(root, pattern);
+        if (rt == NULL)
+                return -1;
+
+        if (handler->hh_prefix) {
+                rt = route_capture(&rt->rt_wild, NULL, 0);
+                if (rt == NULL)
+                        return -1;
+        }
+
+        methods = handler->hh_methods != 0 ? handler->hh_methods : ~0u;
+        for (m = 0; m < HTTP_NMETHODS; ++m) {
+                if ((methods & HTTP_METHOD_BIT(m)) &&
+                    rt->rt_handlers[m] != NULL) {
+                        errno = EEXIST;
+                        return -1;
+                }
+        }
+        for (m = 0; m < HTTP_NMETHODS; ++m) {
+                if (!(methods & HTTP_METHOD_BIT(m)))
+                        continue;
+                rt->rt_handlers[m] = handler;
+                rt->rt_methods |= HTTP_METHOD_BIT(m);
+        }
+
+        return 0;
+}
+
+int
+route_use(struct route *root,
+          const char *prefix,
+          struct http_middleware *mw)
+{
+        struct http_middleware  **uses = NULL;
+        struct route            *rt = NULL;
+
+        rt = route_walk(root, prefix);
+        if (rt == NULL)
+                return -1;
+
+        uses = realloc(rt->rt_uses, (rt->rt_nuses + 1) * sizeof(*uses));
+        if (uses == NULL)
+                return -1;
+        uses[rt->rt_nuses++] = mw;
+        rt->rt_uses = uses;
+        return 0;
+}
+
+/* sizes of the arrays of a route_table */
+struct route_sizes {
+        size_t  rs_nodes;
+        size_t  rs_slots;
+        size_t  rs_stages;
+        size_t  rs_bytes;
+};
+
+/* count what the tree below rt needs, with nuses middleware above it */
+static void
+route_count(const struct route *rt, size_t nuses, struct route_sizes *rs)
+{
+        size_t  i;
+
+        /* a node with middleware gets a copy of the chain above it */
+        if (rt->rt_nuses > 0) {
+                nuses += rt->rt_nuses;
+                rs->rs_stages += nuses;
+        }
+
+        rs->rs_nodes += 1;
+        rs->rs_bytes += rt->rt_len + rt->rt_nchildren;
+        if (rt->rt_name != NULL)
+                rs->rs_bytes += strlen(rt->rt_name) + 1;
+        if (rt->rt_methods != 0)
+                rs->rs_slots += HTTP_NMETHODS;
+
+        for (i = 0; i < rt->rt_nchildren; ++i)
+                route_count(rt->rt_children[i], nuses, rs);
+        if (rt->rt_param != NULL)
+                route_count(rt->rt_param, nuses, rs);
+        if (rt->rt_wild != NULL)
+                route_count(rt->rt_wild, nuses, rs);
+}
+
+/* queue rt as the next node of tab, starting with its parent's chain */
+static void
+route_enqueue(struct route_table *tab,
+              const struct route **order,
+              size_t *tail,
+              const struct route *rt,
+              const struct route_node *parent)
+{
+        struct route_node       *rn = &tab->tb_nodes[*tail];
+
+        rn->rn_stages = parent->rn_stages;
+        rn->rn_nstages = parent->rn_nstages;
+        order[(*tail)++] = rt;
+}
+
+struct route_table *
+route_freeze(const struct route *root)
+{
+        const struct route      **order = NULL;
+        const struct route      *rt = NULL;
+        struct route_table      *tab = NULL;
+        struct route_node       *rn = NULL;
+        struct route_sizes      rs = { 0, 0, 0, 1 };
+        size_t                  tail = 1;
+        size_t                  slot = 0;
+        size_t                  stage = 0;
+        size_t                  off = 1;
+        size_t                  i;
+        size_t                  j;
+
+        route_count(root, 0, &rs);
+        if (rs.rs_nodes > UINT32_MAX || rs.rs_slots > UINT32_MAX ||
+            rs.rs_stages > UINT32_MAX || rs.rs_bytes > UINT32_MAX) {
+                errno = E2BIG;
+                return NULL;
+        }
+
+        /* nodes in the order they go into the table */
+        order = malloc(rs.rs_nodes * sizeof(*order));
+        if (order == NULL)
+                return NULL;
+
+        /* the table, handler slots, stages, nodes and bytes in one block */
+        tab = malloc(sizeof(*tab) +
+                     rs.rs_slots * sizeof(*tab->tb_handlers) +
+                     rs.rs_stages * sizeof(*tab->tb_stages) +
+                     rs.rs_nodes * sizeof(*tab->tb_nodes) + rs.rs_bytes);
+        if (tab == NULL) {
+                free(order);
+                return NULL;
+        }
+        tab->tb_handlers = (struct http_handler **)(tab + 1);
+        tab->tb_stages = (struct http_middleware *)(tab->tb_handlers +
+                                                    rs.rs_slots);
+        tab->tb_nodes = (struct route_node *)(tab->tb_stages +
+                                              rs.rs_stages);
+        tab->tb_bytes = (char *)(tab->tb_nodes + rs.rs_nodes);
+        tab->tb_nnodes = rs.rs_nodes;
+        tab->tb_bytes[0] = '\0';
+
+        /* breadth first, so the static children of a node are adjacent */
+        order[0] = root;
+        tab->tb_nodes[0].rn_stages = 0;
+        tab->tb_nodes[0].rn_nstages = 0;
+        for (i = 0; i < rs.rs_nodes; ++i) {
+                rt = order[i];
+                rn = &tab->tb_nodes[i];
+
+                /* rn_stages is the parent's chain, extend a copy of it */
+                if (rt->rt_nuses > 0) {
+                        memcpy(tab->tb_stages + stage,
+                               tab->tb_stages + rn->rn_stages,
+                               rn->rn_nstages * sizeof(*tab->tb_stages));
+                        rn->rn_stages = stage;
+                        stage += rn->rn_nstages;
+                        for (j = 0; j < rt->rt_nuses; ++j)
+                                tab->tb_stages[stage++] = *rt->rt_uses[j];
+                        rn->rn_nstages += rt->rt_nuses;
+                }
+
+                rn->rn_label = off;
+                rn->rn_len = rt->rt_len;
+                memcpy(tab->tb_bytes + off, rt->rt_label, rt->rt_len);
+                off += rt->rt_len;
+
+                rn->rn_index = off;
+                rn->rn_nchildren = rt->rt_nchildren;
+                rn->rn_children = tail;
+                for (j = 0; j < rt->rt_nchildren; ++j) {
+                        tab->tb_bytes[off++] = rt->rt_index[j];
+                        route_enqueue(tab, order, &tail, rt->rt_children[j],
+                                      rn);
+                }
+
+                rn->rn_param = 0;
+                if (rt->rt_param != NULL) {
+                        rn->rn_param = tail;
+                        route_enqueue(tab, order, &tail, rt->rt_param, rn);
+                }
+                rn->rn_wild = 0;
+                if (rt->rt_wild != NULL) {
+                        rn->rn_wild = tail;
+                        route_enqueue(tab, order, &tail, rt->rt_wild, rn);
+                }
+
+                rn->rn_name = 0;
+                if (rt->rt_name != NULL) {
+                        rn->rn_name = off;
+                        j = strlen(rt->rt_name) + 1;
+                        memcpy(tab->tb_bytes + off, rt->rt_name, j);
+                        off += j;
+                }
+
+                rn->rn_methods = rt->rt_methods;
+                rn->rn_handlers = slot;
+                if (rt->rt_methods != 0) {
+                        memcpy(tab->tb_handlers + slot, rt->rt_handlers,
+                               sizeof(rt->rt_handlers));
+                        slot += HTTP_NMETHODS;
+                }
+        }
+
+        free(order);
+        return tab;
+}
+
+/* record the capture of bytes [p, p + len) of the request by rn */
+static void
+route_record(struct http_request *req,
+             const struct route_table *tab,
+             const struct route_node *rn,
+             const char *p,
+             size_t len)
+{
+        struct http_capture     *cp = NULL;
+
+        if (rn->rn_name == 0)
+                return;
+
+        cp = &req->rq_captures[req->rq_ncaptures++];
+        cp->hc_name = tab->tb_bytes + rn->rn_name;
+        cp->hc_value.hv_off = p - req->rq_buf->ib_inbufp;
+        cp->hc_value.hv_len = len;
+}
+
+/* match path bytes [p, end) below rn (whose own label is matched) */
+static const struct route_node *
+route_find(const struct route_table *tab,
+           const struct route_node *rn,
+           const char *p,
+           const char *end,
+           struct http_request *req)
+{
+        const struct route_node *child = NULL;
+        const struct route_node *found = NULL;
+        const char              *index = NULL;
+        const char              *c = NULL;
+        const char              *seg = NULL;
+        size_t                  ncaptures;
+
+        if (p == end && rn->rn_methods != 0)
+                return rn;
+
+        if (p < end && rn->rn_nchildren > 0) {
+                index = tab->tb_bytes + rn->rn_index;
+                c = memchr(index, *p, rn->rn_nchildren);
+                child = NULL;
+                if (c != NULL)
+                        child = &tab->tb_nodes[rn->rn_children + (c - index)];
+                if (child != NULL && (size_t)(end - p) >= child->rn_len &&
+                    memcmp(p, tab->tb_bytes + child->rn_label,
+                           child->rn_len) == 0) {
+                        found = route_find(tab, child, p + child->rn_len,
+                                           end, req);
+                        if (found != NULL)
+                                return found;
+                }
+        }
+
+        /* a ':' capture takes a whole, non-empty segment */
+        if (p < end && *p != '/' && rn->rn_param != 0) {
+                child = &tab->tb_nodes[rn->rn_param];
+                seg = memchr(p, '/', end - p);
+                if (seg == NULL)
+                        seg = end;
+
+                ncaptures = req->rq_ncaptures;
+                route_record(req, tab, child, p, seg - p);
+                found = route_find(tab, child, seg, end, req);
+                if (found != NULL)
+                        return found;
+                req->rq_ncaptures = ncaptures;
+        }
+
+        if (rn->rn_wild != 0 && tab->tb_nodes[rn->rn_wild].rn_methods != 0) {
+                child = &tab->tb_nodes[rn->rn_wild];
+                route_record(req, tab, child, p, end - p);
+                req->rq_pathinfo.hv_off = p - req->rq_buf->ib_inbufp;
+                req->rq_pathinfo.hv_len = end - p;
+                return child;
+        }
+
+        return NULL;
+}
+
+const struct route_node *
+route_match(const struct route_table *tab, struct http_request *req)
+{
+        const char      *path = http_request_str(req, req->rq_path);
+
+        req->rq_ncaptures = 0;
+        req->rq_pathinfo.hv_off = req->rq_path.hv_off + req->rq_path.hv_len;
+        req->rq_pathinfo.hv_len = 0;
+        return route_find(tab, tab->tb_nodes, path, path + req->rq_path.hv_len,
+                          req);
+}
+
+/* clear every slot of a tree holding p, so what it points to is freed once */
+static void
+route_forget(struct route *rt, const void *p)
+{
+        size_t  i;
+
+        if (rt == NULL)
+                return;
+
+        for (i = 0; i < rt->rt_nchildren; ++i)
+                route_forget(rt->rt_children[i], p);
+        route_forget(rt->rt_param, p);
+        route_forget(rt->rt_wild, p);
+
+        for (i = 0; i < HTTP_NMETHODS; ++i) {
+                if (rt->rt_handlers[i] == p)
+                        rt->rt_handlers[i] = NULL;
+        }
+        for (i = 0; i < rt->rt_nuses; ++i) {
+                if (rt->rt_uses[i] == p)
+                        rt->rt_uses[i] = NULL;
+        }
+}
+
+/*
+ * free the handlers and middleware of the tree below root rt: one may be
+ * added for several methods, routes or prefixes, so each is taken out of
+ * the whole tree before it is freed
+ */
+static void
+route_free_owned(struct route *root, struct route *rt)
+{
+        struct http_handler     *hdlr = NULL;
+        struct http_middleware  *hm = NULL;
+        size_t                  i;
+
+        if (rt == NULL)
+                return;
+
+        for (i = 0; i < rt->rt_nchildren; ++i)
+                route_free_owned(root, rt->rt_children[i]);
+        route_free_owned(root, rt->rt_param);
+        route_free_owned(root, rt->rt_wild);
+
+        for (i = 0; i < HTTP_NMETHODS; ++i) {
+                hdlr = rt->rt_handlers[i];
+                if (hdlr == NULL)
+                        continue;
+                route_forget(root, hdlr);
+                if (hdlr->hh_free != NULL)
+                        hdlr->hh_free(hdlr->hh_arg);
+                free(hdlr);
+        }
+
+        for (i = 0; i < rt->rt_nuses; ++i) {
+                hm = rt->rt_uses[i];
+                if (hm == NULL)
+                        continue;
+                route_forget(root, hm);
+                if (hm->hm_free != NULL)
+                        hm->hm_free(hm->hm_arg);
+                free(hm);
+        }
+}
+
+static void
+route_free_nodes(struct route **rtp)
+{
+        struct route    *rt = *rtp;
+        size_t          i;
+
+        if (rt == NULL)
+                return;
+
+        for (i = 0; i < rt->rt_nchildren; ++i)
+                route_free_nodes(&rt->rt_children[i]);
+        route_free_nodes(&rt->rt_param);
+        route_free_nodes(&rt->rt_wild);
+
+        free(rt->rt_uses);
+        free(rt->rt_children);
+        free(rt->rt_index);
+        free(rt->rt_label);
+        free(rt->rt_name);
+        free(rt);
+        *rtp = NULL;
+}
+
+void
+route_free(struct route **rtp)
+{
+        route_free_owned(*rtp, *rtp);
+        route_free_nodes(rtp);
+}
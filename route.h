@@ -0,0 +1,171 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "http.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * node of a compressed radix tree of routes: static bytes are shared by
+ * every route starting with them, a segment starting with ':' captures
+ * one path segment and a trailing segment starting with '*' captures the
+ * rest of the path (routes are added here, requests are matched against
+ * the struct route_table it is frozen into)
+ */
+struct route {
+        /* static bytes matched by this node (empty for ':' and '*') */
+        char                    *rt_label;
+        /* length of rt_label */
+        size_t                  rt_len;
+        /* capture name of a ':' or '*' node (NULL if anonymous) */
+        char                    *rt_name;
+        /* children matching static bytes, each with its own first byte */
+        struct route            **rt_children;
+        /* first byte of each child's rt_label (searched with memchr()) */
+        char                    *rt_index;
+        /* number of entries in rt_children */
+        size_t                  rt_nchildren;
+        /* child capturing the next segment (tried after rt_children) */
+        struct route            *rt_param;
+        /* child capturing the rest of the path (tried last) */
+        struct route            *rt_wild;
+        /* handler for each method of a route ending here (or NULL) */
+        struct http_handler     *rt_handlers[HTTP_NMETHODS];
+        /* HTTP_METHOD_BIT()s of non-NULL rt_handlers */
+        unsigned                rt_methods;
+        /* middleware for routes through this node, in the order added */
+        struct http_middleware  **rt_uses;
+        /* number of entries in rt_uses */
+        size_t                  rt_nuses;
+};
+
+/* node of a frozen tree (indexes and offsets into its route_table) */
+struct route_node {
+        /* offset of static bytes in tb_bytes */
+        uint32_t        rn_label;
+        /* number of static bytes */
+        uint32_t        rn_len;
+        /* index of the first static child (siblings are adjacent) */
+        uint32_t        rn_children;
+        /* offset of the children's first bytes in tb_bytes */
+        uint32_t        rn_index;
+        /* number of static children */
+        uint16_t        rn_nchildren;
+        /* HTTP_METHOD_BIT()s with a handler */
+        uint16_t        rn_methods;
+        /* index of the ':' and '*' children (0 if none, root is no child) */
+        uint32_t        rn_param;
+        uint32_t        rn_wild;
+        /* offset of the nul terminated capture name (0 if anonymous) */
+        uint32_t        rn_name;
+        /* index of the node's HTTP_NMETHODS handlers in tb_handlers */
+        uint32_t        rn_handlers;
+        /* index of the middleware chain in tb_stages, outermost first */
+        uint32_t        rn_stages;
+        /* number of stages in the chain */
+        uint32_t        rn_nstages;
+};
+
+/*
+ * route tree flattened into a single read-only allocation: nodes in
+ * breadth first order, handler slots of nodes ending a route, middleware
+ * chains, and one byte array of labels, child indexes and capture names
+ */
+struct route_table {
+        /* nodes, root first */
+        struct route_node       *tb_nodes;
+        /* handler slots */
+        struct http_handler     **tb_handlers;
+        /* middleware chains (copies, nodes without their own share) */
+        struct http_middleware  *tb_stages;
+        /* labels, child indexes and capture names (starts with a nul) */
+        char                    *tb_bytes;
+        /* number of entries in tb_nodes */
+        size_t                  tb_nnodes;
+};
+
+/**
+ * Create an empty route tree:
+ *
+ * ret:
+ *      @success:       pointer to root of new tree
+ *      @failure:       NULL and errno set
+ */
+extern struct route *route_new(void);
+
+/**
+ * Add a handler for a route (e.g. "/users/:id/posts/:post"), in the slot
+ * of every method in hh_methods (every slot if zero); a prefix handler
+ * (hh_prefix) is added as if its route ended in an anonymous '*':
+ *
+ * args:
+ *      @root:          pointer to root of tree
+ *      @pattern:       route, starting with '/'
+ *      @handler:       handler to call for matching requests
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL for a malformed route,
+ *                      E2BIG for more than HTTP_MAX_CAPTURES captures,
+ *                      EEXIST if a method already has a handler)
+ */
+extern int route_add(struct route *root,
+                     const char *pattern,
+                     struct http_handler *handler);
+
+/**
+ * Add middleware for every route starting with a prefix (which may have
+ * captures like a route); a route's chain runs the middleware of shorter
+ * prefixes first, then of the same prefix in the order added:
+ *
+ * args:
+ *      @root:          pointer to root of tree
+ *      @prefix:        start of the routes, starting with '/'
+ *      @mw:            middleware to run before their handlers
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (EINVAL for a malformed prefix)
+ */
+extern int route_use(struct route *root,
+                     const char *prefix,
+                     struct http_middleware *mw);
+
+/**
+ * Freeze a route tree into a route_table (the tree keeps owning the
+ * handlers and middleware, free the table with free()):
+ *
+ * args:
+ *      @root:  pointer to root of tree
+ * ret:
+ *      @success:       pointer to new route_table
+ *      @failure:       NULL and errno set
+ */
+extern struct route_table *route_freeze(const struct route *root);
+
+/**
+ * Find the route of a request's path without allocating, trying static
+ * bytes before a ':' segment before a '*' rest at every node and backing
+ * out of dead ends; captures go to rq_captures and a '*' capture also
+ * becomes rq_pathinfo:
+ *
+ * args:
+ *      @tab:   frozen routes
+ *      @req:   request with rq_path parsed
+ * ret:
+ *      @success:       node of the route (handlers in its rn_handlers
+ *                      slots, middleware chain at rn_stages)
+ *      @failure:       NULL (no route matches)
+ */
+extern const struct route_node *route_match(const struct route_table *tab,
+                                            struct http_request *req);
+
+/**
+ * Free a route tree and each of its handlers (with hh_free()) and
+ * middleware (with hm_free()) once, however many routes share them:
+ *
+ * args:
+ *      @rtp:   pointer to pointer to root of tree
+ */
+extern void route_free(struct route **rtp);
+
+#endif
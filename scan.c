@@ -0,0 +1,223 @@
+#include "scan.h"
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef size_t scan_fn(const char *buf, size_t len, enum scan_class cls);
+
+static scan_fn scan_resolve;
+static scan_fn scan_scalar;
+
+/* implementation picked by scan_resolve() on first use */
+static _Atomic(scan_fn *) scan_impl = scan_resolve;
+
+size_t
+scan_stop(const char *buf, size_t len, enum scan_class cls)
+{
+        scan_fn *fn = atomic_load_explicit(&scan_impl, memory_order_relaxed);
+
+        return fn(buf, len, cls);
+}
+
+/*
+ * bit 1 << class set for each byte ending a run of that class: anything
+ * but an RFC 9110 tchar for SCAN_TOKEN (so none of "(),/:;<=>?@[\]{}
+ * either), control bytes, space and DEL for SCAN_TARGET, and control
+ * bytes other than tab, and DEL, for SCAN_VALUE
+ */
+static const unsigned char      scan_stops[256] = {
+        /* 0x00 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 3, 7, 7, 7, 7, 7, 7,
+        /* 0x10 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        /* 0x20 */ 3, 0, 1, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0, 1,
+        /* 0x30 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+        /* 0x40 */ 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 0x50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0,
+        /* 0x60 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 0x70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 7,
+        /* 0x80 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0x90 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xa0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xb0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xc0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xd0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xe0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xf0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+static int
+scan_is_stop(unsigned char c, enum scan_class cls)
+{
+        return scan_stops[c] >> cls & 1;
+}
+
+static size_t
+scan_scalar(const char *buf, size_t len, enum scan_class cls)
+{
+        size_t  i;
+
+        for (i = 0; i < len; ++i) {
+                if (scan_is_stop(buf[i], cls))
+                        break;
+        }
+
+        return i;
+}
+
+#ifdef SCAN_X86
+/*
+ * pcmpestri byte ranges matching scan_stops[]: a compare takes at most 8
+ * ranges, the two left of SCAN_TOKEN ('{' and '}') take a second one
+ */
+static const char       scan_ranges[][16] = {
+        [SCAN_TOKEN] = "\x00\x20\x22\x22\x28\x29\x2c\x2c"
+                       "\x2f\x2f\x3a\x40\x5b\x5d\x7f\xff",
+        [SCAN_TARGET] = "\x00\x20\x7f\x7f",
+        [SCAN_VALUE] = "\x00\x08\x0a\x1f\x7f\x7f",
+};
+
+/* number of bytes used in each scan_ranges entry */
+static const int        scan_nranges[] = {
+        [SCAN_TOKEN] = 16,
+        [SCAN_TARGET] = 4,
+        [SCAN_VALUE] = 6,
+};
+
+/* ranges of a second compare (none if its length is zero) */
+static const char       scan_ranges2[][16] = {
+        [SCAN_TOKEN] = "\x7b\x7b\x7d\x7d",
+};
+
+static const int        scan_nranges2[] = {
+        [SCAN_TOKEN] = 4,
+        [SCAN_TARGET] = 0,
+        [SCAN_VALUE] = 0,
+};
+
+/*
+ * tchar by nibbles for vpshufb: bit hi of scan_tchar_lo[lo] is set if
+ * byte hi << 4 | lo is a tchar, scan_tchar_hi[hi] is that bit (none for
+ * bytes over 0x7f), so a byte is a tchar if the two have a bit in common
+ */
+static const unsigned char      scan_tchar_lo[16] = {
+        0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc,
+        0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+};
+
+static const unsigned char      scan_tchar_hi[16] = {
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+__attribute__((target("sse4.2")))
+static size_t
+scan_sse42(const char *buf, size_t len, enum scan_class cls)
+{
+        __m128i ranges;
+        __m128i ranges2;
+        __m128i b;
+        size_t  i;
+        int     n;
+        int     n2;
+        int     idx;
+        int     idx2;
+
+        ranges = _mm_loadu_si128((const __m128i *)scan_ranges[cls]);
+        ranges2 = _mm_loadu_si128((const __m128i *)scan_ranges2[cls]);
+        n = scan_nranges[cls];
+        n2 = scan_nranges2[cls];
+        for (i = 0; i + 16 <= len; i += 16) {
+                b = _mm_loadu_si128((const __m128i *)(buf + i));
+                idx = _mm_cmpestri(ranges, n, b, 16, _SIDD_UBYTE_OPS |
+                                   _SIDD_CMP_RANGES |
+                                   _SIDD_LEAST_SIGNIFICANT);
+                if (n2 > 0) {
+                        idx2 = _mm_cmpestri(ranges2, n2, b, 16,
+                                            _SIDD_UBYTE_OPS |
+                                            _SIDD_CMP_RANGES |
+                                            _SIDD_LEAST_SIGNIFICANT);
+                        if (idx2 < idx)
+                                idx = idx2;
+                }
+                if (idx < 16)
+                        return i + idx;
+        }
+
+        return i + scan_scalar(buf + i, len - i, cls);
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const char *buf, size_t len, enum scan_class cls)
+{
+        const __m256i   zero = _mm256_setzero_si256();
+        const __m256i   ones = _mm256_set1_epi8(-1);
+        const __m256i   space = _mm256_set1_epi8(' ');
+        const __m256i   tab = _mm256_set1_epi8('\t');
+        const __m256i   del = _mm256_set1_epi8(0x7f);
+        const __m256i   nibble = _mm256_set1_epi8(0x0f);
+        __m256i         tchar_lo;
+        __m256i         tchar_hi;
+        __m256i         lo;
+        __m256i         hi;
+        __m256i         b;
+        __m256i         stop;
+        size_t          i;
+        unsigned        mask;
+
+        /* vpshufb looks up within each 128 bit lane, so both get a copy */
+        tchar_lo = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)scan_tchar_lo));
+        tchar_hi = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)scan_tchar_hi));
+
+        for (i = 0; i + 32 <= len; i += 32) {
+                b = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+                if (cls == SCAN_TOKEN) {
+                        lo = _mm256_and_si256(b, nibble);
+                        hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble);
+                        stop = _mm256_and_si256(
+                                _mm256_shuffle_epi8(tchar_lo, lo),
+                                _mm256_shuffle_epi8(tchar_hi, hi));
+                        stop = _mm256_cmpeq_epi8(stop, zero);
+                } else {
+                        /* signed compares: 0x00-0x1f is 0 <= b < ' ' */
+                        stop = _mm256_and_si256(_mm256_cmpgt_epi8(space, b),
+                                                _mm256_cmpgt_epi8(b, ones));
+                        stop = _mm256_or_si256(stop,
+                                               _mm256_cmpeq_epi8(b, del));
+                        if (cls == SCAN_TARGET)
+                                stop = _mm256_or_si256(stop,
+                                        _mm256_cmpeq_epi8(b, space));
+                        else
+                                stop = _mm256_andnot_si256(
+                                        _mm256_cmpeq_epi8(b, tab), stop);
+                }
+
+                mask = (unsigned)_mm256_movemask_epi8(stop);
+                if (mask != 0)
+                        return i + __builtin_ctz(mask);
+        }
+
+        return i + scan_scalar(buf + i, len - i, cls);
+}
+#endif
+
+static size_t
+scan_resolve(const char *buf, size_t len, enum scan_class cls)
+{
+        scan_fn *fn = scan_scalar;
+
+#ifdef SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                fn = scan_avx2;
+        else if (__builtin_cpu_supports("sse4.2"))
+                fn = scan_sse42;
+#endif
+        atomic_store_explicit(&scan_impl, fn, memory_order_relaxed);
+        return fn(buf, len, cls);
+}
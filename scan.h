@@ -0,0 +1,30 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdlib.h>
+
+/* which bytes end a run in scan_stop() */
+enum scan_class {
+        /* all but RFC 9110 tchar (method, header names) */
+        SCAN_TOKEN,
+        /* control bytes, space and DEL (request target, version) */
+        SCAN_TARGET,
+        /* control bytes other than tab and DEL (header values) */
+        SCAN_VALUE,
+};
+
+/**
+ * Find the first byte of a class in a buffer, 16 or 32 bytes at a time
+ * when the cpu has SSE4.2 or AVX2 (checked once with cpuid); every
+ * implementation gives the same answer:
+ *
+ * args:
+ *      @buf:   bytes to scan
+ *      @len:   number of bytes in buf
+ *      @cls:   class of bytes to stop at
+ * ret:
+ *      offset of first byte in class (len if there is none)
+ */
+extern size_t scan_stop(const char *buf, size_t len, enum scan_class cls);
+
+#endif
@@ -1,4 +1,6 @@
 #include "../http.h"
+#include "../file.h"
+#include "../shm.h"
 #include <err.h>
 #include <errno.h>
 #include <netdb.h>
@@ -7,12 +9,16 @@
 #include <unistd.h>
 #include <string.h>
 
-static void rootfn(struct http_request *req, struct http_response *res);
 static void loginfn(struct http_request *req, struct http_response *res);
-static void html(struct http_request *req, struct http_response *res);
+static void upload(struct http_request *req, struct http_response *res);
+static void hello(struct http_request *req, struct http_response *res);
+static void kv(struct http_request *req, struct http_response *res);
+static void kvfree(void *arg);
+static int auth(struct http_request *req, struct http_response *res,
+                void *arg);
 
 int
-main(void)
+main(int argc, char **argv)
 {
         struct http_server *server;
         struct addrinfo info;
@@ -21,18 +27,55 @@ main(void)
         char service[] = "8080";
         char host[] = "localhost";
         void (*funcs[])(struct http_request *, struct http_response *) = {
-                rootfn,
                 loginfn,
-                html,
+                upload,
+                hello,
+                hello,
+                hello,
         };
         char *funcnames[] = {
-                "/",
                 "/login",
-                "/html",
+                "/upload",
+                "/hello",
+                "/hello/:name",
+                "/private/hello/:name",
                 NULL
         };
+        enum http_server_mode mode = HTTP_SERVER_FORK;
+        int noring = 0;
+        char *dir = NULL;
+        long nworkers = 0;
         size_t i;
         int ret;
+        int c;
+
+        while ((c = getopt(argc, argv, "Eeps:tw:")) != -1) {
+                switch (c) {
+                case 'E':
+                        noring = 1;
+                        break;
+                case 'e':
+                        mode = HTTP_SERVER_EPOLL;
+                        break;
+                case 'p':
+                        mode = HTTP_SERVER_PREFORK;
+                        break;
+                case 's':
+                        dir = optarg;
+                        break;
+                case 't':
+                        mode = HTTP_SERVER_THREADS;
+                        break;
+                case 'w':
+                        nworkers = strtol(optarg, NULL, 10);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-E] [-e | -p | -t] [-s dir] "
+                                "[-w workers]\n",
+                                argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
 
         memset(&info, 0, sizeof(info));
         info.ai_family = AF_INET;
@@ -55,15 +98,98 @@ main(void)
 
         for (i = 0; funcnames[i]; ++i) {
                 struct http_handler *hdlr;
+                char *resource;
 
-                hdlr = malloc(sizeof(*hdlr));
+                hdlr = calloc(1, sizeof(*hdlr));
                 if (!hdlr)
-                        err(EX_SOFTWARE, "malloc()");
+                        err(EX_SOFTWARE, "calloc()");
+
+                /* server owns (and frees) both resource and handler */
+                resource = strdup(funcnames[i]);
+                if (!resource)
+                        err(EX_SOFTWARE, "strdup()");
 
                 hdlr->hh_fn = funcs[i];
-                http_server_add_handler(server, funcnames[i], hdlr);
+                /* greetings change rarely, answer them from the cache */
+                if (funcs[i] == hello)
+                        hdlr->hh_cache_ttl = 1000;
+                http_server_add_handler(server, resource, hdlr);
+        }
+
+        /* same bytes every time, serialized once */
+        if (http_server_add_static_response(server, "/", 200,
+                                            "Content-Type: text/plain\r\n",
+                                            "hi:)\n") < 0 ||
+            http_server_add_static_response(server, "/html", 200,
+                                            "Content-Type: text/html\r\n",
+                                            "<h1>Hello, World!</h1>") < 0)
+                err(EX_SOFTWARE, "http_server_add_static_response()");
+
+        /* everything under /private/ needs "Authorization: Bearer demo" */
+        {
+                struct http_middleware *mw;
+
+                mw = calloc(1, sizeof(*mw));
+                if (!mw)
+                        err(EX_SOFTWARE, "calloc()");
+
+                mw->hm_fn = auth;
+                mw->hm_arg = "Bearer demo";
+                if (http_server_use(server, "/private/", mw) < 0)
+                        err(EX_SOFTWARE, "http_server_use()");
+        }
+
+        /* values under /kv/ outlive the (forked) process storing them */
+        {
+                struct http_handler *hdlr;
+                char *resource;
+
+                hdlr = calloc(1, sizeof(*hdlr));
+                if (!hdlr)
+                        err(EX_SOFTWARE, "calloc()");
+
+                hdlr->hh_arg = shm_cache_new(1024, 4096);
+                if (!hdlr->hh_arg)
+                        err(EX_SOFTWARE, "shm_cache_new()");
+
+                resource = strdup("/kv/:key");
+                if (!resource)
+                        err(EX_SOFTWARE, "strdup()");
+
+                hdlr->hh_fn = kv;
+                hdlr->hh_free = kvfree;
+                hdlr->hh_methods = HTTP_METHOD_BIT(HTTP_METHOD_GET) |
+                                   HTTP_METHOD_BIT(HTTP_METHOD_HEAD) |
+                                   HTTP_METHOD_BIT(HTTP_METHOD_PUT) |
+                                   HTTP_METHOD_BIT(HTTP_METHOD_DELETE);
+                http_server_add_handler(server, resource, hdlr);
+        }
+
+        /* files under dir are served as /static/... */
+        if (dir) {
+                struct http_handler *hdlr;
+                char *resource;
+
+                hdlr = file_handler_new(dir);
+                if (!hdlr)
+                        err(EX_SOFTWARE, "file_handler_new(%s)", dir);
+
+                resource = strdup("/static/");
+                if (!resource)
+                        err(EX_SOFTWARE, "strdup()");
+
+                http_server_add_handler(server, resource, hdlr);
         }
 
+        if (http_server_set_mode(server, mode) < 0)
+                err(EX_SOFTWARE, "http_server_set_mode()");
+
+        if (http_server_set_workers(server, nworkers) < 0)
+                err(EX_SOFTWARE, "http_server_set_workers()");
+
+        if (noring && http_server_set_backend(server, HTTP_BACKEND_EPOLL) < 0)
+                err(EX_SOFTWARE, "http_server_set_backend()");
+
         if (http_server_listen(server, 10) < 0)
                 err(EX_SOFTWARE, "http_server_listen()");
 
@@ -72,47 +198,159 @@ main(void)
 }
 
 static void
-rootfn(struct http_request *req, struct http_response *res)
+loginfn(struct http_request *req, struct http_response *res)
+{
+        http_response_header(res, "Content-Type", "text/plain");
+        http_response_send(res, "login\n", 6);
+}
+
+static void
+upload(struct http_request *req, struct http_response *res)
 {
-        char *p;
+        char buf[4096];
+        unsigned long sum = 0;
+        size_t total = 0;
+        ssize_t n;
+        ssize_t i;
 
-        char buf[] = "HTTP/1.1 200 OK\r\n"
-                     "Content-Length: 5\r\n"
-                     "Content-Type: text/plain\r\n"
-                     "\r\nhi:)\n";
+        /* the body is streamed through buf, never held whole */
+        while ((n = http_request_read_body(req, buf, sizeof(buf))) > 0) {
+                for (i = 0; i < n; ++i)
+                        sum = sum * 31 + (unsigned char)buf[i];
+                total += n;
+        }
 
-        for (p = buf; *p; ++p)
-                iobuf_putc(req->rq_buf, *p);
+        if (n < 0) {
+                http_response_status(res, errno == EMSGSIZE ? 413 : 400);
+                http_response_header(res, "Connection", "close");
+                http_response_send(res, NULL, 0);
+                return;
+        }
 
-        iobuf_flush_out(req->rq_buf);
+        n = snprintf(buf, sizeof(buf), "%zu %lu\n", total, sum);
+        http_response_header(res, "Content-Type", "text/plain");
+        http_response_send(res, buf, n);
 }
 
 static void
-loginfn(struct http_request *req, struct http_response *res)
+hello(struct http_request *req, struct http_response *res)
+{
+        const struct http_view *cap;
+        char buf[256];
+        char *name;
+        int len;
+        int n;
+
+        /* "/hello/:name" captures it, "/hello?name=" queries it */
+        cap = http_request_capture(req, "name");
+        if (cap) {
+                name = http_request_str(req, *cap);
+                len = cap->hv_len;
+        } else {
+                name = http_request_query(req, "name");
+                if (!name || !*name)
+                        name = "world";
+                len = strlen(name);
+        }
+
+        n = snprintf(buf, sizeof(buf), "hello, %.*s\n", len, name);
+        if (n >= (int)sizeof(buf)) {
+                buf[sizeof(buf) - 2] = '\n';
+                n = sizeof(buf) - 1;
+        }
+        http_response_header(res, "Content-Type", "text/plain");
+        http_response_send(res, buf, n);
+}
+
+static void
+kv(struct http_request *req, struct http_response *res)
 {
-        char *p;
-        char buf[] = "HTTP/1.1 200 OK\r\n"
-                     "Content-Length: 6\r\n"
-                     "Content-Type: text/plain\r\n"
-                     "\r\nlogin\n";
+        struct shm_cache *sc = req->rq_handler->hh_arg;
+        const struct http_view *cap;
+        char key[256];
+        char buf[4096];
+        size_t len = 0;
+        ssize_t n = 0;
+        int status;
+        char c;
+
+        cap = http_request_capture(req, "key");
+        /* a longer key would be cut short into another one */
+        if (cap->hv_len >= sizeof(key)) {
+                http_response_status(res, 414);
+                http_response_header(res, "Connection", "close");
+                http_response_send(res, NULL, 0);
+                return;
+        }
+        snprintf(key, sizeof(key), "%.*s", (int)cap->hv_len,
+                 http_request_str(req, *cap));
 
-        for (p = buf; *p; ++p)
-                iobuf_putc(req->rq_buf, *p);
+        switch (req->rq_methodid) {
+        case HTTP_METHOD_PUT:
+                while (len < sizeof(buf) &&
+                       (n = http_request_read_body(req, buf + len,
+                                                   sizeof(buf) - len)) > 0)
+                        len += n;
+                /* a full buffer is too small if any body is left */
+                if (len == sizeof(buf))
+                        n = http_request_read_body(req, &c, 1);
+                if (n == 0 && shm_cache_set(sc, key, buf, len, 0) == 0) {
+                        http_response_status(res, 204);
+                        http_response_send(res, NULL, 0);
+                        break;
+                }
 
-        iobuf_flush_out(req->rq_buf);
+                if (n < 0)
+                        status = errno == EMSGSIZE ? 413 : 400;
+                else if (n > 0 || errno == E2BIG)
+                        status = 413;
+                else
+                        status = 503;
+                /* drained, so the 413 is not lost to a reset */
+                while (n > 0)
+                        n = http_request_read_body(req, buf, sizeof(buf));
+                http_response_status(res, status);
+                http_response_header(res, "Connection", "close");
+                http_response_send(res, NULL, 0);
+                break;
+        case HTTP_METHOD_DELETE:
+                http_response_status(res, shm_cache_del(sc, key) < 0 ? 404 :
+                                                                       204);
+                http_response_send(res, NULL, 0);
+                break;
+        default:
+                n = shm_cache_get(sc, key, buf, sizeof(buf));
+                if (n < 0) {
+                        http_response_status(res, 404);
+                        http_response_send(res, NULL, 0);
+                        break;
+                }
+                http_response_header(res, "Content-Type",
+                                     "application/octet-stream");
+                http_response_send(res, buf, n);
+                break;
+        }
 }
 
 static void
-html(struct http_request *req, struct http_response *res)
+kvfree(void *arg)
+{
+        struct shm_cache *sc = arg;
+
+        shm_cache_free(&sc);
+}
+
+static int
+auth(struct http_request *req, struct http_response *res, void *arg)
 {
-        char *p;
-        char buf[] = "HTTP/1.1 200 OK\r\n"
-                     "Content-Length: 22\r\n"
-                     "Content-Type: text/html\r\n"
-                     "\r\n<h1>Hello, World!</h1>";
+        char *token;
 
-        for (p = buf; *p; ++p)
-                iobuf_putc(req->rq_buf, *p);
+        token = http_request_known(req, HTTP_HDR_AUTHORIZATION);
+        if (token && strcmp(token, arg) == 0)
+                return 0;
 
-        iobuf_flush_out(req->rq_buf);
+        http_response_status(res, 401);
+        http_response_header(res, "WWW-Authenticate", "Bearer");
+        http_response_send(res, NULL, 0);
+        return -1;
 }
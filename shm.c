@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "shm.h"
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* slots a key may live in, starting with the one it hashes to */
+#define SHM_PROBE       8
+/* slots are cache line aligned, so seqlocks do not share lines */
+#define SHM_ALIGN       64
+/* attempts at a busy slot before giving up on it */
+#define SHM_SPINS       64
+
+/* entry of a struct shm_cache, followed by its key and value bytes */
+struct shm_slot {
+        /*
+         * low half even while stable, odd while a writer changes the
+         * slot; high half the writer's pid while odd (zero otherwise)
+         */
+        _Atomic uint64_t        ss_seq;
+        /* length of the key at ss_data */
+        uint32_t                ss_keylen;
+        /* length of the value after the key */
+        uint32_t                ss_vallen;
+        /* hash of the key */
+        uint64_t                ss_hash;
+        /* sc_stamp of the write (zero for a free slot) */
+        uint64_t                ss_stamp;
+        /* ms (CLOCK_MONOTONIC_COARSE) the entry expires at (zero never) */
+        uint64_t                ss_expires;
+        /* key, then value */
+        char                    ss_data[];
+};
+
+/* what a lock-free read of a slot saw */
+struct shm_seen {
+        /* set if the slot holds the key looked for */
+        int             se_match;
+        /* set if the slot is free (or expired) */
+        int             se_free;
+        /* ss_stamp */
+        uint64_t        se_stamp;
+        /* ss_vallen */
+        size_t          se_vallen;
+};
+
+static size_t
+shm_round(size_t n)
+{
+        return (n + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+}
+
+struct shm_cache *
+shm_cache_new(size_t nslots, size_t size)
+{
+        struct shm_cache        *sc = NULL;
+        size_t                  stride;
+        size_t                  hdrlen;
+        size_t                  maplen;
+
+        if (nslots == 0 || size == 0 || size > UINT32_MAX) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        stride = shm_round(sizeof(struct shm_slot) + size);
+        hdrlen = shm_round(sizeof(*sc));
+        if (nslots > (SIZE_MAX - hdrlen) / stride) {
+                errno = ENOMEM;
+                return NULL;
+        }
+        maplen = hdrlen + nslots * stride;
+
+        /* zero filled, so every slot starts out free */
+        sc = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (sc == MAP_FAILED)
+                return NULL;
+
+        sc->sc_nslots = nslots;
+        sc->sc_size = size;
+        sc->sc_stride = stride;
+        sc->sc_maplen = maplen;
+        atomic_init(&sc->sc_stamp, 0);
+        sc->sc_slots = (char *)sc + hdrlen;
+        return sc;
+}
+
+void
+shm_cache_free(struct shm_cache **scp)
+{
+        struct shm_cache        *sc = *scp;
+
+        if (sc == NULL)
+                return;
+
+        (void)munmap(sc, sc->sc_maplen);
+        *scp = NULL;
+}
+
+static struct shm_slot *
+shm_slot(const struct shm_cache *sc, uint64_t hash, size_t i)
+{
+        return (struct shm_slot *)(sc->sc_slots +
+                                   (hash + i) % sc->sc_nslots * sc->sc_stride);
+}
+
+/* 64 bit FNV-1a */
+static uint64_t
+shm_hash(const char *key, size_t len)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL;
+        size_t          i;
+
+        for (i = 0; i < len; ++i) {
+                h ^= (unsigned char)key[i];
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+/* the coarse clock is read without entering the kernel */
+static uint64_t
+shm_now(void)
+{
+        struct timespec ts;
+
+        (void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * read a slot without locking it: whether it holds key (whose value is
+ * then copied to buf) or is free; a read overlapping a write is retried,
+ * so lengths are clamped before use as they may be torn meanwhile
+ */
+static int shm_slot_steal(struct shm_slot *ss, uint64_t *seqp);
+static void shm_slot_unlock(struct shm_slot *ss, uint64_t seq);
+
+static int
+shm_slot_read(const struct shm_cache *sc,
+              struct shm_slot *ss,
+              uint64_t hash,
+              const char *key,
+              size_t keylen,
+              void *buf,
+              size_t size,
+              uint64_t now,
+              struct shm_seen *se)
+{
+        uint64_t        seq;
+        size_t          vallen;
+        size_t          n;
+        int             i;
+
+        for (i = 0; i < SHM_SPINS; ++i) {
+                seq = atomic_load_explicit(&ss->ss_seq, memory_order_acquire);
+                if (seq & 1) {
+                        sched_yield();
+                        continue;
+                }
+
+                se->se_stamp = ss->ss_stamp;
+                se->se_free = se->se_stamp == 0 ||
+                              (ss->ss_expires != 0 && ss->ss_expires <= now);
+                se->se_match = !se->se_free && ss->ss_hash == hash &&
+                               ss->ss_keylen == keylen &&
+                               memcmp(ss->ss_data, key, keylen) == 0;
+                vallen = ss->ss_vallen;
+                if (vallen > sc->sc_size - keylen)
+                        vallen = sc->sc_size - keylen;
+                se->se_vallen = vallen;
+                if (se->se_match && buf != NULL) {
+                        n = vallen < size ? vallen : size;
+                        memcpy(buf, ss->ss_data + keylen, n);
+                }
+
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&ss->ss_seq,
+                                         memory_order_relaxed) == seq)
+                        return 0;
+        }
+
+        /* not busy but abandoned: freed, so no one spins on it again */
+        if (shm_slot_steal(ss, &seq) == 0) {
+                shm_slot_unlock(ss, seq);
+                se->se_match = 0;
+                se->se_free = 1;
+                se->se_stamp = 0;
+                se->se_vallen = 0;
+                return 0;
+        }
+
+        errno = EAGAIN;
+        return -1;
+}
+
+/* odd seq of a slot locked by this process (its pid in the high half) */
+static uint64_t
+shm_seq_locked(uint64_t seq)
+{
+        return (uint64_t)getpid() << 32 | (uint32_t)seq;
+}
+
+/*
+ * take over a slot a writer died holding (left odd with a pid that is
+ * gone), dropping whatever it was writing; a pid in use again by then
+ * keeps the slot busy
+ */
+static int
+shm_slot_steal(struct shm_slot *ss, uint64_t *seqp)
+{
+        uint64_t        seq;
+        pid_t           pid;
+
+        seq = atomic_load_explicit(&ss->ss_seq, memory_order_relaxed);
+        pid = seq >> 32;
+        if (!(seq & 1) || pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+                return -1;
+
+        /* still odd, but other stale checks see it changed */
+        if (!atomic_compare_exchange_strong(&ss->ss_seq, &seq,
+                                            shm_seq_locked(seq + 2)))
+                return -1;
+        atomic_thread_fence(memory_order_release);
+
+        ss->ss_stamp = 0;
+        *seqp = (uint32_t)(seq + 2);
+        return 0;
+}
+
+/* take a slot from other writers (readers retry meanwhile) */
+static int
+shm_slot_lock(struct shm_slot *ss, uint64_t *seqp)
+{
+        uint64_t        seq;
+        int             i;
+
+        for (i = 0; i < SHM_SPINS; ++i) {
+                seq = atomic_load_explicit(&ss->ss_seq, memory_order_relaxed);
+                if (!(seq & 1) &&
+                    atomic_compare_exchange_weak(&ss->ss_seq, &seq,
+                                                 shm_seq_locked(seq + 1))) {
+                        /* the slot's stores must not pass the odd seq */
+                        atomic_thread_fence(memory_order_release);
+                        *seqp = (uint32_t)(seq + 1);
+                        return 0;
+                }
+                sched_yield();
+        }
+
+        if (shm_slot_steal(ss, seqp) == 0)
+                return 0;
+
+        errno = EAGAIN;
+        return -1;
+}
+
+/* seq is the low half of the locked word, the next even one clears pid */
+static void
+shm_slot_unlock(struct shm_slot *ss, uint64_t seq)
+{
+        atomic_store_explicit(&ss->ss_seq, (uint32_t)(seq + 1),
+                              memory_order_release);
+}
+
+ssize_t
+shm_cache_get(struct shm_cache *sc, const char *key, void *buf, size_t size)
+{
+        struct shm_seen se;
+        uint64_t        hash;
+        uint64_t        best = 0;
+        uint64_t        now = shm_now();
+        size_t          keylen = strlen(key);
+        size_t          vallen = 0;
+        size_t          i;
+
+        if (keylen > sc->sc_size) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        /* racing writers may leave a key twice, the newest write wins */
+        hash = shm_hash(key, keylen);
+        for (i = 0; i < SHM_PROBE && i < sc->sc_nslots; ++i) {
+                if (shm_slot_read(sc, shm_slot(sc, hash, i), hash, key,
+                                  keylen, NULL, 0, now, &se) < 0 ||
+                    !se.se_match || se.se_stamp <= best)
+                        continue;
+
+                /* copied only now, for the newest match so far */
+                if (shm_slot_read(sc, shm_slot(sc, hash, i), hash, key,
+                                  keylen, buf, size, now, &se) < 0 ||
+                    !se.se_match)
+                        continue;
+                best = se.se_stamp;
+                vallen = se.se_vallen;
+        }
+
+        if (best == 0) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        return vallen;
+}
+
+int
+shm_cache_set(struct shm_cache *sc,
+              const char *key,
+              const void *val,
+              size_t len,
+              long ttl)
+{
+        struct shm_slot *ss = NULL;
+        struct shm_slot *victim = NULL;
+        struct shm_seen se;
+        uint64_t        hash;
+        uint64_t        oldest = UINT64_MAX;
+        uint64_t        now = shm_now();
+        size_t          keylen = strlen(key);
+        uint64_t        seq;
+        size_t          i;
+
+        if (keylen > sc->sc_size || len > sc->sc_size - keylen) {
+                errno = E2BIG;
+                return -1;
+        }
+
+        /* the key's own slot, else the first free one, else the oldest */
+        hash = shm_hash(key, keylen);
+        for (i = 0; i < SHM_PROBE && i < sc->sc_nslots; ++i) {
+                ss = shm_slot(sc, hash, i);
+                if (shm_slot_read(sc, ss, hash, key, keylen, NULL, 0, now,
+                                  &se) < 0)
+                        continue;
+                if (se.se_match) {
+                        victim = ss;
+                        break;
+                }
+                if (se.se_free && oldest != 0) {
+                        victim = ss;
+                        oldest = 0;
+                } else if (se.se_stamp < oldest) {
+                        victim = ss;
+                        oldest = se.se_stamp;
+                }
+        }
+
+        if (victim == NULL) {
+                errno = EAGAIN;
+                return -1;
+        }
+
+        /* whatever took the slot meanwhile is evicted */
+        if (shm_slot_lock(victim, &seq) < 0)
+                return -1;
+        victim->ss_keylen = keylen;
+        victim->ss_vallen = len;
+        victim->ss_hash = hash;
+        victim->ss_expires = ttl > 0 ? now + ttl : 0;
+        memcpy(victim->ss_data, key, keylen);
+        memcpy(victim->ss_data + keylen, val, len);
+        victim->ss_stamp = atomic_fetch_add(&sc->sc_stamp, 1) + 1;
+        shm_slot_unlock(victim, seq);
+        return 0;
+}
+
+int
+shm_cache_del(struct shm_cache *sc, const char *key)
+{
+        struct shm_slot *ss = NULL;
+        struct shm_seen se;
+        uint64_t        hash;
+        uint64_t        now = shm_now();
+        size_t          keylen = strlen(key);
+        uint64_t        seq;
+        size_t          i;
+        int             found = 0;
+
+        if (keylen > sc->sc_size) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        /* every copy racing writers left */
+        hash = shm_hash(key, keylen);
+        for (i = 0; i < SHM_PROBE && i < sc->sc_nslots; ++i) {
+                ss = shm_slot(sc, hash, i);
+                if (shm_slot_read(sc, ss, hash, key, keylen, NULL, 0, now,
+                                  &se) < 0 || !se.se_match)
+                        continue;
+
+                if (shm_slot_lock(ss, &seq) < 0)
+                        return -1;
+                /* checked again, another writer may have reused it */
+                if (ss->ss_hash == hash && ss->ss_keylen == keylen &&
+                    memcmp(ss->ss_data, key, keylen) == 0) {
+                        ss->ss_stamp = 0;
+                        found = 1;
+                }
+                shm_slot_unlock(ss, seq);
+        }
+
+        if (!found) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        return 0;
+}
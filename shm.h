@@ -0,0 +1,110 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/*
+ * fixed-capacity key/value store in one shared anonymous mapping: created
+ * before the server forks or starts threads, every worker (and every
+ * per-connection child) sees the same slots; a key lives in one of the
+ * SHM_PROBE slots after the one it hashes to, each slot guarded by a
+ * seqlock so readers never block and writers never wait for readers; a
+ * slot a writer died in the middle of (e.g. a killed child) is freed by
+ * the next reader or writer giving up on it, once no process has the
+ * writer's pid
+ */
+struct shm_cache {
+        /* number of slots */
+        size_t                  sc_nslots;
+        /* bytes of key and value a slot holds */
+        size_t                  sc_size;
+        /* bytes between slots (a multiple of the cache line) */
+        size_t                  sc_stride;
+        /* length of the mapping, this header included */
+        size_t                  sc_maplen;
+        /* last write stamp given out (newer entries win, older are evicted) */
+        _Atomic uint64_t        sc_stamp;
+        /* first slot */
+        char                    *sc_slots;
+};
+
+/**
+ * Create a shared key/value store (before workers are started, so they
+ * all inherit the mapping):
+ *
+ * args:
+ *      @nslots:        number of entries the store holds
+ *      @size:          largest key (without its nul) plus value in bytes
+ * ret:
+ *      @success:       pointer to new store
+ *      @failure:       NULL and errno set
+ */
+extern struct shm_cache *shm_cache_new(size_t nslots, size_t size);
+
+/**
+ * Look up a key without taking any lock:
+ *
+ * args:
+ *      @sc:    pointer to store
+ *      @key:   nul terminated key
+ *      @buf:   where the value is copied to
+ *      @size:  size of buf (longer values are cut short)
+ * ret:
+ *      @success:       length of the value (which may exceed size)
+ *      @failure:       -1 and errno set (ENOENT if the key is missing or
+ *                      expired)
+ */
+extern ssize_t shm_cache_get(struct shm_cache *sc,
+                             const char *key,
+                             void *buf,
+                             size_t size);
+
+/**
+ * Store a value for a key, replacing the key's old value, or else taking
+ * a free or expired slot, or else evicting the oldest write among the
+ * slots the key may live in:
+ *
+ * args:
+ *      @sc:    pointer to store
+ *      @key:   nul terminated key
+ *      @val:   value
+ *      @len:   length of value
+ *      @ttl:   ms the value is kept (zero for as long as it is not evicted)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (E2BIG if key and value exceed the
+ *                      size of a slot, EAGAIN if another writer held the
+ *                      slot too long)
+ */
+extern int shm_cache_set(struct shm_cache *sc,
+                         const char *key,
+                         const void *val,
+                         size_t len,
+                         long ttl);
+
+/**
+ * Remove a key:
+ *
+ * args:
+ *      @sc:    pointer to store
+ *      @key:   nul terminated key
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ENOENT if the key is missing,
+ *                      EAGAIN if another writer held its slot too long)
+ */
+extern int shm_cache_del(struct shm_cache *sc, const char *key);
+
+/**
+ * Unmap a store (from this process only, others keep their mapping):
+ *
+ * args:
+ *      @scp:   pointer to pointer to store
+ */
+extern void shm_cache_free(struct shm_cache **scp);
+
+#endif
@@ -0,0 +1,404 @@
+#include "uring.h"
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd,
+            unsigned to_submit,
+            unsigned min_complete,
+            unsigned flags,
+            void *arg,
+            size_t argsz)
+{
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, arg, argsz);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int
+uring_supported(void)
+{
+        static const unsigned char      ops[] = {
+                IORING_OP_ACCEPT,
+                IORING_OP_RECV,
+                IORING_OP_SEND,
+                IORING_OP_SENDMSG,
+                IORING_OP_SHUTDOWN,
+                IORING_OP_CLOSE,
+                IORING_OP_ASYNC_CANCEL,
+        };
+        struct io_uring_probe           *probe = NULL;
+        struct uring_bufs               bufs;
+        struct uring                    *ur = NULL;
+        size_t                          i;
+        int                             ok;
+
+        ur = uring_new(8);
+        if (ur == NULL)
+                return 0;
+
+        ok = 0;
+        if (!(ur->ur_features & IORING_FEAT_EXT_ARG))
+                goto free_ring;
+        if (!(ur->ur_features & IORING_FEAT_NODROP))
+                goto free_ring;
+
+        probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+        if (probe == NULL)
+                goto free_ring;
+        if (uring_register(ur->ur_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+                goto free_probe;
+
+        for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+                if (ops[i] > probe->last_op)
+                        goto free_probe;
+                if (!(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                        goto free_probe;
+        }
+
+        /* provided buffer rings came with multishot accept (5.19) */
+        if (uring_bufs_init(ur, &bufs, 0, 1, 64) < 0)
+                goto free_probe;
+        uring_bufs_destroy(ur, &bufs);
+        ok = 1;
+free_probe:
+        free(probe);
+free_ring:
+        (void)uring_free(&ur);
+        return ok;
+}
+
+struct uring *
+uring_new(unsigned entries)
+{
+        struct io_uring_params  params;
+        struct uring            *ur = NULL;
+        unsigned                *array = NULL;
+        unsigned                i;
+        int                     saved_errno;
+
+        ur = malloc(sizeof(*ur));
+        if (ur == NULL)
+                return NULL;
+
+        memset(&params, 0, sizeof(params));
+        ur->ur_fd = uring_setup(entries, &params);
+        if (ur->ur_fd < 0)
+                goto free_ur;
+
+        ur->ur_features = params.features;
+        ur->ur_sqringsize = params.sq_off.array +
+                            params.sq_entries * sizeof(unsigned);
+        ur->ur_cqringsize = params.cq_off.cqes +
+                            params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ur->ur_cqringsize > ur->ur_sqringsize)
+                        ur->ur_sqringsize = ur->ur_cqringsize;
+                ur->ur_cqringsize = ur->ur_sqringsize;
+        }
+
+        ur->ur_sqring = mmap(NULL, ur->ur_sqringsize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+                             IORING_OFF_SQ_RING);
+        if (ur->ur_sqring == MAP_FAILED)
+                goto close_fd;
+
+        ur->ur_cqring = ur->ur_sqring;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+                ur->ur_cqring = mmap(NULL, ur->ur_cqringsize,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+                                     IORING_OFF_CQ_RING);
+                if (ur->ur_cqring == MAP_FAILED)
+                        goto unmap_sqring;
+        }
+
+        ur->ur_sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+        ur->ur_sqes = mmap(NULL, ur->ur_sqessize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+                           IORING_OFF_SQES);
+        if (ur->ur_sqes == MAP_FAILED)
+                goto unmap_cqring;
+
+        ur->ur_sqhead = (unsigned *)((char *)ur->ur_sqring +
+                                     params.sq_off.head);
+        ur->ur_sqtail = (unsigned *)((char *)ur->ur_sqring +
+                                     params.sq_off.tail);
+        ur->ur_sqmask = *(unsigned *)((char *)ur->ur_sqring +
+                                      params.sq_off.ring_mask);
+        ur->ur_sqsize = params.sq_entries;
+        ur->ur_sqlocal = *ur->ur_sqtail;
+        ur->ur_cqhead = (unsigned *)((char *)ur->ur_cqring +
+                                     params.cq_off.head);
+        ur->ur_cqtail = (unsigned *)((char *)ur->ur_cqring +
+                                     params.cq_off.tail);
+        ur->ur_cqmask = *(unsigned *)((char *)ur->ur_cqring +
+                                      params.cq_off.ring_mask);
+        ur->ur_cqes = (struct io_uring_cqe *)((char *)ur->ur_cqring +
+                                              params.cq_off.cqes);
+
+        /* sqe i always lives in slot i, so the index array never changes */
+        array = (unsigned *)((char *)ur->ur_sqring + params.sq_off.array);
+        for (i = 0; i < params.sq_entries; ++i)
+                array[i] = i;
+
+        return ur;
+unmap_cqring:
+        if (ur->ur_cqring != ur->ur_sqring)
+                (void)munmap(ur->ur_cqring, ur->ur_cqringsize);
+unmap_sqring:
+        (void)munmap(ur->ur_sqring, ur->ur_sqringsize);
+close_fd:
+        saved_errno = errno;
+        (void)close(ur->ur_fd);
+        errno = saved_errno;
+free_ur:
+        free(ur);
+        return NULL;
+}
+
+static int uring_sanity(const struct uring *ur);
+static int uring_flush(struct uring *ur, unsigned wait, int timeout);
+
+struct io_uring_sqe *
+uring_sqe(struct uring *ur)
+{
+        struct io_uring_sqe     *sqe = NULL;
+        unsigned                head;
+
+        if (uring_sanity(ur) < 0)
+                return NULL;
+
+        head = __atomic_load_n(ur->ur_sqhead, __ATOMIC_ACQUIRE);
+        if (ur->ur_sqlocal - head == ur->ur_sqsize) {
+                if (uring_flush(ur, 0, 0) < 0)
+                        return NULL;
+                head = __atomic_load_n(ur->ur_sqhead, __ATOMIC_ACQUIRE);
+                if (ur->ur_sqlocal - head == ur->ur_sqsize) {
+                        errno = EBUSY;
+                        return NULL;
+                }
+        }
+
+        sqe = &ur->ur_sqes[ur->ur_sqlocal & ur->ur_sqmask];
+        ++ur->ur_sqlocal;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+}
+
+static int
+uring_sanity(const struct uring *ur)
+{
+        errno = EINVAL;
+        if (ur == NULL)
+                return -1;
+        if (ur->ur_fd < 0)
+                return -1;
+        if (ur->ur_sqes == NULL)
+                return -1;
+        if (ur->ur_cqes == NULL)
+                return -1;
+        errno = 0;
+        return 0;
+}
+
+static int
+uring_flush(struct uring *ur, unsigned wait, int timeout)
+{
+        struct io_uring_getevents_arg   arg;
+        struct __kernel_timespec        ts;
+        unsigned                        tosubmit;
+        unsigned                        flags;
+        void                            *argp = NULL;
+        size_t                          argsz;
+
+        tosubmit = ur->ur_sqlocal - *ur->ur_sqtail;
+        __atomic_store_n(ur->ur_sqtail, ur->ur_sqlocal, __ATOMIC_RELEASE);
+
+        flags = 0;
+        argsz = 0;
+        if (wait) {
+                flags |= IORING_ENTER_GETEVENTS;
+                if (timeout >= 0) {
+                        ts.tv_sec = timeout / 1000;
+                        ts.tv_nsec = (long long)timeout % 1000 * 1000000;
+                        memset(&arg, 0, sizeof(arg));
+                        arg.sigmask_sz = _NSIG / 8;
+                        arg.ts = (uintptr_t)&ts;
+                        argp = &arg;
+                        argsz = sizeof(arg);
+                        flags |= IORING_ENTER_EXT_ARG;
+                }
+        }
+
+        if (tosubmit == 0 && !wait)
+                return 0;
+
+        return uring_enter(ur->ur_fd, tosubmit, wait, flags, argp, argsz) < 0 ?
+               -1 : 0;
+}
+
+int
+uring_submit(struct uring *ur, int timeout)
+{
+        unsigned        wait;
+
+        if (uring_sanity(ur) < 0)
+                return -1;
+
+        /* completions already waiting: just hand over new entries */
+        wait = timeout != 0;
+        if (*ur->ur_cqhead != __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE))
+                wait = 0;
+
+        return uring_flush(ur, wait, timeout);
+}
+
+struct io_uring_cqe *
+uring_cqe(struct uring *ur)
+{
+        unsigned        head;
+
+        if (uring_sanity(ur) < 0)
+                return NULL;
+
+        head = *ur->ur_cqhead;
+        if (head == __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        return &ur->ur_cqes[head & ur->ur_cqmask];
+}
+
+void
+uring_cqe_seen(struct uring *ur)
+{
+        __atomic_store_n(ur->ur_cqhead, *ur->ur_cqhead + 1, __ATOMIC_RELEASE);
+}
+
+int
+uring_bufs_init(struct uring *ur,
+                struct uring_bufs *ub,
+                unsigned short bgid,
+                unsigned nbufs,
+                size_t bufsize)
+{
+        struct io_uring_buf_reg reg;
+        size_t                  ringsize;
+        unsigned                i;
+        int                     saved_errno;
+
+        if (uring_sanity(ur) < 0)
+                return -1;
+
+        if (nbufs == 0 || (nbufs & (nbufs - 1)) != 0 || nbufs > 32768) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        /* ring must be page aligned, mmap() takes care of that */
+        ringsize = nbufs * sizeof(struct io_uring_buf);
+        ub->ub_ring = mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ub->ub_ring == MAP_FAILED)
+                return -1;
+
+        ub->ub_mem = malloc(nbufs * bufsize);
+        if (ub->ub_mem == NULL)
+                goto unmap_ring;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uintptr_t)ub->ub_ring;
+        reg.ring_entries = nbufs;
+        reg.bgid = bgid;
+        if (uring_register(ur->ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                goto free_mem;
+
+        ub->ub_bufsize = bufsize;
+        ub->ub_nbufs = nbufs;
+        ub->ub_bgid = bgid;
+        ub->ub_tail = 0;
+        for (i = 0; i < nbufs; ++i)
+                uring_buf_recycle(ub, i);
+
+        return 0;
+free_mem:
+        free(ub->ub_mem);
+unmap_ring:
+        saved_errno = errno;
+        (void)munmap(ub->ub_ring, ringsize);
+        errno = saved_errno;
+        return -1;
+}
+
+char *
+uring_buf(struct uring_bufs *ub, unsigned short bid)
+{
+        return ub->ub_mem + (size_t)bid * ub->ub_bufsize;
+}
+
+void
+uring_buf_recycle(struct uring_bufs *ub, unsigned short bid)
+{
+        struct io_uring_buf     *buf = NULL;
+
+        buf = &ub->ub_ring->bufs[ub->ub_tail & (ub->ub_nbufs - 1)];
+        buf->addr = (uintptr_t)uring_buf(ub, bid);
+        buf->len = ub->ub_bufsize;
+        buf->bid = bid;
+        ++ub->ub_tail;
+        __atomic_store_n(&ub->ub_ring->tail, ub->ub_tail, __ATOMIC_RELEASE);
+}
+
+void
+uring_bufs_destroy(struct uring *ur, struct uring_bufs *ub)
+{
+        struct io_uring_buf_reg reg;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = ub->ub_bgid;
+        (void)uring_register(ur->ur_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        (void)munmap(ub->ub_ring, ub->ub_nbufs * sizeof(struct io_uring_buf));
+        free(ub->ub_mem);
+}
+
+int
+uring_free(struct uring **urp)
+{
+        struct uring    *ur = NULL;
+
+        if (urp == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ur = *urp;
+        if (uring_sanity(ur) < 0)
+                return -1;
+
+        (void)munmap(ur->ur_sqes, ur->ur_sqessize);
+        if (ur->ur_cqring != ur->ur_sqring)
+                (void)munmap(ur->ur_cqring, ur->ur_cqringsize);
+        (void)munmap(ur->ur_sqring, ur->ur_sqringsize);
+        if (close(ur->ur_fd) < 0)
+                return -1;
+
+        free(ur);
+        *urp = NULL;
+        return 0;
+}
@@ -0,0 +1,186 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+
+/* io_uring instance driven through the raw system calls */
+struct uring {
+        /* submission queue head (advanced by kernel) */
+        unsigned                *ur_sqhead;
+        /* submission queue tail (advanced by us) */
+        unsigned                *ur_sqtail;
+        /* submission queue entries */
+        struct io_uring_sqe     *ur_sqes;
+        /* number of submission queue entries - 1 */
+        unsigned                ur_sqmask;
+        /* number of submission queue entries */
+        unsigned                ur_sqsize;
+        /* tail including entries not yet handed to the kernel */
+        unsigned                ur_sqlocal;
+        /* completion queue head (advanced by us) */
+        unsigned                *ur_cqhead;
+        /* completion queue tail (advanced by kernel) */
+        unsigned                *ur_cqtail;
+        /* completion queue entries */
+        struct io_uring_cqe     *ur_cqes;
+        /* number of completion queue entries - 1 */
+        unsigned                ur_cqmask;
+        /* mapped submission queue ring */
+        void                    *ur_sqring;
+        /* size of ur_sqring */
+        size_t                  ur_sqringsize;
+        /* mapped completion queue ring (may be ur_sqring) */
+        void                    *ur_cqring;
+        /* size of ur_cqring */
+        size_t                  ur_cqringsize;
+        /* size of ur_sqes mapping */
+        size_t                  ur_sqessize;
+        /* IORING_FEAT_* reported by the kernel */
+        unsigned                ur_features;
+        /* io_uring file descriptor */
+        int                     ur_fd;
+};
+
+/* ring of provided buffers the kernel picks recv buffers from */
+struct uring_bufs {
+        /* ring shared with the kernel */
+        struct io_uring_buf_ring        *ub_ring;
+        /* buffer memory (ub_nbufs * ub_bufsize bytes) */
+        char                            *ub_mem;
+        /* size of each buffer */
+        size_t                          ub_bufsize;
+        /* number of buffers (a power of two) */
+        unsigned                        ub_nbufs;
+        /* next free slot in ub_ring */
+        unsigned short                  ub_tail;
+        /* buffer group id used in sqe->buf_group */
+        unsigned short                  ub_bgid;
+};
+
+/**
+ * Check whether the kernel supports everything the io_uring event loop
+ * needs (accept, recv, send, sendmsg, shutdown, close, cancel, provided
+ * buffer rings and timed waits):
+ *
+ * ret:
+ *      @success:       1
+ *      @failure:       0
+ */
+extern int uring_supported(void);
+
+/**
+ * Create a new io_uring:
+ *
+ * args:
+ *      @entries:       number of submission queue entries
+ * ret:
+ *      @success:       pointer to uring
+ *      @failure:       NULL and errno set
+ */
+extern struct uring *uring_new(unsigned entries);
+
+/**
+ * Get a zeroed submission queue entry (submitting queued entries first
+ * if the queue is full):
+ *
+ * args:
+ *      @ur:    pointer to uring
+ * ret:
+ *      @success:       pointer to sqe
+ *      @failure:       NULL and errno set
+ */
+extern struct io_uring_sqe *uring_sqe(struct uring *ur);
+
+/**
+ * Submit queued entries and wait for at least one completion:
+ *
+ * args:
+ *      @ur:            pointer to uring
+ *      @timeout:       milliseconds to wait (-1 forever, 0 not at all)
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set (ETIME on timeout)
+ */
+extern int uring_submit(struct uring *ur, int timeout);
+
+/**
+ * Get next completion without waiting:
+ *
+ * args:
+ *      @ur:    pointer to uring
+ * ret:
+ *      @success:       pointer to cqe (release it with uring_cqe_seen())
+ *      @failure:       NULL if completion queue is empty
+ */
+extern struct io_uring_cqe *uring_cqe(struct uring *ur);
+
+/**
+ * Hand completion returned by uring_cqe() back to the kernel:
+ *
+ * args:
+ *      @ur:    pointer to uring
+ */
+extern void uring_cqe_seen(struct uring *ur);
+
+/**
+ * Register a ring of provided buffers:
+ *
+ * args:
+ *      @ur:            pointer to uring
+ *      @ub:            buffer ring to initialize
+ *      @bgid:          buffer group id
+ *      @nbufs:         number of buffers (a power of two)
+ *      @bufsize:       size of each buffer
+ * ret:
+ *      @success:       0
+ *      @failure:       -1 and errno set
+ */
+extern int uring_bufs_init(struct uring *ur,
+                           struct uring_bufs *ub,
+                           unsigned short bgid,
+                           unsigned nbufs,
+                           size_t bufsize);
+
+/**
+ * Address of provided buffer:
+ *
+ * args:
+ *      @ub:    pointer to buffer ring
+ *      @bid:   buffer id from cqe->flags
+ * ret:
+ *      pointer to buffer
+ */
+extern char *uring_buf(struct uring_bufs *ub, unsigned short bid);
+
+/**
+ * Give a provided buffer back to the kernel:
+ *
+ * args:
+ *      @ub:    pointer to buffer ring
+ *      @bid:   buffer id
+ */
+extern void uring_buf_recycle(struct uring_bufs *ub, unsigned short bid);
+
+/**
+ * Unregister and free a ring of provided buffers:
+ *
+ * args:
+ *      @ur:    pointer to uring
+ *      @ub:    pointer to buffer ring
+ */
+extern void uring_bufs_destroy(struct uring *ur, struct uring_bufs *ub);
+
+/**
+ * Free an io_uring:
+ *
+ * args:
+ *      @urp:   pointer to pointer to uring
+ * ret:
+ *      @success:       0 and *urp set to NULL
+ *      @failure:       -1 and errno set
+ */
+extern int uring_free(struct uring **urp);
+
+#endif